@@ -0,0 +1,75 @@
+/*
+ MqttBlockPool.cpp - Fixed-size block allocator for PubSubClient's buffers.
+*/
+
+#include "MqttBlockPool.h"
+
+MqttBlockPool::MqttBlockPool() {
+    this->memory = NULL;
+    this->blockSize = 0;
+    this->blocks = 0;
+    this->used = 0;
+}
+
+MqttBlockPool::~MqttBlockPool() {
+    end();
+}
+
+boolean MqttBlockPool::begin(uint16_t blockSize, uint8_t blocks) {
+    if (blockSize == 0 || blocks == 0 || blocks > MQTT_BLOCK_POOL_MAX_BLOCKS) {
+        return false;
+    }
+    uint8_t* memory = (uint8_t*)malloc((size_t)blockSize*blocks);
+    if (memory == NULL) {
+        return false;
+    }
+    free(this->memory);
+    this->memory = memory;
+    this->blockSize = blockSize;
+    this->blocks = blocks;
+    this->used = 0;
+    return true;
+}
+
+void MqttBlockPool::end() {
+    free(this->memory);
+    this->memory = NULL;
+    this->blockSize = 0;
+    this->blocks = 0;
+    this->used = 0;
+}
+
+uint8_t* MqttBlockPool::take() {
+    for (uint8_t i = 0; i < this->blocks; i++) {
+        uint32_t bit = 1UL << i;
+        if (!(this->used & bit)) {
+            this->used |= bit;
+            return this->memory+(size_t)i*this->blockSize;
+        }
+    }
+    return NULL;
+}
+
+void MqttBlockPool::give(uint8_t* block) {
+    if (block == NULL || block < this->memory) {
+        return;
+    }
+    size_t i = (block-this->memory)/this->blockSize;
+    if (i < this->blocks) {
+        this->used &= ~(1UL << i);
+    }
+}
+
+uint16_t MqttBlockPool::getBlockSize() {
+    return this->blockSize;
+}
+
+uint8_t MqttBlockPool::available() {
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < this->blocks; i++) {
+        if (!(this->used & (1UL << i))) {
+            n++;
+        }
+    }
+    return n;
+}
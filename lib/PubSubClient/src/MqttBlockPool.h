@@ -0,0 +1,41 @@
+/*
+ MqttBlockPool.h - Fixed-size block allocator for PubSubClient's buffers.
+*/
+
+#ifndef MqttBlockPool_h
+#define MqttBlockPool_h
+
+#include <Arduino.h>
+
+// Largest number of blocks in one pool
+#define MQTT_BLOCK_POOL_MAX_BLOCKS 32
+
+// Hands out equal-sized blocks carved from a single allocation made by
+// begin(). Taking and giving back blocks never touches the heap, so once the
+// pool is set up memory use is fixed and cannot fragment.
+class MqttBlockPool {
+private:
+   uint8_t* memory;
+   uint16_t blockSize;
+   uint8_t blocks;
+   uint32_t used;                    // one bit per block
+public:
+   MqttBlockPool();
+   ~MqttBlockPool();
+
+   // Allocates blocks of blockSize bytes, replacing any earlier allocation
+   // (every block taken from it must have been given back). Returns false,
+   // leaving the pool as it was, if there is not enough memory or too many
+   // blocks are asked for
+   boolean begin(uint16_t blockSize, uint8_t blocks);
+   // Frees the memory
+   void end();
+   // Returns a free block, or NULL if there is none
+   uint8_t* take();
+   void give(uint8_t* block);
+   uint16_t getBlockSize();
+   // Number of free blocks
+   uint8_t available();
+};
+
+#endif
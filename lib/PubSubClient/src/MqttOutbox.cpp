@@ -0,0 +1,196 @@
+/*
+ MqttOutbox.cpp - Store-and-forward queue of outbound messages for PubSubClient.
+*/
+
+#include "MqttOutbox.h"
+
+// Each record is [flags][topic]['\0'][payload], where flags holds the QoS in
+// bits 0-1 and the retained flag in bit 2. In the RAM ring every record is
+// preceded by its 2-byte length; a length of 0 marks the point where the ring
+// wraps back to the start.
+
+#define MQTT_OUTBOX_RETAIN 0x04
+
+MqttOutbox::MqttOutbox() {
+    this->storage = NULL;
+    this->ramHead = 0;
+    this->ramTail = 0;
+    this->ramCount = 0;
+    this->lastDrain = 0;
+    setDrainRate(MQTT_OUTBOX_BATCH, MQTT_OUTBOX_INTERVAL);
+}
+
+MqttOutbox::MqttOutbox(MqttOutboxStorage& storage) {
+    this->ramHead = 0;
+    this->ramTail = 0;
+    this->ramCount = 0;
+    this->lastDrain = 0;
+    setStorage(storage);
+    setDrainRate(MQTT_OUTBOX_BATCH, MQTT_OUTBOX_INTERVAL);
+}
+
+MqttOutbox& MqttOutbox::setStorage(MqttOutboxStorage& storage) {
+    this->storage = &storage;
+    return *this;
+}
+
+MqttOutbox& MqttOutbox::setDrainRate(uint8_t batch, uint16_t interval) {
+    this->batch = batch;
+    this->interval = interval;
+    return *this;
+}
+
+uint8_t* MqttOutbox::reserve(uint16_t length) {
+    uint16_t needed = length+2;
+    if (this->ramCount == 0) {
+        this->ramHead = this->ramTail = 0;
+    }
+    if (this->ramTail > this->ramHead || this->ramCount == 0) {
+        // Free space is from the tail to the end, then from the start to the head
+        if (MQTT_OUTBOX_RAM_SIZE-this->ramTail < needed) {
+            if (needed > this->ramHead) {
+                return NULL;
+            }
+            if (MQTT_OUTBOX_RAM_SIZE-this->ramTail >= 2) {
+                this->ram[this->ramTail] = 0;
+                this->ram[this->ramTail+1] = 0;
+            }
+            this->ramTail = 0;
+        }
+    } else if (this->ramHead-this->ramTail < needed) {
+        return NULL;
+    }
+    uint8_t* rec = this->ram+this->ramTail;
+    rec[0] = (length >> 8);
+    rec[1] = (length & 0xFF);
+    this->ramTail += needed;
+    this->ramCount++;
+    return rec+2;
+}
+
+const uint8_t* MqttOutbox::front(uint16_t* length) {
+    if (this->ramCount == 0) {
+        return NULL;
+    }
+    *length = (this->ram[this->ramHead]<<8)+this->ram[this->ramHead+1];
+    return this->ram+this->ramHead+2;
+}
+
+void MqttOutbox::popFront() {
+    uint16_t length;
+    if (front(&length) == NULL) {
+        return;
+    }
+    this->ramHead += length+2;
+    this->ramCount--;
+    // Keep the head on a real record so reserve() never writes over a wrap marker
+    if (this->ramCount > 0 && (MQTT_OUTBOX_RAM_SIZE-this->ramHead < 2 ||
+        (this->ram[this->ramHead] == 0 && this->ram[this->ramHead+1] == 0))) {
+        this->ramHead = 0;
+    }
+}
+
+boolean MqttOutbox::push(const char* topic, const uint8_t* payload, uint16_t plength, uint8_t qos, boolean retained) {
+    if (topic == NULL || qos > 2) {
+        return false;
+    }
+    size_t tlen = strlen(topic);
+    uint32_t length = 1+tlen+1+plength;
+    if (length > MQTT_OUTBOX_RECORD_SIZE) {
+        // Too long
+        return false;
+    }
+    uint8_t* rec = reserve(length);
+    if (rec == NULL) {
+        // RAM is full - move it all to storage, oldest first, and start again
+        if (!spill() || (rec = reserve(length)) == NULL) {
+            return false;
+        }
+    }
+    rec[0] = qos;
+    if (retained) {
+        rec[0] |= MQTT_OUTBOX_RETAIN;
+    }
+    memcpy(rec+1,topic,tlen+1);
+    memcpy(rec+2+tlen,payload,plength);
+    return true;
+}
+
+boolean MqttOutbox::spill() {
+    if (this->storage == NULL) {
+        return false;
+    }
+    const uint8_t* rec;
+    uint16_t length;
+    while ((rec = front(&length)) != NULL) {
+        if (!this->storage->append(rec,length)) {
+            return false;
+        }
+        popFront();
+    }
+    return true;
+}
+
+uint8_t MqttOutbox::drain(PubSubClient& client, uint8_t max) {
+    uint8_t sent = 0;
+    while (sent < max && client.connected()) {
+        // Storage always holds the oldest messages
+        boolean stored = (this->storage && this->storage->count() > 0);
+        const uint8_t* rec;
+        uint16_t length;
+        if (stored) {
+            length = this->storage->peek(this->record,sizeof(this->record));
+            if (length == 0) {
+                // Unreadable - skip it rather than block everything behind it
+                this->storage->pop();
+                continue;
+            }
+            rec = this->record;
+        } else if ((rec = front(&length)) == NULL) {
+            break;
+        }
+        uint8_t qos = rec[0]&0x03;
+        const char* topic = (const char*)rec+1;
+        uint16_t tlen = strnlen(topic,length-1);
+        if (tlen+2 > length) {
+            // Corrupt record
+            if (stored) {
+                this->storage->pop();
+            } else {
+                popFront();
+            }
+            continue;
+        }
+        if (qos > 0 && client.getMaxInflight() > 1 && client.getInflightCount()+1 >= client.getMaxInflight()) {
+            // Leave the last in-flight slot for live messages
+            break;
+        }
+        if (!client.publish(topic,rec+tlen+2,length-tlen-2,qos,(rec[0]&MQTT_OUTBOX_RETAIN) != 0)) {
+            break;
+        }
+        if (stored) {
+            this->storage->pop();
+        } else {
+            popFront();
+        }
+        sent++;
+    }
+    return sent;
+}
+
+uint8_t MqttOutbox::loop(PubSubClient& client) {
+    unsigned long t = millis();
+    if (t-this->lastDrain < this->interval || count() == 0 || !client.connected()) {
+        return 0;
+    }
+    this->lastDrain = t;
+    return drain(client,this->batch);
+}
+
+uint16_t MqttOutbox::count() {
+    uint16_t n = this->ramCount;
+    if (this->storage) {
+        n += this->storage->count();
+    }
+    return n;
+}
@@ -0,0 +1,95 @@
+/*
+ MqttOutbox.h - Store-and-forward queue of outbound messages for PubSubClient.
+*/
+
+#ifndef MqttOutbox_h
+#define MqttOutbox_h
+
+#include <Arduino.h>
+#include "PubSubClient.h"
+
+// MQTT_OUTBOX_RAM_SIZE : bytes of RAM used to queue messages before they are
+//  spilled to storage. Each message takes its topic, payload and 4 bytes.
+#ifndef MQTT_OUTBOX_RAM_SIZE
+#define MQTT_OUTBOX_RAM_SIZE 1024
+#endif
+
+// MQTT_OUTBOX_RECORD_SIZE : largest queued message (topic + payload + 2 bytes).
+//  Messages read back from storage are copied into a buffer of this size.
+#ifndef MQTT_OUTBOX_RECORD_SIZE
+#define MQTT_OUTBOX_RECORD_SIZE 256
+#endif
+
+// MQTT_OUTBOX_BATCH : messages published per drain step. Override with setDrainRate()
+#ifndef MQTT_OUTBOX_BATCH
+#define MQTT_OUTBOX_BATCH 4
+#endif
+
+// MQTT_OUTBOX_INTERVAL : time in milliseconds between drain steps. Override with setDrainRate()
+#ifndef MQTT_OUTBOX_INTERVAL
+#define MQTT_OUTBOX_INTERVAL 250
+#endif
+
+// A persistent log of queued messages, oldest first. Records are opaque byte
+// strings; an implementation only has to keep them in order.
+class MqttOutboxStorage {
+public:
+   virtual ~MqttOutboxStorage() {}
+   // Adds a record to the end of the log. Returns false if the log is full
+   virtual boolean append(const uint8_t* data, uint16_t length) = 0;
+   // Copies the oldest record into data. Returns its length, or 0 if the log
+   // is empty or the record does not fit in size bytes
+   virtual uint16_t peek(uint8_t* data, uint16_t size) = 0;
+   // Removes the oldest record
+   virtual void pop() = 0;
+   virtual uint16_t count() = 0;
+};
+
+// Holds messages that could not be published (typically while the client is
+// disconnected) and publishes them, oldest first, once it is connected again.
+//
+// Messages are queued in a RAM ring buffer. When the ring is full its contents
+// are moved to the storage log, so the log only ever holds messages older than
+// those in RAM and flash is written in batches rather than once per message.
+// Messages are only removed once PubSubClient has accepted them.
+class MqttOutbox {
+private:
+   MqttOutboxStorage* storage;
+   uint8_t ram[MQTT_OUTBOX_RAM_SIZE];
+   uint16_t ramHead;
+   uint16_t ramTail;
+   uint16_t ramCount;
+   uint8_t record[MQTT_OUTBOX_RECORD_SIZE];
+   uint8_t batch;
+   uint16_t interval;
+   unsigned long lastDrain;
+
+   uint8_t* reserve(uint16_t length);
+   const uint8_t* front(uint16_t* length);
+   void popFront();
+public:
+   MqttOutbox();
+   MqttOutbox(MqttOutboxStorage& storage);
+
+   MqttOutbox& setStorage(MqttOutboxStorage& storage);
+   // Publish at most batch messages every interval milliseconds from loop()
+   MqttOutbox& setDrainRate(uint8_t batch, uint16_t interval);
+
+   // Queues a message. Returns false if it is too big or there is no room
+   // left in RAM or storage
+   boolean push(const char* topic, const uint8_t* payload, uint16_t plength, uint8_t qos, boolean retained);
+   // Moves every message held in RAM to storage. Returns false if there is no
+   // storage or it fills up
+   boolean spill();
+   // Publishes up to max queued messages. Stops early if a publish fails and,
+   // for QoS 1 and 2 messages, when only one in-flight slot is left (with a
+   // window of more than one) so that live traffic is never starved.
+   // Returns the number of messages published
+   uint8_t drain(PubSubClient& client, uint8_t max);
+   // Call regularly: drains one batch when connected and the interval has passed
+   uint8_t loop(PubSubClient& client);
+   // Number of messages queued in RAM and storage
+   uint16_t count();
+};
+
+#endif
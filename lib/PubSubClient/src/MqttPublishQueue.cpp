@@ -0,0 +1,105 @@
+/*
+ MqttPublishQueue.cpp - Lock-free queue for publishing from several tasks.
+*/
+
+#include "MqttPublishQueue.h"
+
+#ifndef __AVR__
+
+// A bounded queue in the style of Vyukov's: every slot carries a sequence
+// number. A slot whose sequence equals the enqueue position is free for that
+// position, one past it is ready to be published, and once published it is
+// advanced a whole lap so it is free again for the position
+// MQTT_PUBLISH_QUEUE_SLOTS later.
+
+#define MQTT_PUBLISH_QUEUE_MASK (MQTT_PUBLISH_QUEUE_SLOTS-1)
+#define MQTT_PUBLISH_QUEUE_RETAIN 0x04
+
+static_assert((MQTT_PUBLISH_QUEUE_SLOTS & MQTT_PUBLISH_QUEUE_MASK) == 0, "MQTT_PUBLISH_QUEUE_SLOTS must be a power of two");
+
+MqttPublishQueue::MqttPublishQueue() {
+    for (uint32_t i = 0; i < MQTT_PUBLISH_QUEUE_SLOTS; i++) {
+        this->slots[i].sequence.store(i,std::memory_order_relaxed);
+    }
+    this->enqueuePos.store(0,std::memory_order_relaxed);
+    this->dequeuePos = 0;
+    this->dropped.store(0,std::memory_order_relaxed);
+}
+
+boolean MqttPublishQueue::publish(const char* topic, const uint8_t* payload, uint16_t plength, uint8_t qos, boolean retained) {
+    if (topic == 0 || qos > 2) {
+        return false;
+    }
+    size_t tlen = strlen(topic);
+    if (tlen+1+plength > MQTT_PUBLISH_QUEUE_SLOT_SIZE) {
+        // Too long
+        return false;
+    }
+    Slot* slot;
+    uint32_t pos = this->enqueuePos.load(std::memory_order_relaxed);
+    for (;;) {
+        slot = &this->slots[pos & MQTT_PUBLISH_QUEUE_MASK];
+        int32_t diff = (int32_t)(slot->sequence.load(std::memory_order_acquire)-pos);
+        if (diff == 0) {
+            // Free: claim it, unless another producer got there first
+            if (this->enqueuePos.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Still holds the message from the previous lap: full
+            this->dropped.fetch_add(1,std::memory_order_relaxed);
+            return false;
+        } else {
+            // Claimed by another producer since pos was read
+            pos = this->enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+    memcpy(slot->data,topic,tlen+1);
+    memcpy(slot->data+tlen+1,payload,plength);
+    slot->plength = plength;
+    slot->flags = qos;
+    if (retained) {
+        slot->flags |= MQTT_PUBLISH_QUEUE_RETAIN;
+    }
+    // Publishes the contents to the draining task
+    slot->sequence.store(pos+1,std::memory_order_release);
+    return true;
+}
+
+boolean MqttPublishQueue::publish(const char* topic, const char* payload) {
+    return publish(topic,(const uint8_t*)payload,payload ? strnlen(payload, MQTT_PUBLISH_QUEUE_SLOT_SIZE) : 0,0,false);
+}
+
+boolean MqttPublishQueue::publish(const char* topic, const char* payload, boolean retained) {
+    return publish(topic,(const uint8_t*)payload,payload ? strnlen(payload, MQTT_PUBLISH_QUEUE_SLOT_SIZE) : 0,0,retained);
+}
+
+uint8_t MqttPublishQueue::drain(PubSubClient& client) {
+    uint8_t sent = 0;
+    while (sent < MQTT_PUBLISH_QUEUE_SLOTS) {
+        Slot* slot = &this->slots[this->dequeuePos & MQTT_PUBLISH_QUEUE_MASK];
+        if (slot->sequence.load(std::memory_order_acquire) != this->dequeuePos+1) {
+            // Empty, or the producer has not finished writing it
+            break;
+        }
+        const char* topic = (const char*)slot->data;
+        size_t tlen = strlen(topic);
+        if (!client.publish(topic,slot->data+tlen+1,slot->plength,slot->flags&0x03,(slot->flags&MQTT_PUBLISH_QUEUE_RETAIN) != 0)) {
+            break;
+        }
+        slot->sequence.store(this->dequeuePos+MQTT_PUBLISH_QUEUE_SLOTS,std::memory_order_release);
+        this->dequeuePos++;
+        sent++;
+    }
+    return sent;
+}
+
+uint16_t MqttPublishQueue::count() {
+    return this->enqueuePos.load(std::memory_order_relaxed)-this->dequeuePos;
+}
+
+uint32_t MqttPublishQueue::getDropped() {
+    return this->dropped.load(std::memory_order_relaxed);
+}
+
+#endif
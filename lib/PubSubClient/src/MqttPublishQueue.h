@@ -0,0 +1,70 @@
+/*
+ MqttPublishQueue.h - Lock-free queue for publishing from several tasks.
+*/
+
+#ifndef MqttPublishQueue_h
+#define MqttPublishQueue_h
+
+// Needs <atomic>, which avr-gcc does not provide
+#ifndef __AVR__
+
+#include <Arduino.h>
+#include <atomic>
+#include "PubSubClient.h"
+
+// MQTT_PUBLISH_QUEUE_SLOTS : number of messages that can wait to be published.
+//  Must be a power of two.
+#ifndef MQTT_PUBLISH_QUEUE_SLOTS
+#define MQTT_PUBLISH_QUEUE_SLOTS 8
+#endif
+
+// MQTT_PUBLISH_QUEUE_SLOT_SIZE : largest queued message (topic + payload + 1 byte)
+#ifndef MQTT_PUBLISH_QUEUE_SLOT_SIZE
+#define MQTT_PUBLISH_QUEUE_SLOT_SIZE 128
+#endif
+
+// Lets any task queue a message for the task that owns the PubSubClient,
+// which publishes them from drain().
+//
+// PubSubClient itself is not re-entrant, so everything else must happen on the
+// task that calls its loop(). Producers claim a preallocated slot with a
+// compare-and-swap on the enqueue position and mark it ready with a release
+// store of its sequence number; they never block, take a lock or touch the
+// socket, and a full queue fails the publish straight away. Slots are handed
+// over in the order they were claimed, so a producer that is preempted while
+// copying holds back the messages queued after it until it finishes.
+class MqttPublishQueue {
+private:
+   struct Slot {
+      std::atomic<uint32_t> sequence;
+      uint16_t plength;
+      uint8_t flags;
+      // topic, '\0', payload
+      uint8_t data[MQTT_PUBLISH_QUEUE_SLOT_SIZE];
+   };
+   Slot slots[MQTT_PUBLISH_QUEUE_SLOTS];
+   std::atomic<uint32_t> enqueuePos;
+   uint32_t dequeuePos;
+   std::atomic<uint32_t> dropped;
+public:
+   MqttPublishQueue();
+
+   // Queues a message. Safe to call from any task. Returns false if it is too
+   // big or the queue is full
+   boolean publish(const char* topic, const uint8_t* payload, uint16_t plength, uint8_t qos, boolean retained);
+   boolean publish(const char* topic, const char* payload);
+   boolean publish(const char* topic, const char* payload, boolean retained);
+
+   // Publishes queued messages, oldest first, until the queue is empty or the
+   // client refuses one, which is left queued. Only call from the task that
+   // owns the client. Returns the number of messages published
+   uint8_t drain(PubSubClient& client);
+   // Number of messages waiting. Exact only on the draining task
+   uint16_t count();
+   // Number of messages refused because the queue was full
+   uint32_t getDropped();
+};
+
+#endif
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ MqttRouter.cpp - Topic filter to handler dispatch for PubSubClient.
+*/
+
+#include "MqttRouter.h"
+
+MqttRouter::MqttRouter() {
+    clear();
+}
+
+void MqttRouter::clear() {
+    for (uint8_t i = 0; i < MQTT_ROUTER_EDGE_SLOTS; i++) {
+        this->edges[i].child = 0;
+    }
+    this->nodeCount = 0;
+    newNode(MQTT_ROUTER_NONE, NULL, 0); // root
+}
+
+uint32_t MqttRouter::hashLevel(uint8_t parent, const char* level, uint16_t length) {
+    // FNV-1a over the parent index and the level
+    uint32_t h = 2166136261UL;
+    h = (h ^ parent) * 16777619UL;
+    for (uint16_t i = 0; i < length; i++) {
+        h = (h ^ (uint8_t)level[i]) * 16777619UL;
+    }
+    return h;
+}
+
+uint8_t MqttRouter::newNode(uint8_t parent, const char* level, uint16_t length) {
+    if (this->nodeCount >= MQTT_ROUTER_MAX_NODES) {
+        return MQTT_ROUTER_NONE;
+    }
+    Node* node = &this->nodes[this->nodeCount];
+    node->handler = NULL;
+    node->hashHandler = NULL;
+    node->level = level;
+    node->levelLength = length;
+    node->parent = parent;
+    node->plus = MQTT_ROUTER_NONE;
+    return this->nodeCount++;
+}
+
+uint8_t MqttRouter::findChild(uint8_t parent, const char* level, uint16_t length) {
+    uint32_t h = hashLevel(parent, level, length);
+    uint16_t slot = h & (MQTT_ROUTER_EDGE_SLOTS-1);
+    for (uint16_t probe = 0; probe < MQTT_ROUTER_EDGE_SLOTS; probe++) {
+        Edge* edge = &this->edges[slot];
+        if (edge->child == 0) {
+            return MQTT_ROUTER_NONE;
+        }
+        if (edge->hash == h) {
+            Node* node = &this->nodes[edge->child];
+            if (node->parent == parent && node->levelLength == length && memcmp(node->level, level, length) == 0) {
+                return edge->child;
+            }
+        }
+        slot = (slot+1) & (MQTT_ROUTER_EDGE_SLOTS-1);
+    }
+    return MQTT_ROUTER_NONE;
+}
+
+uint8_t MqttRouter::addChild(uint8_t parent, const char* level, uint16_t length) {
+    uint32_t h = hashLevel(parent, level, length);
+    uint16_t slot = h & (MQTT_ROUTER_EDGE_SLOTS-1);
+    for (uint16_t probe = 0; probe < MQTT_ROUTER_EDGE_SLOTS; probe++) {
+        if (this->edges[slot].child == 0) {
+            uint8_t child = newNode(parent, level, length);
+            if (child != MQTT_ROUTER_NONE) {
+                this->edges[slot].hash = h;
+                this->edges[slot].child = child;
+            }
+            return child;
+        }
+        slot = (slot+1) & (MQTT_ROUTER_EDGE_SLOTS-1);
+    }
+    return MQTT_ROUTER_NONE;
+}
+
+boolean MqttRouter::add(const char* filter, MQTT_HANDLER_SIGNATURE) {
+    if (filter == NULL || handler == NULL) {
+        return false;
+    }
+    uint8_t node = 0;
+    const char* level = filter;
+    while (true) {
+        const char* end = level;
+        while (*end && *end != '/') {
+            end++;
+        }
+        uint16_t length = end-level;
+        if (length == 1 && *level == '#') {
+            if (*end) {
+                // '#' must be the last level
+                return false;
+            }
+            this->nodes[node].hashHandler = handler;
+            return true;
+        }
+        if (memchr(level, '#', length) || (length > 1 && memchr(level, '+', length))) {
+            // Wildcards must occupy a whole level
+            return false;
+        }
+        uint8_t child;
+        if (length == 1 && *level == '+') {
+            child = this->nodes[node].plus;
+            if (child == MQTT_ROUTER_NONE) {
+                child = newNode(node, level, length);
+                this->nodes[node].plus = child;
+            }
+        } else {
+            child = findChild(node, level, length);
+            if (child == MQTT_ROUTER_NONE) {
+                child = addChild(node, level, length);
+            }
+        }
+        if (child == MQTT_ROUTER_NONE) {
+            // Out of nodes
+            return false;
+        }
+        node = child;
+        if (!*end) {
+            break;
+        }
+        level = end+1;
+    }
+    this->nodes[node].handler = handler;
+    return true;
+}
+
+boolean MqttRouter::remove(const char* filter) {
+    if (filter == NULL) {
+        return false;
+    }
+    uint8_t node = 0;
+    const char* level = filter;
+    while (true) {
+        const char* end = level;
+        while (*end && *end != '/') {
+            end++;
+        }
+        uint16_t length = end-level;
+        if (length == 1 && *level == '#' && !*end) {
+            boolean found = (this->nodes[node].hashHandler != NULL);
+            this->nodes[node].hashHandler = NULL;
+            return found;
+        }
+        if (length == 1 && *level == '+') {
+            node = this->nodes[node].plus;
+        } else {
+            node = findChild(node, level, length);
+        }
+        if (node == MQTT_ROUTER_NONE) {
+            return false;
+        }
+        if (!*end) {
+            break;
+        }
+        level = end+1;
+    }
+    boolean found = (this->nodes[node].handler != NULL);
+    this->nodes[node].handler = NULL;
+    return found;
+}
+
+// Matches the topic levels from pos onwards against the subtree at node.
+// pos == length+1 once every level has been consumed.
+uint8_t MqttRouter::match(uint8_t node, const char* topic, uint16_t pos, uint16_t length, const uint8_t* payload, uint32_t plength) {
+    uint8_t called = 0;
+    // Wildcards at the first level do not match topics beginning with '$'
+    boolean wildcards = (node != 0 || length == 0 || topic[0] != '$');
+    Node* n = &this->nodes[node];
+    if (n->hashHandler && wildcards) {
+        // '#' also matches the parent level itself
+        n->hashHandler(topic, length, payload, plength);
+        called++;
+    }
+    if (pos > length) {
+        if (n->handler) {
+            n->handler(topic, length, payload, plength);
+            called++;
+        }
+        return called;
+    }
+    uint16_t end = pos;
+    while (end < length && topic[end] != '/') {
+        end++;
+    }
+    uint8_t child = findChild(node, topic+pos, end-pos);
+    if (child != MQTT_ROUTER_NONE) {
+        called += match(child, topic, end+1, length, payload, plength);
+    }
+    if (n->plus != MQTT_ROUTER_NONE && wildcards) {
+        called += match(n->plus, topic, end+1, length, payload, plength);
+    }
+    return called;
+}
+
+uint8_t MqttRouter::dispatch(const char* topic, uint16_t topicLength, const uint8_t* payload, uint32_t length) {
+    return match(0, topic, 0, topicLength, payload, length);
+}
@@ -0,0 +1,82 @@
+/*
+ MqttRouter.h - Topic filter to handler dispatch for PubSubClient.
+*/
+
+#ifndef MqttRouter_h
+#define MqttRouter_h
+
+#include <Arduino.h>
+
+// MQTT_ROUTER_MAX_NODES : number of trie nodes available for registered filters.
+//  Each distinct level of each filter (eg "auth", "door", "+") takes one node.
+#ifndef MQTT_ROUTER_MAX_NODES
+#define MQTT_ROUTER_MAX_NODES 32
+#endif
+
+// MQTT_ROUTER_EDGE_SLOTS : size of the hash table holding the trie's literal
+//  edges. Must be a power of two, larger than MQTT_ROUTER_MAX_NODES.
+#ifndef MQTT_ROUTER_EDGE_SLOTS
+#define MQTT_ROUTER_EDGE_SLOTS 64
+#endif
+
+#define MQTT_ROUTER_NONE 0xFF
+
+// Handlers take the same arguments as the view callback:
+//  (topic, topicLength, payload, payloadLength)
+#if defined(ESP8266) || defined(ESP32)
+#include <functional>
+typedef std::function<void(const char*, uint16_t, const uint8_t*, uint32_t)> MqttHandler;
+#else
+typedef void (*MqttHandler)(const char*, uint16_t, const uint8_t*, uint32_t);
+#endif
+#define MQTT_HANDLER_SIGNATURE MqttHandler handler
+
+// Dispatches messages to handlers registered against topic filters, including
+// the '+' and '#' wildcards.
+//
+// Filters are compiled into a trie whose literal edges live in a single hash
+// table keyed by (parent node, level), so matching a topic costs one hash probe
+// per topic level (plus one branch per matching '+') however many filters are
+// registered. All storage is fixed size; nothing is allocated after construction.
+//
+// The filter strings are not copied: they must remain valid for as long as
+// they are registered.
+class MqttRouter {
+private:
+   struct Node {
+      MqttHandler handler;           // filter ends at this node
+      MqttHandler hashHandler;       // filter ends at this node followed by '#'
+      const char* level;             // literal level, pointing into the filter
+      uint16_t levelLength;
+      uint8_t parent;
+      uint8_t plus;                  // child node for a '+' level
+   };
+   struct Edge {
+      uint32_t hash;
+      uint8_t child;                 // 0 if the slot is empty (the root is never a child)
+   };
+   Node nodes[MQTT_ROUTER_MAX_NODES];
+   Edge edges[MQTT_ROUTER_EDGE_SLOTS];
+   uint8_t nodeCount;
+
+   static uint32_t hashLevel(uint8_t parent, const char* level, uint16_t length);
+   uint8_t findChild(uint8_t parent, const char* level, uint16_t length);
+   uint8_t addChild(uint8_t parent, const char* level, uint16_t length);
+   uint8_t newNode(uint8_t parent, const char* level, uint16_t length);
+   uint8_t match(uint8_t node, const char* topic, uint16_t pos, uint16_t length, const uint8_t* payload, uint32_t plength);
+public:
+   MqttRouter();
+
+   // Registers handler for messages matching filter, replacing any existing
+   // handler for the same filter. Returns false if the filter is invalid or the
+   // trie is full.
+   boolean add(const char* filter, MQTT_HANDLER_SIGNATURE);
+   // Removes the handler registered for filter. Trie nodes are only reclaimed by clear()
+   boolean remove(const char* filter);
+   void clear();
+   // Calls every handler whose filter matches topic.
+   // Returns the number of handlers called
+   uint8_t dispatch(const char* topic, uint16_t topicLength, const uint8_t* payload, uint32_t length);
+};
+
+#endif
@@ -9,157 +9,135 @@
 #include "Arduino.h"
 
 PubSubClient::PubSubClient() {
-    this->_state = MQTT_DISCONNECTED;
-    this->_client = NULL;
-    this->stream = NULL;
-    setCallback(NULL);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+    init();
 }
 
 PubSubClient::PubSubClient(Client& client) {
-    this->_state = MQTT_DISCONNECTED;
+    init();
     setClient(client);
-    this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
 
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
+    init();
     setServer(addr, port);
     setClient(client);
-    this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
+
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
+    init();
     setServer(addr,port);
     setClient(client);
     setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
+
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
+    init();
     setServer(addr, port);
     setCallback(callback);
     setClient(client);
-    this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
+
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
+    init();
     setServer(addr,port);
     setCallback(callback);
     setClient(client);
     setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
 
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
+    init();
     setServer(ip, port);
     setClient(client);
-    this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
+
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
+    init();
     setServer(ip,port);
     setClient(client);
     setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
+
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
+    init();
     setServer(ip, port);
     setCallback(callback);
     setClient(client);
-    this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
+
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
+    init();
     setServer(ip,port);
     setCallback(callback);
     setClient(client);
     setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
 
 PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
+    init();
     setServer(domain,port);
     setClient(client);
-    this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
+
 PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
+    init();
     setServer(domain,port);
     setClient(client);
     setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
+
 PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
+    init();
     setServer(domain,port);
     setCallback(callback);
     setClient(client);
-    this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
+
 PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
+    init();
     setServer(domain,port);
     setCallback(callback);
     setClient(client);
     setStream(stream);
+}
+
+void PubSubClient::init() {
+    this->_state = MQTT_DISCONNECTED;
+    this->_client = NULL;
+    this->domain = NULL;
+    this->stream = NULL;
+    setCallback(NULL);
+    setViewCallback(NULL);
+    setChunkCallbacks(NULL,NULL,NULL);
+    setClock(NULL);
+    this->router = NULL;
+    this->inflight = NULL;
+    memset(this->incoming,0,sizeof(this->incoming));
+    this->txBuffer = NULL;
+    this->txLength = 0;
+    this->subscriptionTopicsLength = 0;
+    this->subscriptionCount = 0;
+    this->sessionStore = NULL;
+    this->sessionPresent = false;
+    this->reasonCode = 0;
+    this->connectPhase = MQTT_PHASE_IDLE;
+    this->connectBackoff = 0;
+    this->connectFailures = 0;
     this->bufferSize = 0;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+    setRetryTimeout(MQTT_RETRY_TIMEOUT);
+    setMaxInflight(MQTT_MAX_INFLIGHT);
+    setTxBuffer(MQTT_TX_BUFFER_SIZE, MQTT_TX_DELAY);
+    setBackoff(MQTT_BACKOFF_MIN, MQTT_BACKOFF_MAX);
+    resetServerLimits();
 }
 
 PubSubClient::~PubSubClient() {
-  free(this->buffer);
+  free(this->inflight);
+  free(this->txBuffer);
+  delete this->router;
 }
 
 boolean PubSubClient::connect(const char *id) {
@@ -182,6 +160,8 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
     if (!connected()) {
         int result = 0;
 
+        // A blocking connect takes over from one started by beginConnect()
+        this->connectPhase = MQTT_PHASE_IDLE;
 
         if(_client->connected()) {
             result = 1;
@@ -194,86 +174,28 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
         }
 
         if (result == 1) {
-            nextMsgId = 1;
-            // Leave room in the buffer for header and variable length field
-            uint16_t length = MQTT_MAX_HEADER_SIZE;
-            unsigned int j;
-
-#if MQTT_VERSION == MQTT_VERSION_3_1
-            uint8_t d[9] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_VERSION};
-#define MQTT_HEADER_VERSION_LENGTH 9
-#elif MQTT_VERSION == MQTT_VERSION_3_1_1
-            uint8_t d[7] = {0x00,0x04,'M','Q','T','T',MQTT_VERSION};
-#define MQTT_HEADER_VERSION_LENGTH 7
-#endif
-            for (j = 0;j<MQTT_HEADER_VERSION_LENGTH;j++) {
-                this->buffer[length++] = d[j];
-            }
-
-            uint8_t v;
-            if (willTopic) {
-                v = 0x04|(willQos<<3)|(willRetain<<5);
-            } else {
-                v = 0x00;
-            }
-            if (cleanSession) {
-                v = v|0x02;
-            }
-
-            if(user != NULL) {
-                v = v|0x80;
-
-                if(pass != NULL) {
-                    v = v|(0x80>>1);
-                }
-            }
-            this->buffer[length++] = v;
-
-            this->buffer[length++] = ((this->keepAlive) >> 8);
-            this->buffer[length++] = ((this->keepAlive) & 0xFF);
-
-            CHECK_STRING_LENGTH(length,id)
-            length = writeString(id,this->buffer,length);
-            if (willTopic) {
-                CHECK_STRING_LENGTH(length,willTopic)
-                length = writeString(willTopic,this->buffer,length);
-                CHECK_STRING_LENGTH(length,willMessage)
-                length = writeString(willMessage,this->buffer,length);
+            if (!sendConnect(id,user,pass,willTopic,willQos,willRetain,willMessage,cleanSession)) {
+                return false;
             }
 
-            if(user != NULL) {
-                CHECK_STRING_LENGTH(length,user)
-                length = writeString(user,this->buffer,length);
-                if(pass != NULL) {
-                    CHECK_STRING_LENGTH(length,pass)
-                    length = writeString(pass,this->buffer,length);
+            uint8_t llen;
+            uint32_t len;
+            while ((len = readPacket(&llen)) == 0) {
+                if (!_client->connected()) {
+                    // readPacket has closed the connection
+                    return false;
                 }
-            }
-
-            write(MQTTCONNECT,this->buffer,length-MQTT_MAX_HEADER_SIZE);
-
-            lastInActivity = lastOutActivity = millis();
-
-            while (!_client->available()) {
-                unsigned long t = millis();
+                unsigned long t = now();
                 if (t-lastInActivity >= ((int32_t) this->socketTimeout*1000UL)) {
                     _state = MQTT_CONNECTION_TIMEOUT;
                     _client->stop();
                     return false;
                 }
+                yield();
             }
-            uint8_t llen;
-            uint32_t len = readPacket(&llen);
 
-            if (len == 4) {
-                if (buffer[3] == 0) {
-                    lastInActivity = millis();
-                    pingOutstanding = false;
-                    _state = MQTT_CONNECTED;
-                    return true;
-                } else {
-                    _state = buffer[3];
-                }
+            if (connack(llen,len)) {
+                return true;
             }
             _client->stop();
         } else {
@@ -284,161 +206,614 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
     return true;
 }
 
-// reads a byte into result
-boolean PubSubClient::readByte(uint8_t * result) {
-   uint32_t previousMillis = millis();
-   while(!_client->available()) {
-     yield();
-     uint32_t currentMillis = millis();
-     if(currentMillis - previousMillis >= ((int32_t) this->socketTimeout * 1000)){
-       return false;
-     }
-   }
-   *result = _client->read();
-   return true;
+boolean PubSubClient::sendConnect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
+    nextMsgId = 1;
+    resetPacket();
+    // Anything still buffered was meant for the old connection
+    this->txLength = 0;
+    resetServerLimits();
+    // Leave room in the buffer for header and variable length field
+    uint16_t length = MQTT_MAX_HEADER_SIZE;
+    unsigned int j;
+
+#if MQTT_VERSION == MQTT_VERSION_3_1
+    uint8_t d[9] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_VERSION};
+#define MQTT_HEADER_VERSION_LENGTH 9
+#elif MQTT_VERSION == MQTT_VERSION_3_1_1 || MQTT_VERSION == MQTT_VERSION_5
+    uint8_t d[7] = {0x00,0x04,'M','Q','T','T',MQTT_VERSION};
+#define MQTT_HEADER_VERSION_LENGTH 7
+#endif
+    for (j = 0;j<MQTT_HEADER_VERSION_LENGTH;j++) {
+        this->outBuffer[length++] = d[j];
+    }
+
+    uint8_t v;
+    if (willTopic) {
+        v = 0x04|(willQos<<3)|(willRetain<<5);
+    } else {
+        v = 0x00;
+    }
+    if (cleanSession) {
+        v = v|0x02;
+    }
+
+    if(user != NULL) {
+        v = v|0x80;
+
+        if(pass != NULL) {
+            v = v|(0x80>>1);
+        }
+    }
+    this->outBuffer[length++] = v;
+
+    this->outBuffer[length++] = ((this->keepAlive) >> 8);
+    this->outBuffer[length++] = ((this->keepAlive) & 0xFF);
+
+#if MQTT_VERSION == MQTT_VERSION_5
+    // Properties: how many QoS 1 and 2 messages the server may send at once
+    // and, unless larger ones can be streamed or chunked, the largest packet
+    // that fits in the buffer
+    uint16_t properties = length++;
+    this->outBuffer[length++] = MQTT_PROP_RECEIVE_MAXIMUM;
+    this->outBuffer[length++] = (MQTT_MAX_INCOMING_QOS2 >> 8);
+    this->outBuffer[length++] = (MQTT_MAX_INCOMING_QOS2 & 0xFF);
+    if (!this->stream && !this->chunkCallback) {
+        this->outBuffer[length++] = MQTT_PROP_MAXIMUM_PACKET_SIZE;
+        this->outBuffer[length++] = 0;
+        this->outBuffer[length++] = 0;
+        this->outBuffer[length++] = (this->bufferSize >> 8);
+        this->outBuffer[length++] = (this->bufferSize & 0xFF);
+    }
+    this->outBuffer[properties] = length-properties-1;
+#endif
+
+    CHECK_STRING_LENGTH(length,id)
+    length = writeString(id,this->outBuffer,length);
+    if (willTopic) {
+#if MQTT_VERSION == MQTT_VERSION_5
+        this->outBuffer[length++] = 0; // no will properties
+#endif
+        CHECK_STRING_LENGTH(length,willTopic)
+        length = writeString(willTopic,this->outBuffer,length);
+        CHECK_STRING_LENGTH(length,willMessage)
+        length = writeString(willMessage,this->outBuffer,length);
+    }
+
+    if(user != NULL) {
+        CHECK_STRING_LENGTH(length,user)
+        length = writeString(user,this->outBuffer,length);
+        if(pass != NULL) {
+            CHECK_STRING_LENGTH(length,pass)
+            length = writeString(pass,this->outBuffer,length);
+        }
+    }
+
+    write(MQTTCONNECT,this->outBuffer,length-MQTT_MAX_HEADER_SIZE);
+    flush();
+
+    lastInActivity = lastOutActivity = now();
+    return true;
+}
+
+boolean PubSubClient::connack(uint8_t llen, uint32_t len) {
+#if MQTT_VERSION == MQTT_VERSION_5
+    if ((buffer[0]&0xF0) != MQTTCONNACK || len < (uint32_t)llen+4) {
+        return false;
+    }
+    this->reasonCode = buffer[llen+2];
+    if (this->reasonCode != 0) {
+        _state = connectRefusedState(this->reasonCode);
+        return false;
+    }
+    uint32_t propertiesLength;
+    uint8_t n = readVarint(llen+3,len,&propertiesLength);
+    uint32_t pos = llen+3+n;
+    uint32_t end = pos+propertiesLength;
+    if (n == 0 || end > len) {
+        return false;
+    }
+    while (pos < end) {
+        uint8_t id;
+        uint32_t value;
+        pos = readProperty(pos,end,&id,&value);
+        if (pos == 0) {
+            return false;
+        }
+        if (id == MQTT_PROP_RECEIVE_MAXIMUM) {
+            this->serverReceiveMaximum = value;
+        } else if (id == MQTT_PROP_MAXIMUM_PACKET_SIZE) {
+            this->serverMaximumPacketSize = value;
+        } else if (id == MQTT_PROP_TOPIC_ALIAS_MAXIMUM) {
+            this->topicAliasMaximum = value;
+        } else if (id == MQTT_PROP_SERVER_KEEP_ALIVE) {
+            this->activeKeepAlive = value;
+        }
+    }
+#else
+    if (len != 4) {
+        return false;
+    }
+    if (buffer[3] != 0) {
+        _state = buffer[3];
+        return false;
+    }
+#endif
+    lastInActivity = now();
+    pingOutstanding = false;
+    _state = MQTT_CONNECTED;
+    this->sessionPresent = (buffer[llen+1] & 0x01) != 0;
+    for (uint8_t i = 0; i < this->subscriptionCount; i++) {
+        Subscription* sub = &this->subscriptions[i];
+        if (!this->sessionPresent) {
+            // A new session: subscribe to everything again
+            sub->status = MQTT_SUBACK_PENDING;
+            sub->msgId = 0;
+        } else if (sub->msgId != 0) {
+            // The server holds the rest; only a SUBSCRIBE that was
+            // never acknowledged may have been lost
+            sub->msgId = 0;
+        }
+    }
+    if (!this->sessionPresent) {
+        // Nor does the server remember any QoS 2 exchanges
+        memset(this->incoming,0,sizeof(this->incoming));
+    }
+    // Restore the subscriptions, then resend anything still waiting to be
+    // acknowledged as it may have been lost with the old connection
+    sendSubscriptions();
+    if (this->sessionPresent) {
+        resendInflight(lastInActivity,true);
+    } else {
+        replayInflight(lastInActivity);
+    }
+    return true;
+}
+
+boolean PubSubClient::beginConnect(const char *id) {
+    return beginConnect(id,NULL,NULL,0,0,0,0,1);
+}
+
+boolean PubSubClient::beginConnect(const char *id, const char *user, const char *pass) {
+    return beginConnect(id,user,pass,0,0,0,0,1);
 }
 
-// reads a byte into result[*index] and increments index
-boolean PubSubClient::readByte(uint8_t * result, uint16_t * index){
-  uint16_t current_index = *index;
-  uint8_t * write_address = &(result[current_index]);
-  if(readByte(write_address)){
-    *index = current_index + 1;
+boolean PubSubClient::beginConnect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
+    if (id == NULL) {
+        return false;
+    }
+    this->connectId = id;
+    this->connectUser = user;
+    this->connectPass = pass;
+    this->connectWillTopic = willTopic;
+    this->connectWillQos = willQos;
+    this->connectWillRetain = willRetain;
+    this->connectWillMessage = willMessage;
+    this->connectCleanSession = cleanSession;
+    this->connectBackoff = 0;
+    this->connectFailures = 0;
+    if (connected()) {
+        this->connectPhase = MQTT_PHASE_CONNECTED;
+    } else {
+        // loop() takes it from here
+        this->connectPhase = MQTT_PHASE_TCP_CONNECTING;
+    }
     return true;
-  }
-  return false;
 }
 
+void PubSubClient::enterBackoff(unsigned long t) {
+    if (this->connectFailures < 0xFFFF) {
+        this->connectFailures++;
+    }
+    if (this->connectBackoff == 0) {
+        this->connectBackoff = this->backoffMin;
+    } else if (this->connectBackoff < this->backoffMax/2) {
+        this->connectBackoff *= 2;
+    } else {
+        this->connectBackoff = this->backoffMax;
+    }
+    this->connectAt = t;
+    this->connectPhase = MQTT_PHASE_BACKOFF;
+}
+
+// Takes the connection started by beginConnect() one step further. Apart
+// from the network client's own connect() (and its DNS lookup), nothing here
+// waits.
+void PubSubClient::connectStep() {
+    unsigned long t = now();
+    if (this->connectPhase == MQTT_PHASE_CONNECTED) {
+        if (!connected()) {
+            // Lost the connection - wait a little before trying again
+            enterBackoff(t);
+        }
+        return;
+    }
+    if (this->connectPhase == MQTT_PHASE_BACKOFF) {
+        if (t-this->connectAt < this->connectBackoff) {
+            return;
+        }
+        this->connectPhase = MQTT_PHASE_TCP_CONNECTING;
+    }
+    if (this->connectPhase == MQTT_PHASE_TCP_CONNECTING) {
+        int result = 1;
+        if (!_client->connected()) {
+            if (domain != NULL) {
+                result = _client->connect(this->domain, this->port);
+            } else {
+                result = _client->connect(this->ip, this->port);
+            }
+        }
+        if (result != 1) {
+            _state = MQTT_CONNECT_FAILED;
+            enterBackoff(t);
+        } else if (!sendConnect(this->connectId,this->connectUser,this->connectPass,this->connectWillTopic,
+                this->connectWillQos,this->connectWillRetain,this->connectWillMessage,this->connectCleanSession)) {
+            enterBackoff(t);
+        } else {
+            this->connectPhase = MQTT_PHASE_AWAIT_CONNACK;
+        }
+        return;
+    }
+    if (this->connectPhase == MQTT_PHASE_AWAIT_CONNACK) {
+        uint8_t llen;
+        uint32_t len = readPacket(&llen);
+        if (len == 0) {
+            if (!_client->connected()) {
+                enterBackoff(t);
+            } else if (t-lastInActivity >= this->socketTimeout*1000UL) {
+                _state = MQTT_CONNECTION_TIMEOUT;
+                _client->stop();
+                enterBackoff(t);
+            }
+        } else if (connack(llen,len)) {
+            this->connectPhase = MQTT_PHASE_CONNECTED;
+            this->connectBackoff = 0;
+            this->connectFailures = 0;
+        } else {
+            _client->stop();
+            enterBackoff(t);
+        }
+    }
+}
+
+uint8_t PubSubClient::getConnectPhase() {
+    return this->connectPhase;
+}
+
+uint16_t PubSubClient::getConnectFailures() {
+    return this->connectFailures;
+}
+
+PubSubClient& PubSubClient::setBackoff(uint16_t min, uint16_t max) {
+    this->backoffMin = min;
+    this->backoffMax = (max < min) ? min : max;
+    if (this->connectBackoff > this->backoffMax) {
+        this->connectBackoff = this->backoffMax;
+    }
+    return *this;
+}
+
+// reads whatever is already available, up to size bytes, into result without waiting
+// Returns the number of bytes read
+uint32_t PubSubClient::readBytes(uint8_t * result, uint32_t size) {
+   int available = _client->available();
+   if (available <= 0) {
+     return 0;
+   }
+   if ((uint32_t)available < size) {
+     size = available;
+   }
+   int rc = _client->read(result, size);
+   return (rc > 0) ? rc : 0;
+}
+
+void PubSubClient::resetPacket() {
+    this->rxState = MQTT_RX_HEADER;
+    this->rxChunked = false;
+    this->rxLength = 0;
+    this->rxMultiplier = 1;
+    this->rxIndex = 0;
+    this->rxBufferLen = 0;
+    this->rxPayloadStart = 0;
+}
+
+// Consumes the bytes already available on the client, carrying the parser state
+// over to the next call if the packet is incomplete.
+// Returns the number of packet bytes held in the buffer once a whole packet has
+// arrived, or 0 if the packet is still incomplete (or was dropped)
 uint32_t PubSubClient::readPacket(uint8_t* lengthLength) {
-    uint16_t len = 0;
-    if(!readByte(this->buffer, &len)) return 0;
-    bool isPublish = (this->buffer[0]&0xF0) == MQTTPUBLISH;
-    uint32_t multiplier = 1;
-    uint32_t length = 0;
-    uint8_t digit = 0;
-    uint16_t skip = 0;
-    uint32_t start = 0;
+    uint8_t digit;
 
-    do {
-        if (len == 5) {
+    if (this->rxState == MQTT_RX_HEADER) {
+        // The flag is only kept past the end of a packet for loop() to see
+        this->rxChunked = false;
+        if (!readBytes(this->buffer, 1)) return 0;
+        this->rxBufferLen = 1;
+        this->rxState = MQTT_RX_LENGTH;
+    }
+
+    while (this->rxState == MQTT_RX_LENGTH) {
+        if (this->rxBufferLen == 5) {
             // Invalid remaining length encoding - kill the connection
+            resetPacket();
             _state = MQTT_DISCONNECTED;
             _client->stop();
             return 0;
         }
-        if(!readByte(&digit)) return 0;
-        this->buffer[len++] = digit;
-        length += (digit & 127) * multiplier;
-        multiplier <<=7; //multiplier *= 128
-    } while ((digit & 128) != 0);
-    *lengthLength = len-1;
-
-    if (isPublish) {
-        // Read in topic length to calculate bytes to skip over for Stream writing
-        if(!readByte(this->buffer, &len)) return 0;
-        if(!readByte(this->buffer, &len)) return 0;
-        skip = (this->buffer[*lengthLength+1]<<8)+this->buffer[*lengthLength+2];
-        start = 2;
-        if (this->buffer[0]&MQTTQOS1) {
-            // skip message id
-            skip += 2;
-        }
-    }
-    uint32_t idx = len;
-
-    for (uint32_t i = start;i<length;i++) {
-        if(!readByte(&digit)) return 0;
-        if (this->stream) {
-            if (isPublish && idx-*lengthLength-2>skip) {
-                this->stream->write(digit);
-            }
+        if (!readBytes(&digit, 1)) return 0;
+        this->buffer[this->rxBufferLen++] = digit;
+        this->rxLength += (digit & 127) * this->rxMultiplier;
+        this->rxMultiplier <<=7; //multiplier *= 128
+        if ((digit & 128) == 0) {
+            this->rxLengthLength = this->rxBufferLen-1;
+            this->rxIndex = this->rxBufferLen;
+            this->rxState = MQTT_RX_BODY;
+        }
+    }
+
+    // Pull the variable header and payload across in as few reads as the
+    // transport allows. Anything beyond the end of the buffer is read into a
+    // scratch area so it can still be passed to the stream (or discarded).
+    bool isPublish = (this->buffer[0]&0xF0) == MQTTPUBLISH;
+    uint8_t llen = this->rxLengthLength;
+    uint8_t scratch[MQTT_READ_CHUNK_SIZE];
+    uint32_t total = llen + 1 + this->rxLength;
+    // A publish that will not fit in the buffer is handed to the chunk callbacks
+    // (when set) rather than dropped
+    bool chunkable = isPublish && !this->stream && this->chunkCallback && total > this->bufferSize;
+    while (this->rxIndex < total) {
+        uint8_t* dst;
+        uint32_t room;
+        if (this->rxChunked) {
+            // Payload chunks reuse the buffer space after the topic
+            dst = this->buffer+this->rxPayloadStart;
+            room = this->bufferSize-this->rxPayloadStart;
+        } else if (this->rxBufferLen < this->bufferSize) {
+            dst = this->buffer+this->rxBufferLen;
+            room = this->bufferSize-this->rxBufferLen;
+        } else {
+            dst = scratch;
+            room = sizeof(scratch);
+        }
+        uint32_t got = readBytes(dst, (total-this->rxIndex < room) ? total-this->rxIndex : room);
+        if (got == 0) return 0;
+
+        if (dst != scratch && !this->rxChunked) {
+            this->rxBufferLen += got;
+        }
+        if (isPublish && this->rxPayloadStart == 0) {
+            this->rxPayloadStart = payloadOffset(llen,this->rxBufferLen);
         }
 
-        if (len < this->bufferSize) {
-            this->buffer[len] = digit;
-            len++;
+        if (this->stream && isPublish) {
+            for (uint32_t i = 0;i<got;i++) {
+                if (this->rxPayloadStart != 0 && this->rxIndex+i >= this->rxPayloadStart) {
+                    this->stream->write(dst[i]);
+                }
+            }
+        }
+        if (this->rxChunked) {
+            chunkCallback(dst,this->rxIndex-this->rxPayloadStart,got,total-this->rxPayloadStart);
+        }
+        this->rxIndex += got;
+
+        if (chunkable && !this->rxChunked && this->rxPayloadStart != 0 &&
+            this->rxPayloadStart <= this->rxBufferLen && this->rxPayloadStart < this->bufferSize) {
+            uint16_t msgId = publishMsgId(llen);
+            if ((this->buffer[0]&0x06) == MQTTQOS2 && (findIncoming(msgId) != MQTT_MAX_INCOMING_QOS2 || !addIncoming(msgId))) {
+                // A QoS 2 message that has already been delivered (or cannot be
+                // remembered) - drain it without delivering it again
+                continue;
+            }
+            // The topic (and message id) are in the buffer - start delivering the payload
+            this->rxChunked = true;
+            if (beginCallback) {
+                beginCallback((const char*)this->buffer+llen+3,(this->buffer[llen+1]<<8)+this->buffer[llen+2],total-this->rxPayloadStart);
+            }
+            if (this->rxBufferLen > this->rxPayloadStart) {
+                chunkCallback(this->buffer+this->rxPayloadStart,0,this->rxBufferLen-this->rxPayloadStart,total-this->rxPayloadStart);
+            }
+            this->rxBufferLen = this->rxPayloadStart;
         }
-        idx++;
     }
 
-    if (!this->stream && idx > this->bufferSize) {
-        len = 0; // This will cause the packet to be ignored.
+    // Packet complete - the next call starts on a new fixed header
+    uint32_t len = this->rxBufferLen;
+    *lengthLength = llen;
+    boolean chunked = this->rxChunked;
+    if (chunked) {
+        if (endCallback) {
+            endCallback();
+        }
+    } else if (!this->stream && this->rxIndex > this->bufferSize) {
+        if (isPublish && (this->buffer[0]&0x06) == MQTTQOS2 && this->rxPayloadStart != 0 && this->rxPayloadStart <= this->rxBufferLen &&
+            findIncoming(publishMsgId(llen)) != MQTT_MAX_INCOMING_QOS2) {
+            // A repeat of a QoS 2 message that has been delivered already - still
+            // pass it up so that loop() acknowledges it
+        } else {
+            len = 0; // This will cause the packet to be ignored.
+        }
     }
+    resetPacket();
+    this->rxChunked = chunked;
     return len;
 }
 
 boolean PubSubClient::loop() {
+    if (this->connectPhase != MQTT_PHASE_IDLE) {
+        connectStep();
+    }
     if (connected()) {
-        unsigned long t = millis();
-        if ((t - lastInActivity > this->keepAlive*1000UL) || (t - lastOutActivity > this->keepAlive*1000UL)) {
+        unsigned long t = now();
+        if ((t - lastInActivity > this->activeKeepAlive*1000UL) || (t - lastOutActivity > this->activeKeepAlive*1000UL)) {
             if (pingOutstanding) {
                 this->_state = MQTT_CONNECTION_TIMEOUT;
                 _client->stop();
                 return false;
             } else {
-                this->buffer[0] = MQTTPINGREQ;
-                this->buffer[1] = 0;
-                _client->write(this->buffer,2);
+                this->outBuffer[0] = MQTTPINGREQ;
+                this->outBuffer[1] = 0;
+                transmit(this->outBuffer,2);
                 lastOutActivity = t;
                 lastInActivity = t;
                 pingOutstanding = true;
             }
         }
+        if (this->inflight) {
+            resendInflight(t,false);
+        }
         if (_client->available()) {
             uint8_t llen;
-            uint16_t len = readPacket(&llen);
+            uint32_t len = readPacket(&llen);
             uint16_t msgId = 0;
             uint8_t *payload;
             if (len > 0) {
                 lastInActivity = t;
                 uint8_t type = this->buffer[0]&0xF0;
                 if (type == MQTTPUBLISH) {
-                    if (callback) {
+                    if (callback || viewCallback || this->router || this->rxChunked) {
                         uint16_t tl = (this->buffer[llen+1]<<8)+this->buffer[llen+2]; /* topic length in bytes */
-                        memmove(this->buffer+llen+2,this->buffer+llen+3,tl); /* move topic inside buffer 1 byte to front */
-                        this->buffer[llen+2+tl] = 0; /* end the topic as a 'C' string with \x00 */
-                        char *topic = (char*) this->buffer+llen+2;
+                        uint32_t offset = payloadOffset(llen,len);
+                        uint8_t qos = this->buffer[0]&0x06;
+                        boolean deliver = true;
                         // msgId only present for QOS>0
-                        if ((this->buffer[0]&0x06) == MQTTQOS1) {
-                            msgId = (this->buffer[llen+3+tl]<<8)+this->buffer[llen+3+tl+1];
-                            payload = this->buffer+llen+3+tl+2;
-                            callback(topic,payload,len-llen-3-tl-2);
-
-                            this->buffer[0] = MQTTPUBACK;
-                            this->buffer[1] = 2;
-                            this->buffer[2] = (msgId >> 8);
-                            this->buffer[3] = (msgId & 0xFF);
-                            _client->write(this->buffer,4);
+                        if (qos) {
+                            msgId = publishMsgId(llen);
+                        }
+                        if (offset == 0 || offset > len) {
+                            // Malformed properties - drop it unacknowledged
+                            deliver = false;
+                            msgId = 0;
+                            offset = len;
+                        } else if (qos == MQTTQOS2 && !this->rxChunked) {
+                            if (findIncoming(msgId) != MQTT_MAX_INCOMING_QOS2) {
+                                // Already delivered - the PUBREC was lost
+                                deliver = false;
+                            } else if (!addIncoming(msgId)) {
+                                // Nowhere to remember it: leave it unacknowledged
+                                // so the server sends it again later
+                                deliver = false;
+                                msgId = 0;
+                            }
+                        }
+                        payload = this->buffer+offset;
+                        if (this->rxChunked) {
+                            // Payload has already been delivered through the chunk callbacks
+                        } else if (!deliver) {
+                            // Duplicate QoS 2 message
+                        } else if (this->router && this->router->dispatch((const char*)this->buffer+llen+3,tl,payload,len-offset)) {
+                            // Handled by the handler(s) registered for matching topic filters
+                        } else if (viewCallback) {
+                            // Topic and payload are passed as views straight into the buffer
+                            viewCallback((const char*)this->buffer+llen+3,tl,payload,len-offset);
+                        } else if (callback) {
+                            memmove(this->buffer+llen+2,this->buffer+llen+3,tl); /* move topic inside buffer 1 byte to front */
+                            this->buffer[llen+2+tl] = 0; /* end the topic as a 'C' string with \x00 */
+                            callback((char*)this->buffer+llen+2,payload,len-offset);
+                        }
+                        if (msgId) {
+                            this->outBuffer[0] = (qos == MQTTQOS2) ? MQTTPUBREC : MQTTPUBACK;
+                            this->outBuffer[1] = 2;
+                            this->outBuffer[2] = (msgId >> 8);
+                            this->outBuffer[3] = (msgId & 0xFF);
+                            transmit(this->outBuffer,4);
                             lastOutActivity = t;
-
-                        } else {
-                            payload = this->buffer+llen+3+tl;
-                            callback(topic,payload,len-llen-3-tl);
+                        }
+                    }
+                } else if (type == MQTTPUBREL) {
+                    if (len >= (uint32_t)llen+3) {
+                        // The message has been delivered; forget its id and complete the exchange
+                        msgId = (this->buffer[llen+1]<<8)+this->buffer[llen+2];
+                        uint8_t i = findIncoming(msgId);
+                        if (i != MQTT_MAX_INCOMING_QOS2) {
+                            this->incoming[i] = 0;
+                        }
+                        this->outBuffer[0] = MQTTPUBCOMP;
+                        this->outBuffer[1] = 2;
+                        this->outBuffer[2] = (msgId >> 8);
+                        this->outBuffer[3] = (msgId & 0xFF);
+                        transmit(this->outBuffer,4);
+                        lastOutActivity = t;
+                    }
+                } else if (type == MQTTPUBACK || type == MQTTPUBREC || type == MQTTPUBCOMP) {
+                    if (len >= (uint32_t)llen+3) {
+                        Inflight* slot = findInflight((this->buffer[llen+1]<<8)+this->buffer[llen+2]);
+                        // MQTT 5 adds a reason code, left out when it is 0 (success)
+                        this->reasonCode = (len > (uint32_t)llen+3) ? this->buffer[llen+3] : 0;
+                        if (slot) {
+                            uint8_t expected = slot->header&0xF6;
+                            if (type == MQTTPUBACK && expected == (MQTTPUBLISH|MQTTQOS1)) {
+                                releaseInflight(slot);
+                            } else if (type == MQTTPUBREC && expected == (MQTTPUBLISH|MQTTQOS2) && this->reasonCode >= 0x80) {
+                                // Refused by the server - there is nothing to release
+                                releaseInflight(slot);
+                            } else if (type == MQTTPUBREC && (expected == (MQTTPUBLISH|MQTTQOS2) || expected == (MQTTPUBREL|MQTTQOS1))) {
+                                // Replace the stored PUBLISH with the PUBREL that now
+                                // has to be sent until a PUBCOMP arrives
+                                slot->header = MQTTPUBREL|MQTTQOS1;
+                                slot->packet[MQTT_MAX_HEADER_SIZE] = this->buffer[llen+1];
+                                slot->packet[MQTT_MAX_HEADER_SIZE+1] = this->buffer[llen+2];
+                                slot->length = 2;
+                                slot->sentAt = t;
+                                if (this->sessionStore) {
+                                    this->sessionStore->save(slot->msgId,slot->header,slot->packet+MQTT_MAX_HEADER_SIZE,slot->length);
+                                }
+                                write(slot->header,slot->packet,slot->length);
+                            } else if (type == MQTTPUBCOMP && expected == (MQTTPUBREL|MQTTQOS1)) {
+                                releaseInflight(slot);
+                            }
+                        }
+                    }
+                } else if (type == MQTTSUBACK) {
+                    if (len >= (uint32_t)llen+3) {
+                        // One return code per topic, in the order they were sent
+                        msgId = (this->buffer[llen+1]<<8)+this->buffer[llen+2];
+                        uint32_t pos = llen+3;
+#if MQTT_VERSION == MQTT_VERSION_5
+                        uint32_t propertiesLength;
+                        uint8_t n = readVarint(pos,len,&propertiesLength);
+                        pos = (n == 0) ? len : pos+n+propertiesLength;
+#endif
+                        for (uint8_t i = 0; i < this->subscriptionCount && pos < len; i++) {
+                            if (this->subscriptions[i].msgId == msgId) {
+                                this->subscriptions[i].status = this->buffer[pos++];
+                                this->subscriptions[i].msgId = 0;
+                            }
                         }
                     }
                 } else if (type == MQTTPINGREQ) {
-                    this->buffer[0] = MQTTPINGRESP;
-                    this->buffer[1] = 0;
-                    _client->write(this->buffer,2);
+                    this->outBuffer[0] = MQTTPINGRESP;
+                    this->outBuffer[1] = 0;
+                    transmit(this->outBuffer,2);
                 } else if (type == MQTTPINGRESP) {
                     pingOutstanding = false;
+#if MQTT_VERSION == MQTT_VERSION_5
+                } else if (type == MQTTDISCONNECT) {
+                    // The server is closing the connection; the reason code says why
+                    this->reasonCode = (len > (uint32_t)llen+1) ? this->buffer[llen+1] : 0;
+                    _state = MQTT_CONNECTION_LOST;
+                    _client->stop();
+                    return false;
+#endif
                 }
             } else if (!connected()) {
                 // readPacket has closed the connection
                 return false;
             }
         }
+        if (this->txLength > 0 && now()-this->txStart >= this->txDelay) {
+            flush();
+        }
         return true;
     }
     return false;
 }
 
 boolean PubSubClient::publish(const char* topic, const char* payload) {
-    return publish(topic,(const uint8_t*)payload, payload ? strnlen(payload, this->bufferSize) : 0,false);
+    return publish(topic,(const uint8_t*)payload, payload ? strlen(payload) : 0,false);
 }
 
 boolean PubSubClient::publish(const char* topic, const char* payload, boolean retained) {
-    return publish(topic,(const uint8_t*)payload, payload ? strnlen(payload, this->bufferSize) : 0,retained);
+    return publish(topic,(const uint8_t*)payload, payload ? strlen(payload) : 0,retained);
 }
 
 boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength) {
@@ -447,94 +822,129 @@ boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigne
 
 boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
     if (connected()) {
-        if (this->bufferSize < MQTT_MAX_HEADER_SIZE + 2+strnlen(topic, this->bufferSize) + plength) {
+        size_t tlen = strnlen(topic, this->bufferSize);
+        if (this->bufferSize < MQTT_MAX_HEADER_SIZE + 2 + tlen + MQTT_PUBLISH_PROPERTIES_SIZE ||
+            2 + tlen + MQTT_PUBLISH_PROPERTIES_SIZE + (uint32_t)plength > MQTT_MAX_REMAINING_LENGTH ||
+            !fitsServer(2 + tlen + MQTT_PUBLISH_PROPERTIES_SIZE + (uint32_t)plength)) {
             // Too long
             return false;
         }
-        // Leave room in the buffer for header and variable length field
-        uint16_t length = MQTT_MAX_HEADER_SIZE;
-        length = writeString(topic,this->buffer,length);
+        // Only the header and topic are built in the buffer; the payload is
+        // written straight from the caller's memory
+        uint16_t length = writePublishHeader(topic,tlen,0,true,this->outBuffer,MQTT_MAX_HEADER_SIZE);
 
-        // Add payload
-        uint16_t i;
-        for (i=0;i<plength;i++) {
-            this->buffer[length++] = payload[i];
-        }
-
-        // Write the header
         uint8_t header = MQTTPUBLISH;
         if (retained) {
             header |= 1;
         }
-        return write(header,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+        size_t hlen = buildHeader(header, this->outBuffer, length-MQTT_MAX_HEADER_SIZE+(uint32_t)plength);
+        size_t rc = transmit(this->outBuffer+(MQTT_MAX_HEADER_SIZE-hlen),length-(MQTT_MAX_HEADER_SIZE-hlen));
+        if (plength > 0) {
+            rc += transmit(payload,plength);
+        }
+        lastOutActivity = now();
+        return (rc == hlen+length-MQTT_MAX_HEADER_SIZE+plength);
     }
     return false;
 }
 
+boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, uint8_t qos, boolean retained) {
+    if (qos == 0) {
+        return publish(topic, payload, plength, retained);
+    }
+    if (qos > 2 || !connected() || this->inflight == NULL) {
+        return false;
+    }
+    size_t tlen = strnlen(topic, this->inflightSize);
+    if (this->inflightSize < MQTT_MAX_HEADER_SIZE + 2 + tlen + 2 + MQTT_PUBLISH_PROPERTIES_SIZE + plength ||
+        !fitsServer(2 + tlen + 2 + MQTT_PUBLISH_PROPERTIES_SIZE + plength)) {
+        // Too long
+        return false;
+    }
+    Inflight* slot = findInflight(0);
+    if (slot == NULL || getInflightCount() >= getMaxInflight()) {
+        // Window is full - wait for a PUBACK
+        return false;
+    }
+    // Leave room in the packet for header and variable length field. The
+    // topic is kept in full; a topic alias only lasts as long as the connection
+    uint16_t msgId = nextPacketId();
+    uint16_t length = writePublishHeader(topic,tlen,msgId,false,slot->packet,MQTT_MAX_HEADER_SIZE);
+    memcpy(slot->packet+length,payload,plength);
+    length += plength;
+
+    slot->header = MQTTPUBLISH|(qos << 1);
+    if (retained) {
+        slot->header |= 1;
+    }
+    slot->length = length-MQTT_MAX_HEADER_SIZE;
+    slot->msgId = msgId;
+    slot->sentAt = now();
+    if (this->sessionStore) {
+        this->sessionStore->save(msgId,slot->header,slot->packet+MQTT_MAX_HEADER_SIZE,slot->length);
+    }
+    // If the write fails the message stays in flight and is resent later
+    writeInflight(slot,slot->header);
+    return true;
+}
+
 boolean PubSubClient::publish_P(const char* topic, const char* payload, boolean retained) {
     return publish_P(topic, (const uint8_t*)payload, payload ? strnlen(payload, this->bufferSize) : 0, retained);
 }
 
 boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
-    uint8_t llen = 0;
-    uint8_t digit;
     unsigned int rc = 0;
-    uint16_t tlen;
-    unsigned int pos = 0;
+    size_t tlen;
     unsigned int i;
     uint8_t header;
-    unsigned int len;
-    int expectedLength;
 
     if (!connected()) {
         return false;
     }
 
     tlen = strnlen(topic, this->bufferSize);
+    if (this->bufferSize < MQTT_MAX_HEADER_SIZE + 2 + tlen + MQTT_PUBLISH_PROPERTIES_SIZE ||
+        !fitsServer(2 + tlen + MQTT_PUBLISH_PROPERTIES_SIZE + plength)) {
+        // Too long
+        return false;
+    }
 
     header = MQTTPUBLISH;
     if (retained) {
         header |= 1;
     }
-    this->buffer[pos++] = header;
-    len = plength + 2 + tlen;
-    do {
-        digit = len  & 127; //digit = len %128
-        len >>= 7; //len = len / 128
-        if (len > 0) {
-            digit |= 0x80;
-        }
-        this->buffer[pos++] = digit;
-        llen++;
-    } while(len>0);
+    uint16_t length = writePublishHeader(topic,tlen,0,true,this->outBuffer,MQTT_MAX_HEADER_SIZE);
+    size_t hlen = buildHeader(header, this->outBuffer, length-MQTT_MAX_HEADER_SIZE+plength);
 
-    pos = writeString(topic,this->buffer,pos);
-
-    rc += _client->write(this->buffer,pos);
+    rc += transmit(this->outBuffer+(MQTT_MAX_HEADER_SIZE-hlen),length-(MQTT_MAX_HEADER_SIZE-hlen));
 
     for (i=0;i<plength;i++) {
-        rc += _client->write((char)pgm_read_byte_near(payload + i));
+        uint8_t c = pgm_read_byte_near(payload + i);
+        rc += transmit(&c,1);
     }
 
-    lastOutActivity = millis();
-
-    expectedLength = 1 + llen + 2 + tlen + plength;
+    lastOutActivity = now();
 
-    return (rc == expectedLength);
+    return (rc == hlen+length-MQTT_MAX_HEADER_SIZE+plength);
 }
 
 boolean PubSubClient::beginPublish(const char* topic, unsigned int plength, boolean retained) {
     if (connected()) {
         // Send the header and variable length field
-        uint16_t length = MQTT_MAX_HEADER_SIZE;
-        length = writeString(topic,this->buffer,length);
+        size_t tlen = strnlen(topic, this->bufferSize);
+        if (this->bufferSize < MQTT_MAX_HEADER_SIZE + 2 + tlen + MQTT_PUBLISH_PROPERTIES_SIZE ||
+            !fitsServer(2 + tlen + MQTT_PUBLISH_PROPERTIES_SIZE + plength)) {
+            // Too long
+            return false;
+        }
+        uint16_t length = writePublishHeader(topic,tlen,0,true,this->outBuffer,MQTT_MAX_HEADER_SIZE);
         uint8_t header = MQTTPUBLISH;
         if (retained) {
             header |= 1;
         }
-        size_t hlen = buildHeader(header, this->buffer, plength+length-MQTT_MAX_HEADER_SIZE);
-        uint16_t rc = _client->write(this->buffer+(MQTT_MAX_HEADER_SIZE-hlen),length-(MQTT_MAX_HEADER_SIZE-hlen));
-        lastOutActivity = millis();
+        size_t hlen = buildHeader(header, this->outBuffer, plength+length-MQTT_MAX_HEADER_SIZE);
+        uint16_t rc = transmit(this->outBuffer+(MQTT_MAX_HEADER_SIZE-hlen),length-(MQTT_MAX_HEADER_SIZE-hlen));
+        lastOutActivity = now();
         return (rc == (length-(MQTT_MAX_HEADER_SIZE-hlen)));
     }
     return false;
@@ -545,21 +955,72 @@ int PubSubClient::endPublish() {
 }
 
 size_t PubSubClient::write(uint8_t data) {
-    lastOutActivity = millis();
-    return _client->write(data);
+    lastOutActivity = now();
+    return transmit(&data,1);
 }
 
 size_t PubSubClient::write(const uint8_t *buffer, size_t size) {
-    lastOutActivity = millis();
-    return _client->write(buffer,size);
+    lastOutActivity = now();
+    return transmit(buffer,size);
+}
+
+size_t PubSubClient::writeClient(const uint8_t* buf, size_t size) {
+#ifdef MQTT_MAX_TRANSFER_SIZE
+    size_t written = 0;
+    while (written < size) {
+        size_t bytesToWrite = (size-written > MQTT_MAX_TRANSFER_SIZE)?MQTT_MAX_TRANSFER_SIZE:size-written;
+        size_t rc = _client->write(buf+written,bytesToWrite);
+        written += rc;
+        if (rc != bytesToWrite) {
+            break;
+        }
+    }
+    return written;
+#else
+    return _client->write(buf,size);
+#endif
+}
+
+size_t PubSubClient::transmit(const uint8_t* buf, size_t size) {
+    if (this->txBuffer == NULL) {
+        return writeClient(buf,size);
+    }
+    if (this->txLength+size > this->txBufferSize) {
+        flush();
+        if (size > this->txBufferSize) {
+            // Too big to hold - send it as it is
+            return writeClient(buf,size);
+        }
+    }
+    if (this->txLength == 0) {
+        this->txStart = now();
+    }
+    memcpy(this->txBuffer+this->txLength,buf,size);
+    this->txLength += size;
+    if (this->txLength == this->txBufferSize) {
+        flush();
+    }
+    return size;
+}
+
+void PubSubClient::flush() {
+    if (this->txLength > 0) {
+        uint16_t length = this->txLength;
+        this->txLength = 0;
+        if (writeClient(this->txBuffer,length) != length) {
+            // These packets were reported as sent - drop the connection so that
+            // it is re-established and anything unacknowledged is resent
+            _client->stop();
+        }
+    }
 }
 
-size_t PubSubClient::buildHeader(uint8_t header, uint8_t* buf, uint16_t length) {
+size_t PubSubClient::buildHeader(uint8_t header, uint8_t* buf, uint32_t length) {
     uint8_t lenBuf[4];
     uint8_t llen = 0;
     uint8_t digit;
     uint8_t pos = 0;
-    uint16_t len = length;
+    uint32_t len = length;
     do {
 
         digit = len  & 127; //digit = len %128
@@ -579,27 +1040,351 @@ size_t PubSubClient::buildHeader(uint8_t header, uint8_t* buf, uint16_t length)
 }
 
 boolean PubSubClient::write(uint8_t header, uint8_t* buf, uint16_t length) {
-    uint16_t rc;
+    size_t rc;
+    if (!fitsServer(length)) {
+        return false;
+    }
     uint8_t hlen = buildHeader(header, buf, length);
+    rc = transmit(buf+(MQTT_MAX_HEADER_SIZE-hlen),length+hlen);
+    lastOutActivity = now();
+    return (rc == hlen+length);
+}
 
-#ifdef MQTT_MAX_TRANSFER_SIZE
-    uint8_t* writeBuf = buf+(MQTT_MAX_HEADER_SIZE-hlen);
-    uint16_t bytesRemaining = length+hlen;  //Match the length type
-    uint8_t bytesToWrite;
-    boolean result = true;
-    while((bytesRemaining > 0) && result) {
-        bytesToWrite = (bytesRemaining > MQTT_MAX_TRANSFER_SIZE)?MQTT_MAX_TRANSFER_SIZE:bytesRemaining;
-        rc = _client->write(writeBuf,bytesToWrite);
-        result = (rc == bytesToWrite);
-        bytesRemaining -= rc;
-        writeBuf += rc;
-    }
-    return result;
+uint16_t PubSubClient::writePublishHeader(const char* topic, uint16_t topicLength, uint16_t msgId, boolean useAlias, uint8_t* buf, uint16_t pos) {
+#if MQTT_VERSION == MQTT_VERSION_5
+    uint16_t alias = useAlias ? topicAlias(topic,topicLength) : 0;
+    if (alias != 0 && this->aliasSent[alias-1]) {
+        // The server already knows the topic by its alias
+        topicLength = 0;
+    }
+#endif
+    buf[pos++] = (topicLength >> 8);
+    buf[pos++] = (topicLength & 0xFF);
+    memmove(buf+pos,topic,topicLength);
+    pos += topicLength;
+    if (msgId != 0) {
+        buf[pos++] = (msgId >> 8);
+        buf[pos++] = (msgId & 0xFF);
+    }
+#if MQTT_VERSION == MQTT_VERSION_5
+    if (alias != 0) {
+        buf[pos++] = 3;
+        buf[pos++] = MQTT_PROP_TOPIC_ALIAS;
+        buf[pos++] = (alias >> 8);
+        buf[pos++] = (alias & 0xFF);
+        this->aliasSent[alias-1] = true;
+    } else {
+        buf[pos++] = 0; // no properties
+    }
 #else
-    rc = _client->write(buf+(MQTT_MAX_HEADER_SIZE-hlen),length+hlen);
-    lastOutActivity = millis();
-    return (rc == hlen+length);
+    (void)useAlias;
+#endif
+    return pos;
+}
+
+boolean PubSubClient::writeInflight(Inflight* slot, uint8_t header) {
+#if MQTT_VERSION == MQTT_VERSION_5
+    if ((header&0xF0) == MQTTPUBLISH) {
+        // The slot holds the topic in full and no properties. Send it with
+        // the topic alias instead, where it has one and there is room.
+        uint8_t* p = slot->packet+MQTT_MAX_HEADER_SIZE;
+        uint16_t tlen = (p[0]<<8)+p[1];
+        uint16_t plength = slot->length-2-tlen-2-1;
+        if (MQTT_MAX_HEADER_SIZE+2+tlen+2+MQTT_PUBLISH_PROPERTIES_SIZE+plength <= this->bufferSize &&
+            topicAlias((const char*)p+2,tlen) != 0) {
+            uint16_t length = writePublishHeader((const char*)p+2,tlen,slot->msgId,true,this->outBuffer,MQTT_MAX_HEADER_SIZE);
+            memcpy(this->outBuffer+length,p+2+tlen+2+1,plength);
+            return write(header,this->outBuffer,length-MQTT_MAX_HEADER_SIZE+plength);
+        }
+    }
+#endif
+    return write(header,slot->packet,slot->length);
+}
+
+boolean PubSubClient::fitsServer(uint32_t length) {
+#if MQTT_VERSION == MQTT_VERSION_5
+    // Fixed header byte, remaining length field and the rest
+    uint32_t total = 2+length;
+    for (uint32_t l = length; l >= 128; l >>= 7) {
+        total++;
+    }
+    return total <= this->serverMaximumPacketSize;
+#else
+    (void)length;
+    return true;
+#endif
+}
+
+uint32_t PubSubClient::payloadOffset(uint8_t llen, uint32_t available) {
+    if (available < (uint32_t)llen+3) {
+        return 0;
+    }
+    uint32_t pos = llen+3+(this->buffer[llen+1]<<8)+this->buffer[llen+2];
+    if (this->buffer[0]&0x06) {
+        // skip message id
+        pos += 2;
+    }
+#if MQTT_VERSION == MQTT_VERSION_5
+    uint32_t propertiesLength;
+    uint8_t n = readVarint(pos,available,&propertiesLength);
+    if (n == 0) {
+        return 0;
+    }
+    pos += n+propertiesLength;
+#endif
+    return pos;
+}
+
+uint16_t PubSubClient::publishMsgId(uint8_t llen) {
+    uint32_t pos = llen+3+(this->buffer[llen+1]<<8)+this->buffer[llen+2];
+    return (this->buffer[pos]<<8)+this->buffer[pos+1];
+}
+
+void PubSubClient::resetServerLimits() {
+    this->activeKeepAlive = this->keepAlive;
+#if MQTT_VERSION == MQTT_VERSION_5
+    // No limits until the CONNACK says otherwise, and no topic aliases
+    this->serverReceiveMaximum = 0xFFFF;
+    this->serverMaximumPacketSize = 0xFFFFFFFF;
+    this->topicAliasMaximum = 0;
+    this->aliasCount = 0;
+#endif
+}
+
+#if MQTT_VERSION == MQTT_VERSION_5
+uint16_t PubSubClient::topicAlias(const char* topic, uint16_t topicLength) {
+    if (topicLength == 0 || topicLength >= MQTT_TOPIC_ALIAS_LENGTH) {
+        return 0;
+    }
+    uint8_t i;
+    for (i = 0; i < this->aliasCount; i++) {
+        if (strlen(this->aliasTopics[i]) == topicLength && memcmp(this->aliasTopics[i],topic,topicLength) == 0) {
+            break;
+        }
+    }
+    if (i == this->aliasCount) {
+        if (this->aliasCount == MQTT_MAX_TOPIC_ALIASES || this->aliasCount >= this->topicAliasMaximum) {
+            return 0;
+        }
+        memcpy(this->aliasTopics[i],topic,topicLength);
+        this->aliasTopics[i][topicLength] = 0;
+        this->aliasSent[i] = false;
+        this->aliasCount++;
+    }
+    return i+1;
+}
+
+uint8_t PubSubClient::readVarint(uint32_t pos, uint32_t end, uint32_t* value) {
+    uint32_t multiplier = 1;
+    *value = 0;
+    for (uint8_t i = 0; i < 4 && pos+i < end; i++) {
+        uint8_t digit = this->buffer[pos+i];
+        *value += (digit & 127) * multiplier;
+        if ((digit & 128) == 0) {
+            return i+1;
+        }
+        multiplier <<= 7;
+    }
+    return 0;
+}
+
+uint32_t PubSubClient::readProperty(uint32_t pos, uint32_t end, uint8_t* id, uint32_t* value) {
+    if (pos >= end) {
+        return 0;
+    }
+    *id = this->buffer[pos++];
+    *value = 0;
+    uint8_t size;
+    switch (*id) {
+    case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+        size = 1;
+        break;
+    case 0x13: case 0x21: case 0x22: case 0x23:
+        size = 2;
+        break;
+    case 0x02: case 0x11: case 0x18: case 0x27:
+        size = 4;
+        break;
+    case 0x0B: {
+        uint8_t n = readVarint(pos,end,value);
+        return (n == 0) ? 0 : pos+n;
+    }
+    case 0x26:
+        // User property: a pair of strings, skipped
+        if (pos+2 > end) {
+            return 0;
+        }
+        pos += 2+(this->buffer[pos]<<8)+this->buffer[pos+1];
+        // fall through
+    case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+        // A string or binary data, skipped
+        if (pos+2 > end) {
+            return 0;
+        }
+        pos += 2+(this->buffer[pos]<<8)+this->buffer[pos+1];
+        return (pos <= end) ? pos : 0;
+    default:
+        return 0;
+    }
+    if (pos+size > end) {
+        return 0;
+    }
+    for (uint8_t i = 0; i < size; i++) {
+        *value = (*value << 8) | this->buffer[pos+i];
+    }
+    return pos+size;
+}
+
+int PubSubClient::connectRefusedState(uint8_t reasonCode) {
+    switch (reasonCode) {
+    case 0x81: case 0x82: case 0x84:
+        // Malformed packet, protocol error, unsupported protocol version
+        return MQTT_CONNECT_BAD_PROTOCOL;
+    case 0x85:
+        return MQTT_CONNECT_BAD_CLIENT_ID;
+    case 0x86:
+        return MQTT_CONNECT_BAD_CREDENTIALS;
+    case 0x87: case 0x8A: case 0x8C:
+        // Not authorized, banned, bad authentication method
+        return MQTT_CONNECT_UNAUTHORIZED;
+    default:
+        return MQTT_CONNECT_UNAVAILABLE;
+    }
+}
 #endif
+
+uint16_t PubSubClient::nextPacketId() {
+    do {
+        nextMsgId++;
+        if (nextMsgId == 0) {
+            nextMsgId = 1;
+        }
+    } while (findInflight(nextMsgId));
+    return nextMsgId;
+}
+
+uint8_t PubSubClient::findIncoming(uint16_t msgId) {
+    uint8_t i;
+    for (i = 0; i < MQTT_MAX_INCOMING_QOS2; i++) {
+        if (this->incoming[i] == msgId) {
+            break;
+        }
+    }
+    return i;
+}
+
+boolean PubSubClient::addIncoming(uint16_t msgId) {
+    uint8_t i = findIncoming(0);
+    if (i == MQTT_MAX_INCOMING_QOS2) {
+        return false;
+    }
+    this->incoming[i] = msgId;
+    return true;
+}
+
+PubSubClient::Inflight* PubSubClient::findInflight(uint16_t msgId) {
+    if (this->inflight) {
+        for (uint8_t i = 0; i < this->maxInflight; i++) {
+            if (this->inflight[i].msgId == msgId) {
+                return &this->inflight[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+boolean PubSubClient::allocInflight() {
+    free(this->inflight);
+    this->inflightPackets.end();
+    this->inflight = (Inflight*)malloc(this->maxInflight*sizeof(Inflight));
+    if (this->inflight == NULL) {
+        return false;
+    }
+    if (!this->inflightPackets.begin(this->bufferSize,this->maxInflight)) {
+        free(this->inflight);
+        this->inflight = NULL;
+        return false;
+    }
+    this->inflightSize = this->bufferSize;
+    for (uint8_t i = 0; i < this->maxInflight; i++) {
+        this->inflight[i].msgId = 0;
+        this->inflight[i].packet = this->inflightPackets.take();
+    }
+    return true;
+}
+
+void PubSubClient::releaseInflight(Inflight* slot) {
+    if (this->sessionStore) {
+        this->sessionStore->remove(slot->msgId);
+    }
+    slot->msgId = 0;
+}
+
+boolean PubSubClient::setSessionStore(MqttSessionStore& store) {
+    this->sessionStore = &store;
+    uint8_t count = store.count();
+    if (count == 0) {
+        return true;
+    }
+    if (this->inflight == NULL) {
+        return false;
+    }
+    // Put back what was in flight when the session was saved. It is resent
+    // once connected.
+    for (uint8_t i = 0; i < count; i++) {
+        Inflight* slot = findInflight(0);
+        if (slot == NULL) {
+            return false;
+        }
+        uint16_t msgId;
+        uint8_t header;
+        uint16_t length = store.load(i,&msgId,&header,slot->packet+MQTT_MAX_HEADER_SIZE,this->inflightSize-MQTT_MAX_HEADER_SIZE);
+        if (length == 0 || msgId == 0 || findInflight(msgId)) {
+            // Unreadable, too big for the buffer, or a duplicate
+            continue;
+        }
+        slot->msgId = msgId;
+        slot->header = header;
+        slot->length = length;
+        slot->sentAt = 0;
+    }
+    return true;
+}
+
+boolean PubSubClient::getSessionPresent() {
+    return this->sessionPresent;
+}
+
+void PubSubClient::resendInflight(unsigned long t, boolean all) {
+    for (uint8_t i = 0; this->inflight && i < this->maxInflight; i++) {
+        Inflight* slot = &this->inflight[i];
+        if (slot->msgId != 0 && (all || t - slot->sentAt >= this->retryTimeout*1000UL)) {
+            // Only a PUBLISH carries the DUP flag; a PUBREL is resent as is
+            uint8_t header = slot->header;
+            if ((header&0xF0) == MQTTPUBLISH) {
+                header |= MQTTDUP;
+            }
+            writeInflight(slot,header);
+            slot->sentAt = t;
+        }
+    }
+}
+
+void PubSubClient::replayInflight(unsigned long t) {
+    for (uint8_t i = 0; this->inflight && i < this->maxInflight; i++) {
+        Inflight* slot = &this->inflight[i];
+        if (slot->msgId == 0) {
+            continue;
+        }
+        if ((slot->header&0xF0) == MQTTPUBREL) {
+            // The server has already received the message, and no longer
+            // knows its id
+            releaseInflight(slot);
+        } else {
+            writeInflight(slot,slot->header);
+            slot->sentAt = t;
+        }
+    }
 }
 
 boolean PubSubClient::subscribe(const char* topic) {
@@ -607,31 +1392,148 @@ boolean PubSubClient::subscribe(const char* topic) {
 }
 
 boolean PubSubClient::subscribe(const char* topic, uint8_t qos) {
-    size_t topicLength = strnlen(topic, this->bufferSize);
-    if (topic == 0) {
+    return subscribe(&topic, &qos, 1);
+}
+
+boolean PubSubClient::subscribe(const char* topics[], const uint8_t* qos, uint8_t count) {
+    if (topics == 0 || qos == 0 || count == 0) {
+        return false;
+    }
+    uint8_t added = 0;
+    uint16_t topicsLength = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        if (topics[i] == 0) {
+            return false;
+        }
+        if (qos[i] > 2) {
+            return false;
+        }
+        size_t topicLength = strnlen(topics[i], this->bufferSize);
+        if (this->bufferSize < 9 + topicLength) {
+            // Too long
+            return false;
+        }
+        if (findSubscription(topics[i]) == MQTT_MAX_SUBSCRIPTIONS) {
+            added++;
+            topicsLength += topicLength+1;
+        }
+    }
+    if (!connected()) {
         return false;
     }
-    if (qos > 1) {
+    if (this->subscriptionCount+added > MQTT_MAX_SUBSCRIPTIONS ||
+        this->subscriptionTopicsLength+topicsLength > MQTT_SUBSCRIPTION_TOPICS_SIZE) {
+        // No room to remember them
         return false;
     }
-    if (this->bufferSize < 9 + topicLength) {
-        // Too long
+    for (uint8_t i = 0; i < count; i++) {
+        uint8_t index = findSubscription(topics[i]);
+        if (index == MQTT_MAX_SUBSCRIPTIONS) {
+            index = this->subscriptionCount++;
+            this->subscriptions[index].topic = this->subscriptionTopicsLength;
+            size_t topicLength = strlen(topics[i]);
+            memcpy(this->subscriptionTopics+this->subscriptionTopicsLength,topics[i],topicLength+1);
+            this->subscriptionTopicsLength += topicLength+1;
+        }
+        this->subscriptions[index].qos = qos[i];
+        this->subscriptions[index].msgId = 0;
+        this->subscriptions[index].status = MQTT_SUBACK_PENDING;
+    }
+    return sendSubscriptions();
+}
+
+boolean PubSubClient::subscribe(const char* topic, uint8_t qos, MQTT_HANDLER_SIGNATURE) {
+    if (topic == 0 || !addHandler(topic, handler)) {
         return false;
     }
-    if (connected()) {
-        // Leave room in the buffer for header and variable length field
+    return subscribe(topic, qos);
+}
+
+boolean PubSubClient::addHandler(const char* filter, MQTT_HANDLER_SIGNATURE) {
+    if (filter == 0 || handler == NULL) {
+        return false;
+    }
+    if (this->router == NULL) {
+        this->router = new MqttRouter();
+    }
+    return this->router->add(filter, handler);
+}
+
+uint8_t PubSubClient::findSubscription(const char* topic) {
+    uint8_t i;
+    for (i = 0; i < this->subscriptionCount; i++) {
+        if (strcmp(this->subscriptionTopics+this->subscriptions[i].topic, topic) == 0) {
+            return i;
+        }
+    }
+    return MQTT_MAX_SUBSCRIPTIONS;
+}
+
+void PubSubClient::removeSubscription(uint8_t index) {
+    uint16_t offset = this->subscriptions[index].topic;
+    uint16_t length = strlen(this->subscriptionTopics+offset)+1;
+    memmove(this->subscriptionTopics+offset,this->subscriptionTopics+offset+length,this->subscriptionTopicsLength-offset-length);
+    this->subscriptionTopicsLength -= length;
+    this->subscriptionCount--;
+    for (uint8_t i = index; i < this->subscriptionCount; i++) {
+        this->subscriptions[i] = this->subscriptions[i+1];
+    }
+    for (uint8_t i = 0; i < this->subscriptionCount; i++) {
+        if (this->subscriptions[i].topic > offset) {
+            this->subscriptions[i].topic -= length;
+        }
+    }
+}
+
+boolean PubSubClient::sendSubscriptions() {
+    boolean rc = true;
+    uint8_t i = 0;
+    while (i < this->subscriptionCount) {
+        if (this->subscriptions[i].msgId != 0 || this->subscriptions[i].status != MQTT_SUBACK_PENDING) {
+            i++;
+            continue;
+        }
+        // Pack as many of the unsent topics as fit in the buffer into one SUBSCRIBE
         uint16_t length = MQTT_MAX_HEADER_SIZE;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
+        uint16_t msgId = nextPacketId();
+        this->outBuffer[length++] = (msgId >> 8);
+        this->outBuffer[length++] = (msgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+        this->outBuffer[length++] = 0; // no properties
+#endif
+        uint8_t packed = 0;
+        for (; i < this->subscriptionCount; i++) {
+            Subscription* sub = &this->subscriptions[i];
+            if (sub->msgId != 0 || sub->status != MQTT_SUBACK_PENDING) {
+                continue;
+            }
+            const char* topic = this->subscriptionTopics+sub->topic;
+            if (length+3+strlen(topic) > this->bufferSize) {
+                if (packed == 0) {
+                    // Does not fit on its own since the buffer shrank
+                    sub->status = MQTT_SUBACK_FAILURE;
+                    continue;
+                }
+                break;
+            }
+            length = writeString(topic,this->outBuffer,length);
+            this->outBuffer[length++] = sub->qos;
+            sub->msgId = msgId;
+            packed++;
+        }
+        if (packed > 0 && !write(MQTTSUBSCRIBE|MQTTQOS1,this->outBuffer,length-MQTT_MAX_HEADER_SIZE)) {
+            rc = false;
         }
-        this->buffer[length++] = (nextMsgId >> 8);
-        this->buffer[length++] = (nextMsgId & 0xFF);
-        length = writeString((char*)topic, this->buffer,length);
-        this->buffer[length++] = qos;
-        return write(MQTTSUBSCRIBE|MQTTQOS1,this->buffer,length-MQTT_MAX_HEADER_SIZE);
     }
-    return false;
+    return rc;
+}
+
+uint8_t PubSubClient::getSubscriptionStatus(const char* topic) {
+    uint8_t index = findSubscription(topic);
+    if (index == MQTT_MAX_SUBSCRIPTIONS) {
+        return MQTT_SUBACK_FAILURE;
+    }
+    return this->subscriptions[index].status;
 }
 
 boolean PubSubClient::unsubscribe(const char* topic) {
@@ -645,26 +1547,35 @@ boolean PubSubClient::unsubscribe(const char* topic) {
     }
     if (connected()) {
         uint16_t length = MQTT_MAX_HEADER_SIZE;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
+        uint16_t msgId = nextPacketId();
+        this->outBuffer[length++] = (msgId >> 8);
+        this->outBuffer[length++] = (msgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+        this->outBuffer[length++] = 0; // no properties
+#endif
+        length = writeString(topic, this->outBuffer,length);
+        if (this->router) {
+            this->router->remove(topic);
         }
-        this->buffer[length++] = (nextMsgId >> 8);
-        this->buffer[length++] = (nextMsgId & 0xFF);
-        length = writeString(topic, this->buffer,length);
-        return write(MQTTUNSUBSCRIBE|MQTTQOS1,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+        uint8_t index = findSubscription(topic);
+        if (index != MQTT_MAX_SUBSCRIPTIONS) {
+            removeSubscription(index);
+        }
+        return write(MQTTUNSUBSCRIBE|MQTTQOS1,this->outBuffer,length-MQTT_MAX_HEADER_SIZE);
     }
     return false;
 }
 
 void PubSubClient::disconnect() {
-    this->buffer[0] = MQTTDISCONNECT;
-    this->buffer[1] = 0;
-    _client->write(this->buffer,2);
+    this->outBuffer[0] = MQTTDISCONNECT;
+    this->outBuffer[1] = 0;
+    transmit(this->outBuffer,2);
+    flush();
     _state = MQTT_DISCONNECTED;
+    this->connectPhase = MQTT_PHASE_IDLE;
     _client->flush();
     _client->stop();
-    lastInActivity = lastOutActivity = millis();
+    lastInActivity = lastOutActivity = now();
 }
 
 uint16_t PubSubClient::writeString(const char* string, uint8_t* buf, uint16_t pos) {
@@ -723,6 +1634,30 @@ PubSubClient& PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE) {
     return *this;
 }
 
+PubSubClient& PubSubClient::setClock(MQTT_CLOCK_SIGNATURE) {
+    this->clock = clock;
+    return *this;
+}
+
+unsigned long PubSubClient::now() {
+    if (this->clock) {
+        return this->clock();
+    }
+    return millis();
+}
+
+PubSubClient& PubSubClient::setViewCallback(MQTT_VIEW_CALLBACK_SIGNATURE) {
+    this->viewCallback = viewCallback;
+    return *this;
+}
+
+PubSubClient& PubSubClient::setChunkCallbacks(MQTT_BEGIN_CALLBACK_SIGNATURE, MQTT_CHUNK_CALLBACK_SIGNATURE, MQTT_END_CALLBACK_SIGNATURE) {
+    this->beginCallback = beginCallback;
+    this->chunkCallback = chunkCallback;
+    this->endCallback = endCallback;
+    return *this;
+}
+
 PubSubClient& PubSubClient::setClient(Client& client){
     this->_client = &client;
     return *this;
@@ -737,23 +1672,33 @@ int PubSubClient::state() {
     return this->_state;
 }
 
+uint8_t PubSubClient::getReasonCode() {
+    return this->reasonCode;
+}
+
 boolean PubSubClient::setBufferSize(uint16_t size) {
     if (size == 0) {
         // Cannot set it back to 0
         return false;
     }
-    if (this->bufferSize == 0) {
-        this->buffer = (uint8_t*)malloc(size);
-    } else {
-        uint8_t* newBuffer = (uint8_t*)realloc(this->buffer, size);
-        if (newBuffer != NULL) {
-            this->buffer = newBuffer;
-        } else {
-            return false;
+    if (size == this->bufferSize) {
+        return true;
+    }
+    // The old blocks are only freed once the new ones are allocated
+    if (!this->buffers.begin(size,2)) {
+        if (this->bufferSize == 0) {
+            this->buffer = this->outBuffer = NULL;
         }
+        return false;
     }
+    this->buffer = this->buffers.take();
+    this->outBuffer = this->buffers.take();
     this->bufferSize = size;
-    return (this->buffer != NULL);
+    if (this->inflight && getInflightCount() == 0) {
+        // Let the in-flight slots pick up the new size
+        return allocInflight();
+    }
+    return true;
 }
 
 uint16_t PubSubClient::getBufferSize() {
@@ -763,6 +1708,58 @@ PubSubClient& PubSubClient::setKeepAlive(uint16_t keepAlive) {
     this->keepAlive = keepAlive;
     return *this;
 }
+boolean PubSubClient::setTxBuffer(uint16_t size, uint16_t delay) {
+    flush();
+    free(this->txBuffer);
+    this->txBuffer = NULL;
+    this->txBufferSize = 0;
+    this->txDelay = delay;
+    if (size == 0) {
+        return true;
+    }
+    this->txBuffer = (uint8_t*)malloc(size);
+    if (this->txBuffer == NULL) {
+        return false;
+    }
+    this->txBufferSize = size;
+    return true;
+}
+
+PubSubClient& PubSubClient::setRetryTimeout(uint16_t timeout) {
+    this->retryTimeout = timeout;
+    return *this;
+}
+
+boolean PubSubClient::setMaxInflight(uint8_t count) {
+    if (count == 0 || getInflightCount() > 0) {
+        return false;
+    }
+    if (count > MQTT_BLOCK_POOL_MAX_BLOCKS) {
+        return false;
+    }
+    this->maxInflight = count;
+    return allocInflight();
+}
+
+uint8_t PubSubClient::getMaxInflight() {
+#if MQTT_VERSION == MQTT_VERSION_5
+    if (this->serverReceiveMaximum < this->maxInflight) {
+        return this->serverReceiveMaximum;
+    }
+#endif
+    return this->maxInflight;
+}
+
+uint8_t PubSubClient::getInflightCount() {
+    uint8_t count = 0;
+    for (uint8_t i = 0; this->inflight && i < this->maxInflight; i++) {
+        if (this->inflight[i].msgId != 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
 PubSubClient& PubSubClient::setSocketTimeout(uint16_t timeout) {
     this->socketTimeout = timeout;
     return *this;
@@ -11,9 +11,12 @@
 #include "IPAddress.h"
 #include "Client.h"
 #include "Stream.h"
+#include "MqttRouter.h"
+#include "MqttBlockPool.h"
 
 #define MQTT_VERSION_3_1      3
 #define MQTT_VERSION_3_1_1    4
+#define MQTT_VERSION_5        5
 
 // MQTT_VERSION : Pick the version
 //#define MQTT_VERSION MQTT_VERSION_3_1
@@ -21,6 +24,20 @@
 #define MQTT_VERSION MQTT_VERSION_3_1_1
 #endif
 
+#if MQTT_VERSION == MQTT_VERSION_5
+// MQTT_MAX_TOPIC_ALIASES : number of topics published with a 2-byte topic alias
+//  instead of their name (MQTT 5 only). The first topics published get them,
+//  up to the Topic Alias Maximum the server allows.
+#ifndef MQTT_MAX_TOPIC_ALIASES
+#define MQTT_MAX_TOPIC_ALIASES 4
+#endif
+
+// MQTT_TOPIC_ALIAS_LENGTH : longest topic, plus 1, that can be given an alias
+#ifndef MQTT_TOPIC_ALIAS_LENGTH
+#define MQTT_TOPIC_ALIAS_LENGTH 32
+#endif
+#endif
+
 // MQTT_MAX_PACKET_SIZE : Maximum packet size. Override with setBufferSize().
 #ifndef MQTT_MAX_PACKET_SIZE
 #define MQTT_MAX_PACKET_SIZE 256
@@ -41,6 +58,69 @@
 //  pass the entire MQTT packet in each write call.
 //#define MQTT_MAX_TRANSFER_SIZE 80
 
+// MQTT_BACKOFF_MIN / MQTT_BACKOFF_MAX : time in milliseconds loop() waits
+//  before retrying a connection started by beginConnect(). It starts at the
+//  minimum and doubles after each failure, up to the maximum. Override with
+//  setBackoff()
+#ifndef MQTT_BACKOFF_MIN
+#define MQTT_BACKOFF_MIN 1000
+#endif
+#ifndef MQTT_BACKOFF_MAX
+#define MQTT_BACKOFF_MAX 30000
+#endif
+
+// MQTT_MAX_SUBSCRIPTIONS : number of subscriptions the client remembers and
+//  restores after reconnecting
+#ifndef MQTT_MAX_SUBSCRIPTIONS
+#define MQTT_MAX_SUBSCRIPTIONS 8
+#endif
+
+// MQTT_SUBSCRIPTION_TOPICS_SIZE : bytes available to hold copies of the
+//  remembered subscription topics (each takes its length + 1)
+#ifndef MQTT_SUBSCRIPTION_TOPICS_SIZE
+#define MQTT_SUBSCRIPTION_TOPICS_SIZE 128
+#endif
+
+// MQTT_TX_BUFFER_SIZE : size of the buffer used to combine outgoing packets into
+//  fewer, larger writes. 0 sends every packet as soon as it is built.
+//  Override with setTxBuffer()
+#ifndef MQTT_TX_BUFFER_SIZE
+#define MQTT_TX_BUFFER_SIZE 0
+#endif
+
+// MQTT_TX_DELAY : time in milliseconds that loop() lets packets wait in the
+//  transmit buffer for others to join them. Override with setTxBuffer()
+#ifndef MQTT_TX_DELAY
+#define MQTT_TX_DELAY 10
+#endif
+
+// MQTT_READ_CHUNK_SIZE : size of the stack scratch area used to drain the part of
+//  an inbound packet that does not fit in the buffer (streamed or dropped messages)
+#ifndef MQTT_READ_CHUNK_SIZE
+#define MQTT_READ_CHUNK_SIZE 64
+#endif
+
+// MQTT_MAX_INFLIGHT : number of QoS 1 and 2 messages that can be waiting to be
+//  acknowledged at the same time. Each takes a packet of the buffer size,
+//  allocated with the client, so keep it small on boards with little RAM.
+//  Override with setMaxInflight()
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 8
+#endif
+
+// MQTT_RETRY_TIMEOUT : time in Seconds to wait for a PUBACK, PUBREC or PUBCOMP
+//  before the PUBLISH or PUBREL is resent. Override with setRetryTimeout()
+#ifndef MQTT_RETRY_TIMEOUT
+#define MQTT_RETRY_TIMEOUT 10
+#endif
+
+// MQTT_MAX_INCOMING_QOS2 : number of inbound QoS 2 messages that can be waiting
+//  for their PUBREL. Each takes 2 bytes. Further QoS 2 messages are left
+//  unacknowledged (so the server sends them again) until one completes.
+#ifndef MQTT_MAX_INCOMING_QOS2
+#define MQTT_MAX_INCOMING_QOS2 8
+#endif
+
 // Possible values for client.state()
 #define MQTT_CONNECTION_TIMEOUT     -4
 #define MQTT_CONNECTION_LOST        -3
@@ -53,6 +133,13 @@
 #define MQTT_CONNECT_BAD_CREDENTIALS 4
 #define MQTT_CONNECT_UNAUTHORIZED    5
 
+// Possible values for client.getConnectPhase()
+#define MQTT_PHASE_IDLE           0 // Not using beginConnect(), or disconnect() was called
+#define MQTT_PHASE_TCP_CONNECTING 1 // Opening the network connection and sending CONNECT
+#define MQTT_PHASE_AWAIT_CONNACK  2 // Waiting for the server to accept the connection
+#define MQTT_PHASE_CONNECTED      3
+#define MQTT_PHASE_BACKOFF        4 // Waiting to retry after a failure or lost connection
+
 #define MQTTCONNECT     1 << 4  // Client request to connect to Server
 #define MQTTCONNACK     2 << 4  // Connect Acknowledgment
 #define MQTTPUBLISH     3 << 4  // Publish message
@@ -72,46 +159,248 @@
 #define MQTTQOS0        (0 << 1)
 #define MQTTQOS1        (1 << 1)
 #define MQTTQOS2        (2 << 1)
+#define MQTTDUP         (1 << 3)
+
+// MQTT 5 properties used by the client
+#define MQTT_PROP_SERVER_KEEP_ALIVE     0x13
+#define MQTT_PROP_RECEIVE_MAXIMUM       0x21
+#define MQTT_PROP_TOPIC_ALIAS_MAXIMUM   0x22
+#define MQTT_PROP_TOPIC_ALIAS           0x23
+#define MQTT_PROP_MAXIMUM_PACKET_SIZE   0x27
+
+// Possible values for getSubscriptionStatus(), besides the granted QoS
+#define MQTT_SUBACK_FAILURE 0x80 // Rejected by the server, or not subscribed
+#define MQTT_SUBACK_PENDING 0xFF // Waiting for the SUBACK
 
 // Maximum size of fixed header and variable length size header
 #define MQTT_MAX_HEADER_SIZE 5
+// Room needed after the topic (and message id) of a PUBLISH for its properties
+#if MQTT_VERSION == MQTT_VERSION_5
+#define MQTT_PUBLISH_PROPERTIES_SIZE 4
+#else
+#define MQTT_PUBLISH_PROPERTIES_SIZE 0
+#endif
+// Largest value the remaining length field can hold
+#define MQTT_MAX_REMAINING_LENGTH 268435455UL
+
+// Inbound packet parser states
+#define MQTT_RX_HEADER  0  // Waiting for the fixed header byte
+#define MQTT_RX_LENGTH  1  // Reading the remaining length field
+#define MQTT_RX_BODY    2  // Reading the variable header and payload
 
 #if defined(ESP8266) || defined(ESP32)
 #include <functional>
 #define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+#define MQTT_VIEW_CALLBACK_SIGNATURE std::function<void(const char*, uint16_t, const uint8_t*, uint32_t)> viewCallback
+#define MQTT_BEGIN_CALLBACK_SIGNATURE std::function<void(const char*, uint16_t, uint32_t)> beginCallback
+#define MQTT_CHUNK_CALLBACK_SIGNATURE std::function<void(const uint8_t*, uint32_t, uint32_t, uint32_t)> chunkCallback
+#define MQTT_END_CALLBACK_SIGNATURE std::function<void(void)> endCallback
+#define MQTT_CLOCK_SIGNATURE std::function<unsigned long(void)> clock
 #else
 #define MQTT_CALLBACK_SIGNATURE void (*callback)(char*, uint8_t*, unsigned int)
+#define MQTT_VIEW_CALLBACK_SIGNATURE void (*viewCallback)(const char*, uint16_t, const uint8_t*, uint32_t)
+#define MQTT_BEGIN_CALLBACK_SIGNATURE void (*beginCallback)(const char*, uint16_t, uint32_t)
+#define MQTT_CHUNK_CALLBACK_SIGNATURE void (*chunkCallback)(const uint8_t*, uint32_t, uint32_t, uint32_t)
+#define MQTT_END_CALLBACK_SIGNATURE void (*endCallback)(void)
+#define MQTT_CLOCK_SIGNATURE unsigned long (*clock)(void)
 #endif
 
 #define CHECK_STRING_LENGTH(l,s) if (l+2+strnlen(s, this->bufferSize) > this->bufferSize) {_client->stop();return false;}
 
+// Keeps the QoS 1 and 2 messages waiting to be acknowledged somewhere that
+// outlives the client (eg. flash), so a persistent session (cleanSession
+// false) can carry on after a restart. Each is saved as its fixed header byte
+// and the rest of the packet: a PUBLISH, or the PUBREL that replaces it once
+// a QoS 2 message has been received.
+class MqttSessionStore {
+public:
+   virtual ~MqttSessionStore() {}
+   // Saves the packet for msgId, replacing any saved before. Returns false if
+   // there is no room
+   virtual boolean save(uint16_t msgId, uint8_t header, const uint8_t* packet, uint16_t length) = 0;
+   // Forgets the packet for msgId once it has been acknowledged
+   virtual void remove(uint16_t msgId) = 0;
+   // Copies the index'th saved packet into packet. Returns its length, or 0 if
+   // it cannot be read or does not fit in size bytes
+   virtual uint16_t load(uint8_t index, uint16_t* msgId, uint8_t* header, uint8_t* packet, uint16_t size) = 0;
+   virtual uint8_t count() = 0;
+};
+
 class PubSubClient : public Print {
 private:
    Client* _client;
+   // Inbound packets are read into buffer and outbound ones built in
+   // outBuffer, so a message can be answered from its callback while its
+   // topic and payload are still in use. Both are blocks of bufferSize bytes
+   // from one allocation, made by setBufferSize()
+   MqttBlockPool buffers;
    uint8_t* buffer;
+   uint8_t* outBuffer;
    uint16_t bufferSize;
    uint16_t keepAlive;
+   // Keep alive for the current connection: keepAlive, unless the server
+   // asked for another in its CONNACK
+   uint16_t activeKeepAlive;
    uint16_t socketTimeout;
    uint16_t nextMsgId;
    unsigned long lastOutActivity;
    unsigned long lastInActivity;
    bool pingOutstanding;
    MQTT_CALLBACK_SIGNATURE;
+   MQTT_VIEW_CALLBACK_SIGNATURE;
+   MQTT_BEGIN_CALLBACK_SIGNATURE;
+   MQTT_CHUNK_CALLBACK_SIGNATURE;
+   MQTT_END_CALLBACK_SIGNATURE;
+   MQTT_CLOCK_SIGNATURE;
+   // Milliseconds from the clock set with setClock(), or millis()
+   unsigned long now();
+   MqttRouter* router;
+   // Inbound packet parser state - carried across calls to loop() so that a
+   // packet arriving in fragments never blocks waiting for the rest of it
+   uint8_t rxState;
+   uint8_t rxLengthLength;
+   uint16_t rxBufferLen;
+   uint32_t rxLength;
+   uint32_t rxMultiplier;
+   uint32_t rxIndex;
+   uint32_t rxPayloadStart;
+   boolean rxChunked;
+   // Outbound QoS 1 and 2 messages waiting to be acknowledged. Each slot keeps
+   // its own copy of the packet (with MQTT_MAX_HEADER_SIZE bytes of room for the
+   // fixed header) so it can be resent without the caller holding on to the
+   // payload. Once a QoS 2 message has its PUBREC the slot holds the PUBREL.
+   struct Inflight {
+      uint16_t msgId;                // 0 if the slot is free
+      uint8_t header;                // PUBLISH (waiting for PUBACK/PUBREC) or PUBREL (waiting for PUBCOMP)
+      uint16_t length;               // remaining length of the packet
+      unsigned long sentAt;
+      uint8_t* packet;
+   };
+   Inflight* inflight;
+   MqttBlockPool inflightPackets;    // one block of packet storage per slot
+   uint8_t maxInflight;
+   uint16_t inflightSize;            // bytes of packet storage per slot
+   uint16_t retryTimeout;
+   // (Re)allocates the slots, and a packet of the buffer size for each. All
+   // of them must be free
+   boolean allocInflight();
+   Inflight* findInflight(uint16_t msgId);
+   // Frees the slot once its message has been acknowledged
+   void releaseInflight(Inflight* slot);
+   MqttSessionStore* sessionStore;
+   boolean sessionPresent;
+   void resendInflight(unsigned long t, boolean all);
+   // After connecting to a new session: sends each PUBLISH again as a new
+   // message and drops the PUBRELs the server cannot match
+   void replayInflight(unsigned long t);
+   uint16_t nextPacketId();
+   // Ids of inbound QoS 2 messages that have been delivered but not yet
+   // released, so that a resent PUBLISH is not delivered twice (0 = free)
+   uint16_t incoming[MQTT_MAX_INCOMING_QOS2];
+   uint8_t findIncoming(uint16_t msgId);
+   boolean addIncoming(uint16_t msgId);
+   // The subscription set, restored after every reconnect
+   struct Subscription {
+      uint16_t topic;                // offset of the topic in subscriptionTopics
+      uint16_t msgId;                // SUBSCRIBE waiting for its SUBACK, 0 if none
+      uint8_t qos;                   // requested QoS
+      uint8_t status;                // granted QoS, MQTT_SUBACK_FAILURE or MQTT_SUBACK_PENDING
+   };
+   Subscription subscriptions[MQTT_MAX_SUBSCRIPTIONS];
+   char subscriptionTopics[MQTT_SUBSCRIPTION_TOPICS_SIZE];
+   uint8_t subscriptionCount;
+   uint16_t subscriptionTopicsLength;
+   uint8_t findSubscription(const char* topic);
+   void removeSubscription(uint8_t index);
+   // Sends every subscription that is pending and not yet sent, packing as
+   // many as fit in the buffer into each SUBSCRIBE packet
+   boolean sendSubscriptions();
    uint32_t readPacket(uint8_t*);
-   boolean readByte(uint8_t * result);
-   boolean readByte(uint8_t * result, uint16_t * index);
+   uint32_t readBytes(uint8_t * result, uint32_t size);
+   void resetPacket();
+   // Outgoing packets waiting to be sent as one write (see setTxBuffer)
+   uint8_t* txBuffer;
+   uint16_t txBufferSize;
+   uint16_t txLength;
+   uint16_t txDelay;
+   unsigned long txStart;            // when the oldest waiting packet was added
+   // Everything sent goes through transmit(), which adds it to the transmit
+   // buffer when there is one; writeClient() passes it to the network client
+   size_t transmit(const uint8_t* buf, size_t size);
+   size_t writeClient(const uint8_t* buf, size_t size);
    boolean write(uint8_t header, uint8_t* buf, uint16_t length);
    uint16_t writeString(const char* string, uint8_t* buf, uint16_t pos);
    // Build up the header ready to send
    // Returns the size of the header
    // Note: the header is built at the end of the first MQTT_MAX_HEADER_SIZE bytes, so will start
    //       (MQTT_MAX_HEADER_SIZE - <returned size>) bytes into the buffer
-   size_t buildHeader(uint8_t header, uint8_t* buf, uint16_t length);
+   size_t buildHeader(uint8_t header, uint8_t* buf, uint32_t length);
+   boolean sendConnect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
+   // Handles the CONNACK held in the buffer. Returns true if the server accepted the connection
+   boolean connack(uint8_t llen, uint32_t len);
+   // Writes the topic, the message id (if not 0) and, for MQTT 5, the
+   // properties of a PUBLISH. With useAlias the topic is replaced by its alias
+   // where it has one.
+   uint16_t writePublishHeader(const char* topic, uint16_t topicLength, uint16_t msgId, boolean useAlias, uint8_t* buf, uint16_t pos);
+   // Writes an in-flight packet, using a topic alias for a PUBLISH where possible
+   boolean writeInflight(Inflight* slot, uint8_t header);
+   // Returns false if a packet with this remaining length is larger than the
+   // server accepts
+   boolean fitsServer(uint32_t length);
+   // Returns the position of the payload of the PUBLISH in the buffer, or 0
+   // if not enough of it has arrived to tell
+   uint32_t payloadOffset(uint8_t llen, uint32_t available);
+   // Returns the message id of the PUBLISH in the buffer
+   uint16_t publishMsgId(uint8_t llen);
+   uint8_t reasonCode;
+   // Forgets the limits and topic aliases of the previous connection
+   void resetServerLimits();
+#if MQTT_VERSION == MQTT_VERSION_5
+   // Limits announced by the server in its CONNACK
+   uint16_t serverReceiveMaximum;
+   uint32_t serverMaximumPacketSize;
+   uint16_t topicAliasMaximum;
+   // Topics given an alias; aliasSent marks those the server knows about on
+   // the current connection
+   char aliasTopics[MQTT_MAX_TOPIC_ALIASES][MQTT_TOPIC_ALIAS_LENGTH];
+   boolean aliasSent[MQTT_MAX_TOPIC_ALIASES];
+   uint8_t aliasCount;
+   uint16_t topicAlias(const char* topic, uint16_t topicLength);
+   // Reads the variable byte integer at pos. Returns its size, or 0 if it does
+   // not end before end
+   uint8_t readVarint(uint32_t pos, uint32_t end, uint32_t* value);
+   // Reads the property at pos. Returns the position of the next one, or 0 if
+   // it is malformed or runs past end
+   uint32_t readProperty(uint32_t pos, uint32_t end, uint8_t* id, uint32_t* value);
+   // Maps a CONNACK reason code of 0x80 or more to the MQTT_CONNECT_* value
+   // state() reports
+   int connectRefusedState(uint8_t reasonCode);
+#endif
+   // Connection started by beginConnect(), driven by loop()
+   uint8_t connectPhase;
+   const char* connectId;
+   const char* connectUser;
+   const char* connectPass;
+   const char* connectWillTopic;
+   const char* connectWillMessage;
+   uint8_t connectWillQos;
+   boolean connectWillRetain;
+   boolean connectCleanSession;
+   unsigned long connectAt;          // when the current backoff started
+   uint16_t connectBackoff;
+   uint16_t connectFailures;
+   uint16_t backoffMin;
+   uint16_t backoffMax;
+   void connectStep();
+   void enterBackoff(unsigned long t);
    IPAddress ip;
    const char* domain;
    uint16_t port;
    Stream* stream;
    int _state;
+   // Shared by the constructors: everything but the server, client, callback
+   // and stream
+   void init();
 public:
    PubSubClient();
    PubSubClient(Client& client);
@@ -134,11 +423,59 @@ public:
    PubSubClient& setServer(uint8_t * ip, uint16_t port);
    PubSubClient& setServer(const char * domain, uint16_t port);
    PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE);
+   // Set a callback that is given the topic and payload as views into the
+   // receive buffer: (topic, topicLength, payload, payloadLength). The topic
+   // is not NUL-terminated and nothing is copied or moved to deliver it.
+   // Takes precedence over the callback set with setCallback().
+   // The views are only valid until the callback returns.
+   PubSubClient& setViewCallback(MQTT_VIEW_CALLBACK_SIGNATURE);
+   // Set callbacks used to receive messages that are too big for the buffer.
+   // Instead of being dropped, such a message is delivered as:
+   //   begin(topic, topicLength, payloadLength)
+   //   chunk(data, offset, length, payloadLength) - one or more times, in order
+   //   end()
+   // The topic and chunk data are only valid until each callback returns.
+   // Messages that fit in the buffer still go to the normal callback, and the
+   // buffer must be large enough to hold the topic. Not used when a Stream is set.
+   PubSubClient& setChunkCallbacks(MQTT_BEGIN_CALLBACK_SIGNATURE, MQTT_CHUNK_CALLBACK_SIGNATURE, MQTT_END_CALLBACK_SIGNATURE);
+   // Sets where the keepalive, retry, backoff and timeout timers read the time
+   // from, in milliseconds. NULL (the default) uses millis()
+   PubSubClient& setClock(MQTT_CLOCK_SIGNATURE);
    PubSubClient& setClient(Client& client);
    PubSubClient& setStream(Stream& stream);
    PubSubClient& setKeepAlive(uint16_t keepAlive);
    PubSubClient& setSocketTimeout(uint16_t timeout);
+   // Set the time in seconds after which an unacknowledged QoS 1 or 2 message
+   // is resent (a PUBLISH with the DUP flag set, or a PUBREL)
+   PubSubClient& setRetryTimeout(uint16_t timeout);
+   // Combine outgoing packets into writes of up to size bytes, so that a burst
+   // of small packets goes out in one TCP segment. Waiting packets are sent
+   // when the buffer fills, by loop() once the oldest has waited delay
+   // milliseconds, and by flush(). A size of 0 sends every packet straight away.
+   // Returns false if the buffer cannot be allocated.
+   boolean setTxBuffer(uint16_t size, uint16_t delay);
+   // Set how many QoS 1 and 2 messages can be waiting to be acknowledged at
+   // once. Storage for them (count * the buffer size) is allocated here, and
+   // again by setBufferSize(). Returns false if there are messages in flight,
+   // count is more than MQTT_BLOCK_POOL_MAX_BLOCKS or the storage cannot be
+   // allocated.
+   boolean setMaxInflight(uint8_t count);
+   // Returns the size of the in-flight window, which with MQTT 5 is also
+   // limited by the server's Receive Maximum
+   uint8_t getMaxInflight();
+   // Returns the number of QoS 1 and 2 messages still waiting to be acknowledged
+   uint8_t getInflightCount();
+   // Save the messages waiting to be acknowledged in store as well, and load
+   // any it already holds back into flight to be resent once connected. Use
+   // with cleanSession false. Returns false if they do not all fit.
+   boolean setSessionStore(MqttSessionStore& store);
+   // Returns true if the server still held the session at the last connect,
+   // in which case the subscriptions were not sent again
+   boolean getSessionPresent();
 
+   // Allocates the receive and send buffers, size bytes each, and the
+   // in-flight slots to match when none are in use. Call it before
+   // connecting: anything they hold is lost
    boolean setBufferSize(uint16_t size);
    uint16_t getBufferSize();
 
@@ -148,10 +485,36 @@ public:
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
    void disconnect();
+   // Start connecting without waiting for the CONNACK. Each call to loop() then
+   // takes the connection one step further (see getConnectPhase()) and, if it
+   // fails or is later lost, tries again after a backoff (see setBackoff()).
+   // The TCP connect itself, including any DNS lookup for a domain set with
+   // setServer(), is the network client's and blocks that loop() until it
+   // succeeds or times out. Use setServer() with an IPAddress to skip the lookup.
+   // The strings are not copied, so they must stay valid until disconnect().
+   // Returns false if id is NULL.
+   boolean beginConnect(const char* id);
+   boolean beginConnect(const char* id, const char* user, const char* pass);
+   boolean beginConnect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
+   // Returns one of the MQTT_PHASE_* values
+   uint8_t getConnectPhase();
+   // Returns how many times loop() has backed off (a failed attempt or a lost
+   // connection) since beginConnect() or the last accepted CONNACK
+   uint16_t getConnectFailures();
+   // Set the shortest and longest time in milliseconds between attempts made by loop()
+   PubSubClient& setBackoff(uint16_t min, uint16_t max);
    boolean publish(const char* topic, const char* payload);
    boolean publish(const char* topic, const char* payload, boolean retained);
    boolean publish(const char* topic, const uint8_t * payload, unsigned int plength);
+   // The payload is written straight from the caller's memory, so only the
+   // topic has to fit in the buffer
    boolean publish(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
+   // Publish at QoS 0, 1 or 2. A QoS 1 or 2 message is sent straight away
+   // without waiting for earlier ones to be acknowledged; it is kept until its
+   // PUBACK (or PUBCOMP) arrives and is resent by loop() after the retry timeout,
+   // and by connect() after a reconnect. Returns false if the message is too big
+   // for the buffer or all setMaxInflight() slots are in use.
+   boolean publish(const char* topic, const uint8_t * payload, unsigned int plength, uint8_t qos, boolean retained);
    boolean publish_P(const char* topic, const char* payload, boolean retained);
    boolean publish_P(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
    // Start to publish a message.
@@ -171,12 +534,35 @@ public:
    // Write size bytes from buffer into the payload (only to be used with beginPublish/endPublish)
    // Returns the number of bytes written
    virtual size_t write(const uint8_t *buffer, size_t size);
+   // Send any packets waiting in the transmit buffer
+   virtual void flush();
    boolean subscribe(const char* topic);
    boolean subscribe(const char* topic, uint8_t qos);
+   // Subscribe to topic (which may contain '+' and '#' wildcards) and route
+   // matching messages to handler instead of the callback. The handler stays
+   // registered if the SUBSCRIBE cannot be sent. topic is not copied and must
+   // remain valid while subscribed.
+   boolean subscribe(const char* topic, uint8_t qos, MQTT_HANDLER_SIGNATURE);
+   // Subscribe to count topics, each at the matching qos, in a single SUBSCRIBE
+   // packet (or as few as fit in the buffer). Topics are copied into the
+   // client's subscription set, which is subscribed again, in one packet,
+   // after every reconnect. Returns false if a topic or qos is invalid or the
+   // set is full (see MQTT_MAX_SUBSCRIPTIONS).
+   boolean subscribe(const char* topics[], const uint8_t* qos, uint8_t count);
+   // Returns the QoS the server granted for topic, MQTT_SUBACK_PENDING until
+   // the SUBACK arrives, or MQTT_SUBACK_FAILURE if it was rejected or topic is
+   // not in the subscription set
+   uint8_t getSubscriptionStatus(const char* topic);
+   // Route messages matching filter to handler without subscribing to it, eg.
+   // to then subscribe to several filters at once
+   boolean addHandler(const char* filter, MQTT_HANDLER_SIGNATURE);
    boolean unsubscribe(const char* topic);
    boolean loop();
    boolean connected();
    int state();
+   // Returns the reason code of the last CONNACK, PUBACK, PUBREC, PUBCOMP or
+   // DISCONNECT received (always 0 before MQTT 5)
+   uint8_t getReasonCode();
 
 };
 
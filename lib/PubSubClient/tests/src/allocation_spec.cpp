@@ -0,0 +1,218 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "AllocTracker.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+// Everything is set up (connected, router allocated) before
+// AllocTracker::start(), so only the steady state is counted. The in-flight
+// slots and the subscription set are allocated with the client.
+
+byte server[] = { 172, 16, 0, 2 };
+
+int callback_calls = 0;
+int view_calls = 0;
+int handler_calls = 0;
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    callback_calls++;
+}
+
+void view_callback(const char* topic, uint16_t topicLength, const uint8_t* payload, uint32_t length) {
+    view_calls++;
+}
+
+void handler(const char* topic, uint16_t topicLength, const uint8_t* payload, uint32_t length) {
+    handler_calls++;
+}
+
+boolean allocated_nothing() {
+    return AllocTracker::allocations() == 0 && AllocTracker::reallocations() == 0 && AllocTracker::frees() == 0;
+}
+
+void connect(PubSubClient& client, ShimClient& shimClient) {
+    shimClient.setAllowConnect(true);
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    client.connect((char*)"client_test1");
+}
+
+int test_allocation_publish() {
+    IT("publishes at QoS 0 without allocating or copying the payload twice");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883, callback, shimClient);
+    connect(client,shimClient);
+    IS_TRUE(client.connected());
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+    uint32_t written = shimClient.bytesWritten();
+
+    AllocTracker::start();
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload"));
+    AllocTracker::stop();
+
+    IS_TRUE(allocated_nothing());
+    IS_TRUE(shimClient.bytesWritten()-written == 16);
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_allocation_publish_qos1() {
+    IT("publishes at QoS 1 without allocating, the first time too");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883, callback, shimClient);
+    connect(client,shimClient);
+    IS_TRUE(client.connected());
+
+    uint8_t payload[] = "payload";
+    byte puback1[] = { 0x40, 0x02, 0x00, 0x02 };
+    shimClient.respond(puback1,4);
+    byte puback2[] = { 0x40, 0x02, 0x00, 0x03 };
+    shimClient.respond(puback2,4);
+    uint32_t written = shimClient.bytesWritten();
+
+    AllocTracker::start();
+    IS_TRUE(client.publish("topic",payload,7,1,false));
+    IS_TRUE(client.getInflightCount() == 1);
+    IS_TRUE(client.loop());
+    IS_TRUE(client.getInflightCount() == 0);
+    IS_TRUE(client.publish("topic",payload,7,1,false));
+    IS_TRUE(client.loop());
+    AllocTracker::stop();
+
+    IS_TRUE(allocated_nothing());
+    IS_TRUE(client.getInflightCount() == 0);
+    IS_TRUE(shimClient.bytesWritten()-written == 36);
+
+    END_IT
+}
+
+int test_allocation_receive_callback() {
+    IT("receives into the callback without allocating or reading a byte twice");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883, callback, shimClient);
+    connect(client,shimClient);
+    IS_TRUE(client.connected());
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,16);
+    byte publishQos1[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publishQos1,18);
+    callback_calls = 0;
+    uint32_t read = shimClient.bytesRead();
+    uint32_t written = shimClient.bytesWritten();
+
+    AllocTracker::start();
+    IS_TRUE(client.loop());
+    IS_TRUE(client.loop());
+    AllocTracker::stop();
+
+    IS_TRUE(allocated_nothing());
+    IS_TRUE(callback_calls == 2);
+    IS_TRUE(shimClient.bytesRead()-read == 34);
+    // Just the PUBACK
+    IS_TRUE(shimClient.bytesWritten()-written == 4);
+
+    END_IT
+}
+
+int test_allocation_receive_view() {
+    IT("receives into the view callback without allocating");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setViewCallback(view_callback);
+    connect(client,shimClient);
+    IS_TRUE(client.connected());
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,16);
+    view_calls = 0;
+
+    AllocTracker::start();
+    IS_TRUE(client.loop());
+    AllocTracker::stop();
+
+    IS_TRUE(allocated_nothing());
+    IS_TRUE(view_calls == 1);
+
+    END_IT
+}
+
+int test_allocation_receive_router() {
+    IT("dispatches to topic handlers without allocating");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883, callback, shimClient);
+    connect(client,shimClient);
+    IS_TRUE(client.connected());
+    IS_TRUE(client.addHandler("door/+",handler));
+
+    byte publish[] = {0x30,0xd,0x0,0x6,0x64,0x6f,0x6f,0x72,0x2f,0x61,0x6f,0x70,0x65,0x6e,0x21};
+    shimClient.respond(publish,15);
+    handler_calls = 0;
+    callback_calls = 0;
+
+    AllocTracker::start();
+    IS_TRUE(client.loop());
+    AllocTracker::stop();
+
+    IS_TRUE(allocated_nothing());
+    IS_TRUE(handler_calls == 1);
+    IS_TRUE(callback_calls == 0);
+
+    END_IT
+}
+
+int test_allocation_subscribe() {
+    IT("subscribes without allocating");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883, callback, shimClient);
+    connect(client,shimClient);
+    IS_TRUE(client.connected());
+
+    AllocTracker::start();
+    IS_TRUE(client.subscribe("door/+",1));
+    AllocTracker::stop();
+
+    IS_TRUE(allocated_nothing());
+
+    END_IT
+}
+
+int test_allocation_tracker() {
+    IT("counts allocations made while tracking");
+    AllocTracker::start();
+    void* p = malloc(16);
+    p = realloc(p,32);
+    free(p);
+    int* i = new int(1);
+    delete i;
+    AllocTracker::stop();
+
+    IS_TRUE(AllocTracker::allocations() == 2);
+    IS_TRUE(AllocTracker::reallocations() == 1);
+    IS_TRUE(AllocTracker::frees() == 2);
+    IS_TRUE(AllocTracker::bytes() >= 16+32+sizeof(int));
+
+    // Nothing is counted once stopped
+    free(malloc(16));
+    IS_TRUE(AllocTracker::allocations() == 2);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Allocation");
+    test_allocation_tracker();
+    test_allocation_publish();
+    test_allocation_publish_qos1();
+    test_allocation_subscribe();
+    test_allocation_receive_callback();
+    test_allocation_receive_view();
+    test_allocation_receive_router();
+
+    FINISH
+}
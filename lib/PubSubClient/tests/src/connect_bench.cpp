@@ -0,0 +1,80 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "Bench.h"
+#include "trace.h"
+#include <sstream>
+
+// Measures connect latency through a ShimClient, from the call until the
+// CONNACK has been handled, for blocking connect() and for beginConnect()
+// driven by loop(). Each connection is closed with disconnect() outside the
+// timed part. Run with `make bench`.
+
+byte server[] = { 172, 16, 0, 2 };
+
+void callback(char* topic, byte* payload, unsigned int length) {
+}
+
+void bench_connect(boolean blocking, unsigned int idLength, boolean credentials, uint16_t bufferSize, unsigned long iterations) {
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setBufferSize(bufferSize);
+
+    char id[64];
+    memset(id,'c',idLength);
+    id[idLength] = '\0';
+    const char* user = credentials ? "door-user" : NULL;
+    const char* pass = credentials ? "door-password" : NULL;
+    const char* willTopic = credentials ? "doors/front/status" : NULL;
+    const char* willMessage = credentials ? "offline" : NULL;
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    BenchTimer timer;
+    unsigned long wireBytesPerOp = 0;
+    unsigned long connected = 0;
+    for (unsigned long i = 0; i < iterations; i++) {
+        shimClient.respond(connack,4);
+        uint16_t before = shimClient.received();
+        timer.start();
+        if (blocking) {
+            client.connect(id,user,pass,willTopic,1,true,willMessage,true);
+        } else {
+            client.beginConnect(id,user,pass,willTopic,1,true,willMessage,true);
+            while (client.getConnectPhase() != MQTT_PHASE_CONNECTED && client.getConnectPhase() != MQTT_PHASE_BACKOFF) {
+                client.loop();
+            }
+        }
+        timer.stop();
+        wireBytesPerOp = (uint16_t)(shimClient.received()-before);
+        if (client.connected()) {
+            connected++;
+        }
+        client.disconnect();
+    }
+
+    std::ostringstream params;
+    params << "mode=" << (blocking ? "blocking" : "loop") << " id=" << idLength
+           << " credentials=" << (credentials ? 1 : 0) << " buffer=" << bufferSize;
+    if (connected != iterations) {
+        params << " failed=" << (iterations-connected);
+    }
+    bench_report("connect",params.str(),iterations,timer.seconds(),wireBytesPerOp,0);
+}
+
+int main()
+{
+    const unsigned int ids[] = { 8, 23 };
+    const uint16_t buffers[] = { 256, 2048 };
+    for (int blocking = 1; blocking >= 0; blocking--) {
+        for (unsigned int i = 0; i < 2; i++) {
+            for (int credentials = 0; credentials < 2; credentials++) {
+                for (unsigned int b = 0; b < 2; b++) {
+                    bench_connect(blocking,ids[i],credentials,buffers[b],20000);
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -3,6 +3,7 @@
 #include "Buffer.h"
 #include "BDDTest.h"
 #include "trace.h"
+#include "VirtualClock.h"
 
 
 byte server[] = { 172, 16, 0, 2 };
@@ -29,8 +30,14 @@ int test_connect_fails_on_no_response() {
     ShimClient shimClient;
     shimClient.setAllowConnect(true);
     PubSubClient client(server, 1883, callback, shimClient);
+    // Lets connect() see time pass while it waits
+    VirtualClock::setAutoAdvance(1000);
+    uint32_t start = VirtualClock::now();
     int rc = client.connect((char*)"client_test1");
+    uint32_t waited = VirtualClock::now()-start;
+    VirtualClock::setAutoAdvance(0);
     IS_FALSE(rc);
+    IS_TRUE(waited >= 15000 && waited < 20000);
     int state = client.state();
     IS_TRUE(state == MQTT_CONNECTION_TIMEOUT);
     END_IT
@@ -312,6 +319,158 @@ int test_connect_custom_keepalive() {
 }
 
 
+int test_begin_connect() {
+    IT("connects without blocking from loop");
+    ShimClient shimClient;
+
+    shimClient.setAllowConnect(true);
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    shimClient.expect(connect,26);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_IDLE);
+
+    int rc = client.beginConnect("client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_TCP_CONNECTING);
+    IS_TRUE(shimClient.received() == 0);
+
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_AWAIT_CONNACK);
+    IS_FALSE(client.connected());
+
+    // Nothing has arrived yet
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_AWAIT_CONNACK);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_CONNECTED);
+    IS_TRUE(client.state() == MQTT_CONNECTED);
+    IS_FALSE(shimClient.error());
+
+    client.disconnect();
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_IDLE);
+
+    END_IT
+}
+
+int test_begin_connect_backoff() {
+    IT("waits before retrying a failed connection");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(false);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setBackoff(60000,60000);
+    IS_TRUE(client.beginConnect("client_test1"));
+
+    int rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_BACKOFF);
+    IS_TRUE(client.state() == MQTT_CONNECT_FAILED);
+    IS_TRUE(client.getConnectFailures() == 1);
+
+    // Still backing off
+    shimClient.setAllowConnect(true);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_BACKOFF);
+    IS_TRUE(shimClient.received() == 0);
+
+    client.setBackoff(0,0);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_AWAIT_CONNACK);
+    IS_TRUE(client.getConnectFailures() == 1);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_CONNECTED);
+    IS_TRUE(client.getConnectFailures() == 0);
+
+    END_IT
+}
+
+int test_begin_connect_timeout() {
+    IT("backs off if no connack arrives in time");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setSocketTimeout(0);
+    IS_TRUE(client.beginConnect("client_test1"));
+
+    client.loop();
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_AWAIT_CONNACK);
+    int rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_BACKOFF);
+    IS_TRUE(client.state() == MQTT_CONNECTION_TIMEOUT);
+
+    END_IT
+}
+
+int test_begin_connect_bad_rc() {
+    IT("backs off if the connection is refused");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x05 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.beginConnect("client_test1"));
+
+    client.loop();
+    int rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_BACKOFF);
+    IS_TRUE(client.state() == MQTT_CONNECT_UNAUTHORIZED);
+
+    END_IT
+}
+
+int test_begin_connect_reconnects() {
+    IT("reconnects from loop after losing the connection");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setBackoff(0,0);
+    IS_TRUE(client.beginConnect("client_test1"));
+    client.loop();
+    int rc = client.loop();
+    IS_TRUE(rc);
+
+    shimClient.setConnected(false);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_BACKOFF);
+    IS_TRUE(client.state() == MQTT_CONNECTION_LOST);
+
+    uint16_t received = shimClient.received();
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_AWAIT_CONNACK);
+    IS_TRUE(shimClient.received() == received+26);
+
+    shimClient.respond(connack,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getConnectPhase() == MQTT_PHASE_CONNECTED);
+
+    END_IT
+}
+
 int main()
 {
     SUITE("Connect");
@@ -332,5 +491,10 @@ int main()
     test_connect_disconnect_connect();
 
     test_connect_custom_keepalive();
+    test_begin_connect();
+    test_begin_connect_backoff();
+    test_begin_connect_timeout();
+    test_begin_connect_bad_rc();
+    test_begin_connect_reconnects();
     FINISH
 }
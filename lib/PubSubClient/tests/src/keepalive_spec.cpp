@@ -3,7 +3,7 @@
 #include "Buffer.h"
 #include "BDDTest.h"
 #include "trace.h"
-#include <unistd.h>
+#include "VirtualClock.h"
 
 byte server[] = { 172, 16, 0, 2 };
 
@@ -13,7 +13,7 @@ void callback(char* topic, byte* payload, unsigned int length) {
 
 
 int test_keepalive_pings_idle() {
-    IT("keeps an idle connection alive (takes 1 minute)");
+    IT("keeps an idle connection alive");
 
     ShimClient shimClient;
     shimClient.setAllowConnect(true);
@@ -31,7 +31,7 @@ int test_keepalive_pings_idle() {
     shimClient.respond(pingresp,2);
 
     for (int i = 0; i < 50; i++) {
-        sleep(1);
+        VirtualClock::advance(1000);
         if ( i == 15 || i == 31 || i == 47) {
             shimClient.expect(pingreq,2);
             shimClient.respond(pingresp,2);
@@ -46,7 +46,7 @@ int test_keepalive_pings_idle() {
 }
 
 int test_keepalive_pings_with_outbound_qos0() {
-    IT("keeps a connection alive that only sends qos0 (takes 1 minute)");
+    IT("keeps a connection alive that only sends qos0");
 
     ShimClient shimClient;
     shimClient.setAllowConnect(true);
@@ -66,7 +66,7 @@ int test_keepalive_pings_with_outbound_qos0() {
         rc = client.publish((char*)"topic",(char*)"payload");
         IS_TRUE(rc);
         IS_FALSE(shimClient.error());
-        sleep(1);
+        VirtualClock::advance(1000);
         if ( i == 15 || i == 31 || i == 47) {
             byte pingreq[] = { 0xC0,0x0 };
             shimClient.expect(pingreq,2);
@@ -82,7 +82,7 @@ int test_keepalive_pings_with_outbound_qos0() {
 }
 
 int test_keepalive_pings_with_inbound_qos0() {
-    IT("keeps a connection alive that only receives qos0 (takes 1 minute)");
+    IT("keeps a connection alive that only receives qos0");
 
     ShimClient shimClient;
     shimClient.setAllowConnect(true);
@@ -98,7 +98,7 @@ int test_keepalive_pings_with_inbound_qos0() {
 
     for (int i = 0; i < 50; i++) {
         TRACE(i<<":");
-        sleep(1);
+        VirtualClock::advance(1000);
         if ( i == 15 || i == 31 || i == 47) {
             byte pingreq[] = { 0xC0,0x0 };
             shimClient.expect(pingreq,2);
@@ -115,7 +115,7 @@ int test_keepalive_pings_with_inbound_qos0() {
 }
 
 int test_keepalive_no_pings_inbound_qos1() {
-    IT("does not send pings for connections with inbound qos1 (takes 1 minute)");
+    IT("does not send pings for connections with inbound qos1");
 
     ShimClient shimClient;
     shimClient.setAllowConnect(true);
@@ -133,7 +133,7 @@ int test_keepalive_no_pings_inbound_qos1() {
     for (int i = 0; i < 50; i++) {
         shimClient.respond(publish,18);
         shimClient.expect(puback,4);
-        sleep(1);
+        VirtualClock::advance(1000);
         rc = client.loop();
         IS_TRUE(rc);
         IS_FALSE(shimClient.error());
@@ -143,7 +143,7 @@ int test_keepalive_no_pings_inbound_qos1() {
 }
 
 int test_keepalive_disconnects_hung() {
-    IT("disconnects a hung connection (takes 30 seconds)");
+    IT("disconnects a hung connection");
 
     ShimClient shimClient;
     shimClient.setAllowConnect(true);
@@ -159,7 +159,7 @@ int test_keepalive_disconnects_hung() {
     shimClient.expect(pingreq,2);
 
     for (int i = 0; i < 32; i++) {
-        sleep(1);
+        VirtualClock::advance(1000);
         rc = client.loop();
     }
     IS_FALSE(rc);
@@ -172,6 +172,45 @@ int test_keepalive_disconnects_hung() {
     END_IT
 }
 
+unsigned long customTime = 0;
+
+unsigned long custom_clock() {
+    return customTime;
+}
+
+int test_keepalive_custom_clock() {
+    IT("reads the time from the clock set with setClock");
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setClock(custom_clock);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte pingreq[] = { 0xC0,0x0 };
+    shimClient.expect(pingreq,2);
+
+    // millis() moving on has no effect
+    uint16_t received = shimClient.received();
+    VirtualClock::advance(60000);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.received() == received);
+
+    customTime += 16000;
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.received() == received+2);
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int main()
 {
     SUITE("Keep-alive");
@@ -180,6 +219,7 @@ int main()
     test_keepalive_pings_with_inbound_qos0();
     test_keepalive_no_pings_inbound_qos1();
     test_keepalive_disconnects_hung();
+    test_keepalive_custom_clock();
 
     FINISH
 }
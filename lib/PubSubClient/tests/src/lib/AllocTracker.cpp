@@ -0,0 +1,110 @@
+#include "AllocTracker.h"
+#include <atomic>
+#include <new>
+#include <stddef.h>
+
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* ptr, size_t size);
+    void __libc_free(void* ptr);
+}
+
+static std::atomic<bool> tracking(false);
+static std::atomic<unsigned long> allocationCount(0);
+static std::atomic<unsigned long> reallocationCount(0);
+static std::atomic<unsigned long> freeCount(0);
+static std::atomic<unsigned long> byteCount(0);
+
+static void countAllocation(size_t size) {
+    if (tracking) {
+        allocationCount++;
+        byteCount += size;
+    }
+}
+
+static void countFree(void* ptr) {
+    if (tracking && ptr) {
+        freeCount++;
+    }
+}
+
+void AllocTracker::start() {
+    allocationCount = 0;
+    reallocationCount = 0;
+    freeCount = 0;
+    byteCount = 0;
+    tracking = true;
+}
+
+void AllocTracker::stop() {
+    tracking = false;
+}
+
+unsigned long AllocTracker::allocations() {
+    return allocationCount;
+}
+
+unsigned long AllocTracker::reallocations() {
+    return reallocationCount;
+}
+
+unsigned long AllocTracker::frees() {
+    return freeCount;
+}
+
+unsigned long AllocTracker::bytes() {
+    return byteCount;
+}
+
+extern "C" {
+    void* malloc(size_t size) {
+        countAllocation(size);
+        return __libc_malloc(size);
+    }
+    void* calloc(size_t count, size_t size) {
+        countAllocation(count*size);
+        return __libc_calloc(count,size);
+    }
+    void* realloc(void* ptr, size_t size) {
+        if (tracking) {
+            reallocationCount++;
+            byteCount += size;
+        }
+        return __libc_realloc(ptr,size);
+    }
+    void free(void* ptr) {
+        countFree(ptr);
+        __libc_free(ptr);
+    }
+}
+
+void* operator new(size_t size) {
+    countAllocation(size);
+    void* ptr = __libc_malloc(size ? size : 1);
+    if (ptr == NULL) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    countFree(ptr);
+    __libc_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
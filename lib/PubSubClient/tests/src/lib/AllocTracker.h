@@ -0,0 +1,21 @@
+#ifndef alloctracker_h
+#define alloctracker_h
+
+// Counts heap use by the code under test. Every malloc, calloc, realloc, free,
+// new and delete made between start() and stop() is counted, so a spec can
+// check that a path allocates nothing. Needs glibc, whose allocator it wraps.
+class AllocTracker {
+public:
+    // Resets the counters and starts counting
+    static void start();
+    static void stop();
+    // malloc, calloc and new calls
+    static unsigned long allocations();
+    static unsigned long reallocations();
+    // free and delete calls (of non-NULL pointers)
+    static unsigned long frees();
+    // Bytes asked for by allocations and reallocations
+    static unsigned long bytes();
+};
+
+#endif
@@ -0,0 +1,17 @@
+#include "Bench.h"
+#include "trace.h"
+
+void bench_report(const char* name, const std::string& params, unsigned long ops, double seconds, unsigned long wireBytesPerOp, unsigned long payloadPerOp) {
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+    LOG("bench=" << name
+        << " " << params
+        << " ops=" << ops
+        << " ns_per_op=" << (unsigned long)(seconds*1e9/ops)
+        << " wire_bytes_per_op=" << wireBytesPerOp);
+    if (payloadPerOp) {
+        LOG(" mb_per_s=" << (double)payloadPerOp*ops/seconds/1e6);
+    }
+    LOG("\n");
+}
@@ -0,0 +1,26 @@
+#ifndef bench_h
+#define bench_h
+
+#include <chrono>
+#include <string>
+
+// Prints one result per line as space separated key=value pairs, so runs of
+// different library builds can be compared with a script:
+//   bench=<name> <params> ops=<n> ns_per_op=<n> wire_bytes_per_op=<n> mb_per_s=<n>
+// wire_bytes_per_op is what crossed the Client interface for one operation and
+// mb_per_s is payload megabytes (10^6 bytes) per second, left out when the
+// operation carries no payload.
+void bench_report(const char* name, const std::string& params, unsigned long ops, double seconds, unsigned long wireBytesPerOp, unsigned long payloadPerOp);
+
+class BenchTimer {
+private:
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::duration total;
+public:
+    BenchTimer() : total(0) {}
+    void start() { started = std::chrono::steady_clock::now(); }
+    void stop() { total += std::chrono::steady_clock::now() - started; }
+    double seconds() { return std::chrono::duration<double>(total).count(); }
+};
+
+#endif
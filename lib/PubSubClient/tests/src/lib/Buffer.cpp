@@ -4,31 +4,59 @@
 Buffer::Buffer() {
     this->pos = 0;
     this->length = 0;
+    this->copied = 0;
 }
 
 Buffer::Buffer(uint8_t* buf, size_t size) {
     this->pos = 0;
     this->length = 0;
+    this->copied = 0;
     this->add(buf,size);
 }
 bool Buffer::available() {
     return this->pos < this->length;
 }
 
+uint16_t Buffer::remaining() {
+    return this->length - this->pos;
+}
+
 uint8_t Buffer::next() {
     if (this->available()) {
+        this->copied++;
         return this->buffer[this->pos++];
     }
     return 0;
 }
 
+uint16_t Buffer::read(uint8_t* buf, size_t size) {
+    uint16_t n = this->remaining();
+    if (size < n) {
+        n = size;
+    }
+    memcpy(buf,this->buffer+this->pos,n);
+    this->pos += n;
+    this->copied += n;
+    return n;
+}
+
 void Buffer::reset() {
     this->pos = 0;
 }
 
 void Buffer::add(uint8_t* buf, size_t size) {
+    if (!this->available()) {
+        // Everything added so far has been consumed - start again from the
+        // front so long-running tests don't run off the end of the buffer
+        this->pos = 0;
+        this->length = 0;
+    }
     uint16_t i = 0;
     for (;i<size;i++) {
         this->buffer[this->length++] = buf[i];
     }
 }
+
+uint32_t Buffer::copiedOut() {
+    return this->copied;
+}
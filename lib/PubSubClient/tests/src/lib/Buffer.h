@@ -8,16 +8,21 @@ private:
     uint8_t buffer[2048];
     uint16_t pos;
     uint16_t length;
+    uint32_t copied;
 
 public:
     Buffer();
     Buffer(uint8_t* buf, size_t size);
 
     virtual bool available();
+    virtual uint16_t remaining();
     virtual uint8_t next();
+    virtual uint16_t read(uint8_t* buf, size_t size);
     virtual void reset();
 
     virtual void add(uint8_t* buf, size_t size);
+    // Bytes taken out by next() and read()
+    virtual uint32_t copiedOut();
 };
 
 #endif
@@ -2,13 +2,6 @@
 #include "trace.h"
 #include <iostream>
 #include <Arduino.h>
-#include <ctime>
-
-extern "C" {
-    uint32_t millis(void) {
-       return time(0)*1000;
-    }
-}
 
 ShimClient::ShimClient() {
     this->responseBuffer = new Buffer();
@@ -18,6 +11,9 @@ ShimClient::ShimClient() {
     this->_error = false;
     this->expectAnything = true;
     this->_received = 0;
+    this->_writes = 0;
+    this->_bytesWritten = 0;
+    this->_reads = 0;
     this->_expectedPort = 0;
 }
 
@@ -56,6 +52,8 @@ int ShimClient::connect(const char *host, uint16_t port)  {
 }
 size_t ShimClient::write(uint8_t b)  {
     this->_received += 1;
+    this->_writes += 1;
+    this->_bytesWritten += 1;
     TRACE(std::hex << (unsigned int)b);
     if (!this->expectAnything) {
         if (this->expectBuffer->available()) {
@@ -73,6 +71,8 @@ size_t ShimClient::write(uint8_t b)  {
 }
 size_t ShimClient::write(const uint8_t *buf, size_t size)  {
     this->_received += size;
+    this->_writes += 1;
+    this->_bytesWritten += size;
     TRACE( "[" << std::dec << (unsigned int)(size) << "] ");
     uint16_t i=0;
     for (;i<size;i++) {
@@ -97,15 +97,15 @@ size_t ShimClient::write(const uint8_t *buf, size_t size)  {
     return size;
 }
 int ShimClient::available()  {
-    return this->responseBuffer->available();
+    return this->responseBuffer->remaining();
+}
+int ShimClient::read()  {
+    this->_reads += 1;
+    return this->responseBuffer->next();
 }
-int ShimClient::read()  { return this->responseBuffer->next(); }
 int ShimClient::read(uint8_t *buf, size_t size) {
-    uint16_t i = 0;
-    for (;i<size;i++) {
-        buf[i] = this->read();
-    }
-    return size;
+    this->_reads += 1;
+    return this->responseBuffer->read(buf,size);
 }
 int ShimClient::peek()  { return 0; }
 void ShimClient::flush() {}
@@ -142,6 +142,10 @@ uint16_t ShimClient::received() {
     return this->_received;
 }
 
+uint16_t ShimClient::writes() {
+    return this->_writes;
+}
+
 void ShimClient::expectConnect(IPAddress ip, uint16_t port) {
     this->_expectedIP = ip;
     this->_expectedPort = port;
@@ -151,3 +155,15 @@ void ShimClient::expectConnect(const char *host, uint16_t port) {
     this->_expectedHost = host;
     this->_expectedPort = port;
 }
+
+uint32_t ShimClient::bytesWritten() {
+    return this->_bytesWritten;
+}
+
+uint32_t ShimClient::bytesRead() {
+    return this->responseBuffer->copiedOut();
+}
+
+uint32_t ShimClient::reads() {
+    return this->_reads;
+}
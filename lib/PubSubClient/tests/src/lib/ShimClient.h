@@ -16,6 +16,9 @@ private:
     bool expectAnything;
     bool _error;
     uint16_t _received;
+    uint16_t _writes;
+    uint32_t _bytesWritten;
+    uint32_t _reads;
     IPAddress _expectedIP;
     uint16_t _expectedPort;
     const char* _expectedHost;
@@ -42,6 +45,12 @@ public:
   virtual void expectConnect(const char *host, uint16_t port);
   
   virtual uint16_t received();
+  virtual uint16_t writes();
+  // Copy counters: every byte the client under test writes or reads, and
+  // the number of read calls it made
+  virtual uint32_t bytesWritten();
+  virtual uint32_t bytesRead();
+  virtual uint32_t reads();
   virtual bool error();
   
   virtual void setAllowConnect(bool b);
@@ -0,0 +1,25 @@
+#include "VirtualClock.h"
+
+// Starts well clear of 0, like a board that has been running for a while
+static uint32_t virtualTime = 3600000UL;
+static uint32_t autoAdvance = 0;
+
+uint32_t VirtualClock::now() {
+    uint32_t t = virtualTime;
+    virtualTime += autoAdvance;
+    return t;
+}
+
+void VirtualClock::advance(uint32_t ms) {
+    virtualTime += ms;
+}
+
+void VirtualClock::setAutoAdvance(uint32_t ms) {
+    autoAdvance = ms;
+}
+
+extern "C" {
+    uint32_t millis(void) {
+       return VirtualClock::now();
+    }
+}
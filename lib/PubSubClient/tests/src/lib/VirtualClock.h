@@ -0,0 +1,17 @@
+#ifndef virtualclock_h
+#define virtualclock_h
+
+#include "Arduino.h"
+
+// The time seen by the code under test: millis() returns it, and it only moves
+// when a test moves it, so timeouts are deterministic and cost no real time.
+class VirtualClock {
+public:
+    static uint32_t now();
+    static void advance(uint32_t ms);
+    // Moves the clock on by ms every time it is read, for code that waits in
+    // a loop on millis() (0 to stop)
+    static void setAutoAdvance(uint32_t ms);
+};
+
+#endif
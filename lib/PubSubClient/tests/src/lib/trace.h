@@ -4,7 +4,13 @@
 
 #include <stdlib.h>
 
+// Looked up once: the shim traces every byte, and benchmarks go through it
+inline bool trace_enabled() {
+    static bool enabled = getenv("TRACE") != NULL;
+    return enabled;
+}
+
 #define LOG(x) {std::cout << x << std::flush; }
-#define TRACE(x) {if (getenv("TRACE")) { std::cout << x << std::flush; }}
+#define TRACE(x) {if (trace_enabled()) { std::cout << x << std::flush; }}
 
 #endif
@@ -0,0 +1,361 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+#include "VirtualClock.h"
+
+// Built with -DMQTT_VERSION=MQTT_VERSION_5 (see Makefile)
+
+byte server[] = { 172, 16, 0, 2 };
+
+bool callback_called = false;
+char lastTopic[1024];
+char lastPayload[1024];
+unsigned int lastLength;
+
+void reset_callback() {
+    callback_called = false;
+    lastTopic[0] = '\0';
+    lastPayload[0] = '\0';
+    lastLength = 0;
+}
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    callback_called = true;
+    strcpy(lastTopic,topic);
+    memcpy(lastPayload,payload,length);
+    lastLength = length;
+}
+
+byte connect_packet[] = {0x10,0x21,0x0,0x4,0x4d,0x51,0x54,0x54,0x5,0x2,0x0,0xf,0x8,0x21,0x0,0x8,0x27,0x0,0x0,0x1,0x0,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+
+int test_mqtt5_connect() {
+    IT("sends an MQTT 5 connect and applies the connack properties");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    shimClient.expect(connect_packet,35);
+    // Receive Maximum 2, Topic Alias Maximum 1, Maximum Packet Size 40
+    byte connack[] = { 0x20,0x0e,0x0,0x0,0x0b,0x21,0x0,0x2,0x22,0x0,0x1,0x27,0x0,0x0,0x0,0x28 };
+    shimClient.respond(connack,16);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTED);
+    IS_TRUE(client.getMaxInflight() == 2);
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_mqtt5_connect_refused() {
+    IT("reports the connack reason code");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20,0x3,0x0,0x87,0x0 };
+    shimClient.respond(connack,5);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_FALSE(rc);
+    // Not authorized: state() keeps to the MQTT_CONNECT_* values
+    IS_TRUE(client.state() == MQTT_CONNECT_UNAUTHORIZED);
+    IS_TRUE(client.getReasonCode() == 0x87);
+
+    END_IT
+}
+
+int test_mqtt5_topic_alias() {
+    IT("replaces repeated topics with an alias");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    // Topic Alias Maximum 1
+    byte connack[] = { 0x20,0x6,0x0,0x0,0x3,0x22,0x0,0x1 };
+    shimClient.respond(connack,8);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte first[] = { 0x30,0xd,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x3,0x23,0x0,0x1,0x61,0x62 };
+    shimClient.expect(first,15);
+    byte second[] = { 0x30,0x8,0x0,0x0,0x3,0x23,0x0,0x1,0x61,0x62 };
+    shimClient.expect(second,10);
+    // No alias left for another topic
+    byte other[] = { 0x30,0xa,0x0,0x5,0x6f,0x74,0x68,0x65,0x72,0x0,0x61,0x62 };
+    shimClient.expect(other,12);
+
+    IS_TRUE(client.publish("topic",(const uint8_t*)"ab",2,false));
+    IS_TRUE(client.publish("topic",(const uint8_t*)"ab",2,false));
+    IS_TRUE(client.publish("other",(const uint8_t*)"ab",2,false));
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_mqtt5_topic_alias_reconnect() {
+    IT("sends the topic again when resending after a reconnect");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20,0x6,0x0,0x0,0x3,0x22,0x0,0x1 };
+    shimClient.respond(connack,8);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte first[] = { 0x32,0xf,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x3,0x23,0x0,0x1,0x61,0x62 };
+    shimClient.expect(first,17);
+    byte second[] = { 0x32,0xa,0x0,0x0,0x0,0x3,0x3,0x23,0x0,0x1,0x61,0x62 };
+    shimClient.expect(second,12);
+    IS_TRUE(client.publish("topic",(const uint8_t*)"ab",2,1,false));
+    IS_TRUE(client.publish("topic",(const uint8_t*)"ab",2,1,false));
+    IS_FALSE(shimClient.error());
+
+    shimClient.setConnected(false);
+    shimClient.respond(connack,8);
+    shimClient.expect(connect_packet,35);
+    byte resend1[] = { 0x32,0xf,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x3,0x23,0x0,0x1,0x61,0x62 };
+    shimClient.expect(resend1,17);
+    byte resend2[] = { 0x32,0xa,0x0,0x0,0x0,0x3,0x3,0x23,0x0,0x1,0x61,0x62 };
+    shimClient.expect(resend2,12);
+
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_mqtt5_receive_maximum() {
+    IT("limits the in-flight window to the server's receive maximum");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20,0x6,0x0,0x0,0x3,0x21,0x0,0x1 };
+    shimClient.respond(connack,8);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getMaxInflight() == 1);
+
+    IS_TRUE(client.publish("topic",(const uint8_t*)"ab",2,1,false));
+    IS_FALSE(client.publish("topic",(const uint8_t*)"ab",2,1,false));
+
+    // A PUBACK reason code below 0x80 is still a success
+    byte puback[] = { 0x40,0x3,0x0,0x2,0x10 };
+    shimClient.respond(puback,5);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getReasonCode() == 0x10);
+    IS_TRUE(client.getInflightCount() == 0);
+    IS_TRUE(client.publish("topic",(const uint8_t*)"ab",2,1,false));
+
+    END_IT
+}
+
+int test_mqtt5_maximum_packet_size() {
+    IT("does not send packets larger than the server accepts");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    // Maximum Packet Size 20
+    byte connack[] = { 0x20,0x8,0x0,0x0,0x5,0x27,0x0,0x0,0x0,0x14 };
+    shimClient.respond(connack,10);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    uint16_t received = shimClient.received();
+    IS_FALSE(client.publish("topic",(const uint8_t*)"0123456789",10,false));
+    IS_FALSE(client.publish("topic",(const uint8_t*)"0123456789",10,1,false));
+    IS_TRUE(shimClient.received() == received);
+    IS_TRUE(client.getInflightCount() == 0);
+    IS_TRUE(client.publish("topic",(const uint8_t*)"01234",5,false));
+
+    END_IT
+}
+
+int test_mqtt5_receive_properties() {
+    IT("skips the properties of received messages");
+    reset_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20,0x3,0x0,0x0,0x0 };
+    shimClient.respond(connack,5);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // Payload Format Indicator property
+    byte publish[] = { 0x30,0x11,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x2,0x1,0x1,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64 };
+    shimClient.respond(publish,19);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+
+    reset_callback();
+    byte publish_qos1[] = { 0x32,0x11,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x1,0x0,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64 };
+    shimClient.respond(publish_qos1,19);
+    byte puback[] = { 0x40,0x2,0x0,0x1 };
+    shimClient.expect(puback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callback_called);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_mqtt5_subscribe() {
+    IT("subscribes and reads suback reason codes after the properties");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20,0x3,0x0,0x0,0x0 };
+    shimClient.respond(connack,5);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte subscribe[] = { 0x82,0xb,0x0,0x2,0x0,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x1 };
+    shimClient.expect(subscribe,13);
+    rc = client.subscribe("topic",1);
+    IS_TRUE(rc);
+
+    // Reason String property, then the reason code
+    byte suback[] = { 0x90,0x9,0x0,0x2,0x5,0x1f,0x0,0x2,0x6f,0x6b,0x1 };
+    shimClient.respond(suback,11);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getSubscriptionStatus("topic") == 1);
+
+    byte unsubscribe[] = { 0xa2,0xa,0x0,0x3,0x0,0x0,0x5,0x74,0x6f,0x70,0x69,0x63 };
+    shimClient.expect(unsubscribe,12);
+    rc = client.unsubscribe("topic");
+    IS_TRUE(rc);
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_mqtt5_pubrec_refused() {
+    IT("does not release a qos 2 message the server refused");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20,0x3,0x0,0x0,0x0 };
+    shimClient.respond(connack,5);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    IS_TRUE(client.publish("topic",(const uint8_t*)"ab",2,2,false));
+    uint16_t received = shimClient.received();
+    byte pubrec[] = { 0x50,0x3,0x0,0x2,0x80 };
+    shimClient.respond(pubrec,5);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getReasonCode() == 0x80);
+    IS_TRUE(client.getInflightCount() == 0);
+    IS_TRUE(shimClient.received() == received);
+
+    END_IT
+}
+
+int test_mqtt5_server_disconnect() {
+    IT("closes the connection when the server disconnects");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20,0x3,0x0,0x0,0x0 };
+    shimClient.respond(connack,5);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // Session taken over
+    byte disconnect[] = { 0xe0,0x1,0x8e };
+    shimClient.respond(disconnect,3);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_FALSE(client.connected());
+    IS_TRUE(client.state() == MQTT_CONNECTION_LOST);
+    IS_TRUE(client.getReasonCode() == 0x8e);
+
+    END_IT
+}
+
+int test_mqtt5_server_keep_alive() {
+    IT("uses the server keep alive for that connection only");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    // Server Keep Alive 5
+    byte connack[] = { 0x20,0x6,0x0,0x0,0x3,0x13,0x0,0x5 };
+    shimClient.respond(connack,8);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte pingreq[] = { 0xC0,0x0 };
+    shimClient.expect(pingreq,2);
+    VirtualClock::advance(6000);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(shimClient.error());
+
+    // The next CONNECT asks for the configured 15 seconds again, and with no
+    // Server Keep Alive in the CONNACK that is what is used
+    shimClient.setConnected(false);
+    byte plainConnack[] = { 0x20,0x3,0x0,0x0,0x0 };
+    shimClient.respond(plainConnack,5);
+    shimClient.expect(connect_packet,35);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_FALSE(shimClient.error());
+
+    uint16_t received = shimClient.received();
+    VirtualClock::advance(6000);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.received() == received);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("MQTT 5");
+    test_mqtt5_connect();
+    test_mqtt5_connect_refused();
+    test_mqtt5_topic_alias();
+    test_mqtt5_topic_alias_reconnect();
+    test_mqtt5_receive_maximum();
+    test_mqtt5_maximum_packet_size();
+    test_mqtt5_receive_properties();
+    test_mqtt5_subscribe();
+    test_mqtt5_pubrec_refused();
+    test_mqtt5_server_disconnect();
+    test_mqtt5_server_keep_alive();
+
+    FINISH
+}
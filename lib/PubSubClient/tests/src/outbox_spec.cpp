@@ -0,0 +1,220 @@
+#include "PubSubClient.h"
+#include "MqttOutbox.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+byte server[] = { 172, 16, 0, 2 };
+
+void callback(char* topic, byte* payload, unsigned int length) {
+  // handle message arrived
+}
+
+// In-memory stand-in for a flash-backed log
+class MemoryStorage : public MqttOutboxStorage {
+public:
+    uint8_t records[16][MQTT_OUTBOX_RECORD_SIZE];
+    uint16_t lengths[16];
+    uint16_t head;
+    uint16_t tail;
+    uint16_t capacity;
+    uint16_t appends;
+
+    MemoryStorage() : head(0), tail(0), capacity(16), appends(0) {}
+
+    boolean append(const uint8_t* data, uint16_t length) {
+        if (tail-head >= capacity) {
+            return false;
+        }
+        memcpy(records[tail%16],data,length);
+        lengths[tail%16] = length;
+        tail++;
+        appends++;
+        return true;
+    }
+    uint16_t peek(uint8_t* data, uint16_t size) {
+        if (head == tail || lengths[head%16] > size) {
+            return 0;
+        }
+        memcpy(data,records[head%16],lengths[head%16]);
+        return lengths[head%16];
+    }
+    void pop() {
+        if (head != tail) {
+            head++;
+        }
+    }
+    uint16_t count() {
+        return tail-head;
+    }
+};
+
+int test_outbox_drain_in_order() {
+    IT("publishes queued messages in order once connected");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    MqttOutbox outbox;
+
+    IS_TRUE(outbox.push("t",(const uint8_t*)"a",1,0,false));
+    IS_TRUE(outbox.push("t",(const uint8_t*)"b",1,0,true));
+    IS_TRUE(outbox.count() == 2);
+
+    // Nothing is sent while disconnected
+    IS_TRUE(outbox.drain(client,10) == 0);
+    IS_TRUE(outbox.count() == 2);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish1[] = {0x30,0x4,0x0,0x1,0x74,0x61};
+    byte publish2[] = {0x31,0x4,0x0,0x1,0x74,0x62};
+    shimClient.expect(publish1,6);
+    shimClient.expect(publish2,6);
+
+    IS_TRUE(outbox.drain(client,10) == 2);
+    IS_TRUE(outbox.count() == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_outbox_spill() {
+    IT("spills to storage when RAM is full and drains storage first");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    MemoryStorage storage;
+    PubSubClient client(server, 1883, callback, shimClient);
+    MqttOutbox outbox(storage);
+
+    // 2 byte length + flags + "t\0" + 97 bytes of payload = 100 bytes each
+    uint8_t payload[97];
+    int queued = MQTT_OUTBOX_RAM_SIZE/100 + 2;
+    for (int i = 0; i < queued; i++) {
+        memset(payload,i,sizeof(payload));
+        IS_TRUE(outbox.push("t",payload,sizeof(payload),0,false));
+    }
+    IS_TRUE(storage.appends == MQTT_OUTBOX_RAM_SIZE/100);
+    IS_TRUE(outbox.count() == queued);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0x64,0x0,0x1,0x74};
+    for (int i = 0; i < queued; i++) {
+        memset(payload,i,sizeof(payload));
+        shimClient.expect(publish,5);
+        shimClient.expect(payload,sizeof(payload));
+    }
+    IS_TRUE(outbox.drain(client,255) == queued);
+    IS_TRUE(outbox.count() == 0);
+    IS_TRUE(storage.count() == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_outbox_full() {
+    IT("refuses messages when RAM and storage are full");
+    MemoryStorage storage;
+    storage.capacity = 1;
+    MqttOutbox outbox(storage);
+
+    uint8_t payload[97];
+    int accepted = 0;
+    for (int i = 0; i < 2*MQTT_OUTBOX_RAM_SIZE/100; i++) {
+        if (outbox.push("t",payload,sizeof(payload),0,false)) {
+            accepted++;
+        }
+    }
+    IS_TRUE(accepted < 2*MQTT_OUTBOX_RAM_SIZE/100);
+    IS_TRUE(outbox.count() == accepted);
+
+    uint8_t big[MQTT_OUTBOX_RECORD_SIZE];
+    MqttOutbox empty;
+    IS_FALSE(empty.push("t",big,sizeof(big),0,false));
+
+    END_IT
+}
+
+int test_outbox_rate_limit() {
+    IT("drains in rate limited batches from loop");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    MqttOutbox outbox;
+    outbox.setDrainRate(2,60000);
+    for (int i = 0; i < 5; i++) {
+        IS_TRUE(outbox.push("t",(const uint8_t*)"a",1,0,false));
+    }
+
+    IS_TRUE(outbox.loop(client) == 2);
+    IS_TRUE(outbox.loop(client) == 0);
+    IS_TRUE(outbox.count() == 3);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_outbox_leaves_inflight_slot() {
+    IT("leaves an in-flight slot free for live messages");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setMaxInflight(3);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    MqttOutbox outbox;
+    for (int i = 0; i < 4; i++) {
+        IS_TRUE(outbox.push("t",(const uint8_t*)"a",1,1,false));
+    }
+
+    IS_TRUE(outbox.drain(client,10) == 2);
+    IS_TRUE(client.getInflightCount() == 2);
+    IS_TRUE(client.publish("t",(const uint8_t*)"live",4,1,false));
+
+    byte puback[] = { 0x40, 0x02, 0x00, 0x02 };
+    shimClient.respond(puback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(outbox.drain(client,10) == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Outbox");
+    test_outbox_drain_in_order();
+    test_outbox_spill();
+    test_outbox_full();
+    test_outbox_rate_limit();
+    test_outbox_leaves_inflight_slot();
+
+    FINISH
+}
@@ -0,0 +1,89 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "Bench.h"
+#include "trace.h"
+#include <sstream>
+
+// Measures the cost of publish() through a ShimClient: QoS 0 on its own, and
+// QoS 1 including loop() handling the PUBACK. Run with `make bench`.
+
+byte server[] = { 172, 16, 0, 2 };
+
+void callback(char* topic, byte* payload, unsigned int length) {
+}
+
+void bench_publish(uint8_t qos, unsigned int payloadLength, unsigned int topicLength, uint16_t bufferSize, unsigned long iterations) {
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setBufferSize(bufferSize);
+    client.connect((char*)"client_test1");
+
+    char topic[256];
+    memset(topic,'t',topicLength);
+    topic[topicLength] = '\0';
+    uint8_t payload[2048];
+    memset(payload,'A',payloadLength);
+
+    std::ostringstream params;
+    params << "qos=" << (int)qos << " payload=" << payloadLength << " topic=" << topicLength << " buffer=" << bufferSize;
+
+    // Message ids run 2, 3, ... from the first publish after connecting
+    uint16_t msgId = 2;
+    byte puback[] = { 0x40, 0x02, 0x00, 0x00 };
+    uint16_t before = shimClient.received();
+    if (!client.publish(topic,payload,payloadLength,qos,false)) {
+        LOG("bench=publish " << params.str() << " skipped=too_big\n");
+        return;
+    }
+    unsigned long wireBytesPerOp = (uint16_t)(shimClient.received()-before);
+    if (qos > 0) {
+        puback[2] = (msgId >> 8);
+        puback[3] = (msgId & 0xFF);
+        shimClient.respond(puback,4);
+        client.loop();
+        msgId++;
+    }
+
+    BenchTimer timer;
+    timer.start();
+    for (unsigned long i = 0; i < iterations; i++) {
+        client.publish(topic,payload,payloadLength,qos,false);
+        if (qos > 0) {
+            puback[2] = (msgId >> 8);
+            puback[3] = (msgId & 0xFF);
+            shimClient.respond(puback,4);
+            client.loop();
+            if (++msgId == 0) {
+                msgId = 1;
+            }
+        }
+    }
+    timer.stop();
+    if (client.getInflightCount() != 0) {
+        params << " unacked=" << (int)client.getInflightCount();
+    }
+    bench_report("publish",params.str(),iterations,timer.seconds(),wireBytesPerOp,payloadLength);
+}
+
+int main()
+{
+    const unsigned int payloads[] = { 16, 128, 1024 };
+    const unsigned int topics[] = { 5, 64 };
+    const uint16_t buffers[] = { 256, 2048 };
+    for (uint8_t qos = 0; qos < 2; qos++) {
+        for (unsigned int p = 0; p < 3; p++) {
+            for (unsigned int t = 0; t < 2; t++) {
+                for (unsigned int b = 0; b < 2; b++) {
+                    bench_publish(qos,payloads[p],topics[t],buffers[b],50000);
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,194 @@
+#include <sched.h>
+#include <thread>
+#include <vector>
+
+#include "PubSubClient.h"
+#include "MqttPublishQueue.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+// Built with -pthread (see Makefile)
+
+byte server[] = { 172, 16, 0, 2 };
+
+void callback(char* topic, byte* payload, unsigned int length) {
+  // handle message arrived
+}
+
+// Keeps a copy of everything written so the packets can be checked afterwards
+class RecordingClient : public ShimClient {
+public:
+    std::vector<uint8_t> sent;
+
+    size_t write(uint8_t b) {
+        sent.push_back(b);
+        return ShimClient::write(b);
+    }
+    size_t write(const uint8_t *buf, size_t size) {
+        sent.insert(sent.end(),buf,buf+size);
+        return ShimClient::write(buf,size);
+    }
+};
+
+int test_publish_queue_drain_in_order() {
+    IT("publishes queued messages in order when drained");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    MqttPublishQueue queue;
+    IS_TRUE(queue.publish("t",(const uint8_t*)"a",1,0,false));
+    IS_TRUE(queue.publish("t","b",true));
+    IS_TRUE(queue.publish("t",(const uint8_t*)"c",1,1,false));
+    IS_TRUE(queue.count() == 3);
+
+    byte publish1[] = {0x30,0x4,0x0,0x1,0x74,0x61};
+    byte publish2[] = {0x31,0x4,0x0,0x1,0x74,0x62};
+    byte publish3[] = {0x32,0x6,0x0,0x1,0x74,0x0,0x2,0x63};
+    shimClient.expect(publish1,6);
+    shimClient.expect(publish2,6);
+    shimClient.expect(publish3,8);
+
+    IS_TRUE(queue.drain(client) == 3);
+    IS_TRUE(queue.count() == 0);
+    IS_FALSE(shimClient.error());
+    IS_TRUE(queue.drain(client) == 0);
+
+    END_IT
+}
+
+int test_publish_queue_full() {
+    IT("refuses messages when full or too big");
+    MqttPublishQueue queue;
+
+    uint8_t payload[MQTT_PUBLISH_QUEUE_SLOT_SIZE];
+    memset(payload,'x',sizeof(payload));
+    IS_FALSE(queue.publish("t",payload,MQTT_PUBLISH_QUEUE_SLOT_SIZE-1,0,false));
+    IS_TRUE(queue.publish("t",payload,MQTT_PUBLISH_QUEUE_SLOT_SIZE-2,0,false));
+    IS_FALSE(queue.publish("t",payload,1,3,false));
+
+    for (int i = 1; i < MQTT_PUBLISH_QUEUE_SLOTS; i++) {
+        IS_TRUE(queue.publish("t","a"));
+    }
+    IS_TRUE(queue.count() == MQTT_PUBLISH_QUEUE_SLOTS);
+    IS_FALSE(queue.publish("t","a"));
+    IS_TRUE(queue.getDropped() == 1);
+
+    END_IT
+}
+
+int test_publish_queue_keeps_refused() {
+    IT("keeps messages the client refuses");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    MqttPublishQueue queue;
+    IS_TRUE(queue.publish("t","a"));
+    IS_TRUE(queue.publish("t","b"));
+
+    // Not connected yet
+    IS_TRUE(queue.drain(client) == 0);
+    IS_TRUE(queue.count() == 2);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish1[] = {0x30,0x4,0x0,0x1,0x74,0x61};
+    byte publish2[] = {0x30,0x4,0x0,0x1,0x74,0x62};
+    shimClient.expect(publish1,6);
+    shimClient.expect(publish2,6);
+    IS_TRUE(queue.drain(client) == 2);
+    IS_FALSE(shimClient.error());
+
+    // Slots are reused once published
+    for (int i = 0; i < MQTT_PUBLISH_QUEUE_SLOTS; i++) {
+        IS_TRUE(queue.publish("t","a"));
+    }
+    IS_TRUE(queue.getDropped() == 0);
+
+    END_IT
+}
+
+int test_publish_queue_producers() {
+    IT("delivers every message from concurrent producers once and in order");
+    RecordingClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    shimClient.sent.clear();
+
+    const int producers = 4;
+    const int messages = 5000;
+    MqttPublishQueue queue;
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.push_back(std::thread([&queue,p]() {
+            for (int i = 0; i < messages; i++) {
+                uint8_t payload[3] = { (uint8_t)p, (uint8_t)(i >> 8), (uint8_t)(i & 0xFF) };
+                while (!queue.publish("q",payload,3,0,false)) {
+                    sched_yield();
+                }
+            }
+        }));
+    }
+    int published = 0;
+    while (published < producers*messages) {
+        uint8_t n = queue.drain(client);
+        if (n == 0) {
+            sched_yield();
+        }
+        published += n;
+    }
+    for (int p = 0; p < producers; p++) {
+        threads[p].join();
+    }
+    IS_TRUE(queue.count() == 0);
+
+    // Each packet is {0x30,0x6,0x0,0x1,'q',producer,seq hi,seq lo}
+    IS_TRUE(shimClient.sent.size() == (size_t)producers*messages*8);
+    int next[producers] = { 0 };
+    boolean ordered = true;
+    for (size_t i = 0; i+8 <= shimClient.sent.size(); i += 8) {
+        const uint8_t* packet = &shimClient.sent[i];
+        uint8_t p = packet[5];
+        int seq = (packet[6] << 8) | packet[7];
+        if (packet[0] != 0x30 || packet[1] != 0x6 || packet[4] != 'q' || p >= producers || seq != next[p]) {
+            ordered = false;
+            break;
+        }
+        next[p]++;
+    }
+    IS_TRUE(ordered);
+    for (int p = 0; p < producers; p++) {
+        IS_TRUE(next[p] == messages);
+    }
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Publish queue");
+    test_publish_queue_drain_in_order();
+    test_publish_queue_full();
+    test_publish_queue_keeps_refused();
+    test_publish_queue_producers();
+
+    FINISH
+}
@@ -3,6 +3,7 @@
 #include "Buffer.h"
 #include "BDDTest.h"
 #include "trace.h"
+#include "VirtualClock.h"
 
 
 byte server[] = { 172, 16, 0, 2 };
@@ -11,6 +12,60 @@ void callback(char* topic, byte* payload, unsigned int length) {
   // handle message arrived
 }
 
+// In-memory stand-in for a flash-backed session store
+class MemorySessionStore : public MqttSessionStore {
+public:
+    uint16_t msgIds[4];
+    uint8_t headers[4];
+    uint8_t packets[4][64];
+    uint16_t lengths[4];
+    uint8_t used;
+
+    MemorySessionStore() : used(0) {}
+
+    boolean save(uint16_t msgId, uint8_t header, const uint8_t* packet, uint16_t length) {
+        uint8_t i = 0;
+        while (i < used && msgIds[i] != msgId) {
+            i++;
+        }
+        if (i == 4 || length > 64) {
+            return false;
+        }
+        if (i == used) {
+            used++;
+        }
+        msgIds[i] = msgId;
+        headers[i] = header;
+        memcpy(packets[i],packet,length);
+        lengths[i] = length;
+        return true;
+    }
+    void remove(uint16_t msgId) {
+        for (uint8_t i = 0; i < used; i++) {
+            if (msgIds[i] == msgId) {
+                used--;
+                msgIds[i] = msgIds[used];
+                headers[i] = headers[used];
+                memcpy(packets[i],packets[used],lengths[used]);
+                lengths[i] = lengths[used];
+                return;
+            }
+        }
+    }
+    uint16_t load(uint8_t index, uint16_t* msgId, uint8_t* header, uint8_t* packet, uint16_t size) {
+        if (index >= used || lengths[index] > size) {
+            return 0;
+        }
+        *msgId = msgIds[index];
+        *header = headers[index];
+        memcpy(packet,packets[index],lengths[index]);
+        return lengths[index];
+    }
+    uint8_t count() {
+        return used;
+    }
+};
+
 int test_publish() {
     IT("publishes a null-terminated string");
     ShimClient shimClient;
@@ -126,7 +181,7 @@ int test_publish_not_connected() {
 }
 
 int test_publish_too_long() {
-    IT("publish fails when topic/payload are too long");
+    IT("publish fails when the topic is too long");
     ShimClient shimClient;
     shimClient.setAllowConnect(true);
 
@@ -138,8 +193,8 @@ int test_publish_too_long() {
     int rc = client.connect((char*)"client_test1");
     IS_TRUE(rc);
 
-    //                                         0        1         2         3         4         5         6         7         8         9         0         1         2
-    rc = client.publish((char*)"topic",(char*)"123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890");
+    //                          0        1         2         3         4         5         6         7         8         9         0         1         2
+    rc = client.publish((char*)"123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789",(char*)"payload");
     IS_FALSE(rc);
 
     IS_FALSE(shimClient.error());
@@ -147,6 +202,39 @@ int test_publish_too_long() {
     END_IT
 }
 
+int test_publish_larger_than_buffer() {
+    IT("publishes a payload larger than the buffer without copying it");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setBufferSize(32);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte payload[200];
+    for (int i = 0; i < 200; i++) {
+        payload[i] = i;
+    }
+    // Remaining length 207 = 2 + 5 + 200
+    byte header[] = {0x30,0xcf,0x1,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(header,10);
+    shimClient.expect(payload,200);
+
+    uint16_t writes = shimClient.writes();
+    rc = client.publish((char*)"topic",payload,200);
+    IS_TRUE(rc);
+    // Header and topic in one write, the payload from where it is in another
+    IS_TRUE(shimClient.writes() == writes+2);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int test_publish_P() {
     IT("publishes using PROGMEM");
     ShimClient shimClient;
@@ -176,6 +264,377 @@ int test_publish_P() {
 
 
 
+int test_publish_qos1() {
+    IT("publishes at qos 1 and holds the message until PUBACK");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,18);
+
+    rc = client.publish((char*)"topic",(const uint8_t*)"payload",7,1,false);
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    byte puback[] = { 0x40, 0x02, 0x00, 0x02 };
+    shimClient.respond(puback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos1_window() {
+    IT("pipelines qos 1 publishes up to the in-flight window");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setMaxInflight(2));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish1[] = {0x32,0x6,0x0,0x1,0x74,0x0,0x2,0x61};
+    byte publish2[] = {0x32,0x6,0x0,0x1,0x74,0x0,0x3,0x62};
+    shimClient.expect(publish1,8);
+    shimClient.expect(publish2,8);
+
+    IS_TRUE(client.publish((char*)"t",(const uint8_t*)"a",1,1,false));
+    IS_TRUE(client.publish((char*)"t",(const uint8_t*)"b",1,1,false));
+    IS_FALSE(client.publish((char*)"t",(const uint8_t*)"c",1,1,false));
+    IS_TRUE(client.getInflightCount() == 2);
+    IS_FALSE(client.setMaxInflight(4));
+
+    // Acknowledgements can arrive in any order
+    byte puback[] = { 0x40, 0x02, 0x00, 0x03 };
+    shimClient.respond(puback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    byte publish3[] = {0x32,0x6,0x0,0x1,0x74,0x0,0x4,0x63};
+    shimClient.expect(publish3,8);
+    IS_TRUE(client.publish((char*)"t",(const uint8_t*)"c",1,1,false));
+    IS_TRUE(client.getInflightCount() == 2);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos1_retry() {
+    IT("resends an unacknowledged qos 1 message with DUP set (takes 2 seconds)");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setRetryTimeout(1);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0x6,0x0,0x1,0x74,0x0,0x2,0x61};
+    shimClient.expect(publish,8);
+    IS_TRUE(client.publish((char*)"t",(const uint8_t*)"a",1,1,false));
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(shimClient.error());
+
+    VirtualClock::advance(2000);
+
+    byte dup[] = {0x3a,0x6,0x0,0x1,0x74,0x0,0x2,0x61};
+    shimClient.expect(dup,8);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos1_reconnect() {
+    IT("resends unacknowledged qos 1 messages after reconnecting");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    IS_TRUE(client.publish((char*)"t",(const uint8_t*)"a",1,1,false));
+    shimClient.setConnected(false);
+    IS_FALSE(client.publish((char*)"t",(const uint8_t*)"b",1,1,false));
+
+    shimClient.respond(connack,4);
+    uint16_t received = shimClient.received();
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    // CONNECT followed by the resent PUBLISH
+    IS_TRUE(shimClient.received() == received+26+8);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    byte puback[] = { 0x40, 0x02, 0x00, 0x02 };
+    shimClient.respond(puback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos2() {
+    IT("publishes at qos 2 and completes the PUBREC/PUBREL/PUBCOMP exchange");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x34,0x6,0x0,0x1,0x74,0x0,0x2,0x61};
+    shimClient.expect(publish,8);
+    IS_TRUE(client.publish((char*)"t",(const uint8_t*)"a",1,2,false));
+    IS_TRUE(client.getInflightCount() == 1);
+
+    // A PUBACK does not complete a qos 2 message
+    byte puback[] = { 0x40, 0x02, 0x00, 0x02 };
+    shimClient.respond(puback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    byte pubrec[] = { 0x50, 0x02, 0x00, 0x02 };
+    byte pubrel[] = { 0x62, 0x02, 0x00, 0x02 };
+    shimClient.respond(pubrec,4);
+    shimClient.expect(pubrel,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+    IS_FALSE(shimClient.error());
+
+    // After a reconnect to the same session the PUBREL, not the PUBLISH, is resent
+    shimClient.setConnected(false);
+    byte connack_session[] = { 0x20, 0x02, 0x01, 0x00 };
+    shimClient.respond(connack_session,4);
+    uint16_t received = shimClient.received();
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.received() == received+26+4);
+
+    byte pubcomp[] = { 0x70, 0x02, 0x00, 0x02 };
+    shimClient.respond(pubcomp,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 0);
+
+    END_IT
+}
+
+int test_publish_session_lost() {
+    IT("sends unacknowledged messages as new ones when the server lost the session");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    MemorySessionStore store;
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setSessionStore(store));
+    int rc = client.connect((char*)"client_test1",0,0,0,0,0,0,0);
+    IS_TRUE(rc);
+
+    IS_TRUE(client.publish((char*)"t",(const uint8_t*)"a",1,2,false));
+    IS_TRUE(client.publish((char*)"t",(const uint8_t*)"b",1,1,false));
+    byte pubrec[] = { 0x50, 0x02, 0x00, 0x02 };
+    shimClient.respond(pubrec,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 2);
+    IS_TRUE(store.count() == 2);
+
+    // The PUBREL is dropped and the PUBLISH goes out without DUP
+    shimClient.setConnected(false);
+    shimClient.respond(connack,4);
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x0,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    shimClient.expect(connect,26);
+    byte publish[] = {0x32,0x6,0x0,0x1,0x74,0x0,0x3,0x62};
+    shimClient.expect(publish,8);
+    uint16_t received = shimClient.received();
+    rc = client.connect((char*)"client_test1",0,0,0,0,0,0,0);
+    IS_TRUE(rc);
+    IS_FALSE(client.getSessionPresent());
+    IS_TRUE(shimClient.received() == received+26+8);
+    IS_FALSE(shimClient.error());
+    IS_TRUE(client.getInflightCount() == 1);
+    IS_TRUE(store.count() == 1);
+    IS_TRUE(store.msgIds[0] == 3);
+
+    byte puback[] = { 0x40, 0x02, 0x00, 0x03 };
+    shimClient.respond(puback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 0);
+    IS_TRUE(store.count() == 0);
+
+    END_IT
+}
+
+int test_publish_coalesced() {
+    IT("combines packets in the transmit buffer into one write");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setTxBuffer(64,60000));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+    shimClient.expect(publish,16);
+    byte subscribe[] = { 0x82,0xa,0x0,0x2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0 };
+    shimClient.expect(subscribe,12);
+
+    uint16_t writes = shimClient.writes();
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload"));
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload"));
+    IS_TRUE(client.subscribe((char*)"topic"));
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writes() == writes);
+
+    client.flush();
+    IS_TRUE(shimClient.writes() == writes+1);
+    IS_TRUE(shimClient.received() == 26+16+16+12);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_coalesced_thresholds() {
+    IT("sends the transmit buffer when it fills or the delay passes");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setTxBuffer(40,0));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    uint16_t writes = shimClient.writes();
+    // 16 + 16 fit, the third does not
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload"));
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload"));
+    IS_TRUE(shimClient.writes() == writes);
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload"));
+    IS_TRUE(shimClient.writes() == writes+1);
+
+    // Packets bigger than the buffer go straight out
+    IS_TRUE(client.publish((char*)"topic",(char*)"1234567890123456789012345678901234567890"));
+    IS_TRUE(shimClient.writes() == writes+3);
+
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload"));
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writes() == writes+4);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_session_store() {
+    IT("keeps unacknowledged messages in the session store");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    MemorySessionStore store;
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setSessionStore(store));
+    int rc = client.connect((char*)"client_test1",0,0,0,0,0,0,0);
+    IS_TRUE(rc);
+
+    IS_TRUE(client.publish((char*)"t",(const uint8_t*)"a",1,2,false));
+    IS_TRUE(client.publish((char*)"t",(const uint8_t*)"b",1,1,false));
+    IS_TRUE(store.count() == 2);
+    IS_TRUE(store.headers[0] == 0x34);
+
+    byte puback[] = { 0x40, 0x02, 0x00, 0x03 };
+    shimClient.respond(puback,4);
+    byte pubrec[] = { 0x50, 0x02, 0x00, 0x02 };
+    shimClient.respond(pubrec,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(store.count() == 1);
+    IS_TRUE(store.headers[0] == 0x62);
+    IS_TRUE(store.lengths[0] == 2);
+
+    // A new client, eg. after a restart, carries on with the session
+    ShimClient shimClient2;
+    shimClient2.setAllowConnect(true);
+    PubSubClient client2(server, 1883, callback, shimClient2);
+    IS_TRUE(client2.setSessionStore(store));
+    IS_TRUE(client2.getInflightCount() == 1);
+
+    byte connack_session[] = { 0x20, 0x02, 0x01, 0x00 };
+    shimClient2.respond(connack_session,4);
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x0,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    shimClient2.expect(connect,26);
+    byte pubrel[] = { 0x62, 0x02, 0x00, 0x02 };
+    shimClient2.expect(pubrel,4);
+    rc = client2.connect((char*)"client_test1",0,0,0,0,0,0,0);
+    IS_TRUE(rc);
+    IS_TRUE(client2.getSessionPresent());
+    IS_FALSE(shimClient2.error());
+
+    byte pubcomp[] = { 0x70, 0x02, 0x00, 0x02 };
+    shimClient2.respond(pubcomp,4);
+    rc = client2.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client2.getInflightCount() == 0);
+    IS_TRUE(store.count() == 0);
+
+    END_IT
+}
+
 int main()
 {
     SUITE("Publish");
@@ -185,7 +644,17 @@ int main()
     test_publish_retained_2();
     test_publish_not_connected();
     test_publish_too_long();
+    test_publish_larger_than_buffer();
     test_publish_P();
+    test_publish_qos1();
+    test_publish_qos1_window();
+    test_publish_qos1_retry();
+    test_publish_qos1_reconnect();
+    test_publish_qos2();
+    test_publish_session_store();
+    test_publish_session_lost();
+    test_publish_coalesced();
+    test_publish_coalesced_thresholds();
 
     FINISH
 }
@@ -0,0 +1,96 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "Bench.h"
+#include "trace.h"
+#include <sstream>
+
+// Measures how fast loop() parses and dispatches inbound PUBLISH packets
+// fed through a ShimClient. Run with `make bench`.
+
+byte server[] = { 172, 16, 0, 2 };
+
+unsigned long received = 0;
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    received += length;
+}
+
+// Writes a QoS 0 PUBLISH of payloadLength 'A's to a topicLength byte topic
+unsigned int build_publish(byte* packet, unsigned int topicLength, unsigned int payloadLength) {
+    unsigned int remaining = 2+topicLength+payloadLength;
+    unsigned int pos = 0;
+    packet[pos++] = 0x30;
+    do {
+        byte digit = remaining & 127;
+        remaining >>= 7;
+        if (remaining > 0) {
+            digit |= 0x80;
+        }
+        packet[pos++] = digit;
+    } while (remaining > 0);
+    packet[pos++] = (topicLength >> 8);
+    packet[pos++] = (topicLength & 0xFF);
+    memset(packet+pos,'t',topicLength);
+    pos += topicLength;
+    memset(packet+pos,'A',payloadLength);
+    pos += payloadLength;
+    return pos;
+}
+
+void bench_receive(unsigned int payloadLength, unsigned int topicLength, uint16_t bufferSize, unsigned long iterations) {
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setBufferSize(bufferSize);
+    client.connect((char*)"client_test1");
+
+    byte publish[1200];
+    unsigned int length = build_publish(publish,topicLength,payloadLength);
+    // As many packets as fit in the shim's response buffer are queued, then
+    // read by one loop() each
+    byte batch[2048];
+    unsigned int perBatch = sizeof(batch)/length;
+    for (unsigned int i = 0; i < perBatch; i++) {
+        memcpy(batch+i*length,publish,length);
+    }
+
+    received = 0;
+    BenchTimer timer;
+    unsigned long done = 0;
+    while (done < iterations) {
+        shimClient.respond(batch,perBatch*length);
+        timer.start();
+        for (unsigned int i = 0; i < perBatch; i++) {
+            client.loop();
+        }
+        timer.stop();
+        done += perBatch;
+    }
+
+    std::ostringstream params;
+    params << "payload=" << payloadLength << " topic=" << topicLength << " buffer=" << bufferSize;
+    if (received != (unsigned long)payloadLength*done) {
+        params << " dropped=1";
+    }
+    bench_report("receive",params.str(),done,timer.seconds(),length,payloadLength);
+}
+
+int main()
+{
+    const unsigned int payloads[] = { 16, 128, 1024 };
+    const unsigned int topics[] = { 5, 64 };
+    for (unsigned int p = 0; p < 3; p++) {
+        for (unsigned int t = 0; t < 2; t++) {
+            unsigned long iterations = payloads[p] < 1024 ? 200000 : 50000;
+            // Just big enough, and generously sized
+            bench_receive(payloads[p],topics[t],payloads[p]+topics[t]+8,iterations);
+            bench_receive(payloads[p],topics[t],2048,iterations);
+        }
+    }
+    return 0;
+}
@@ -27,6 +27,60 @@ void callback(char* topic, byte* payload, unsigned int length) {
     lastLength = length;
 }
 
+bool view_callback_called = false;
+const char* lastViewTopic;
+uint16_t lastViewTopicLength;
+const uint8_t* lastViewPayload;
+uint32_t lastViewLength;
+
+void view_callback(const char* topic, uint16_t topicLength, const uint8_t* payload, uint32_t length) {
+    view_callback_called = true;
+    lastViewTopic = topic;
+    lastViewTopicLength = topicLength;
+    lastViewPayload = payload;
+    lastViewLength = length;
+    memcpy(lastTopic,topic,topicLength);
+    lastTopic[topicLength] = '\0';
+    memcpy(lastPayload,payload,length);
+}
+
+bool chunk_begin_called = false;
+bool chunk_end_called = false;
+uint32_t chunkCount;
+uint32_t chunkTotal;
+uint32_t chunkReceived;
+bool chunkOffsetsValid;
+
+void reset_chunks() {
+    chunk_begin_called = false;
+    chunk_end_called = false;
+    chunkCount = 0;
+    chunkTotal = 0;
+    chunkReceived = 0;
+    chunkOffsetsValid = true;
+}
+
+void chunk_begin(const char* topic, uint16_t topicLength, uint32_t length) {
+    chunk_begin_called = true;
+    memcpy(lastTopic,topic,topicLength);
+    lastTopic[topicLength] = '\0';
+    chunkTotal = length;
+}
+
+void chunk_data(const uint8_t* data, uint32_t offset, uint32_t length, uint32_t total) {
+    chunkCount++;
+    if (offset != chunkReceived || total != chunkTotal || offset+length > total) {
+        chunkOffsetsValid = false;
+        return;
+    }
+    memcpy(lastPayload+offset,data,length);
+    chunkReceived += length;
+}
+
+void chunk_end() {
+    chunk_end_called = true;
+}
+
 int test_receive_callback() {
     IT("receives a callback message");
     reset_callback();
@@ -324,6 +378,460 @@ int test_receive_qos1() {
     END_IT
 }
 
+int test_receive_qos2() {
+    IT("receives a qos2 message exactly once");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x34,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte pubrec[] = {0x50,0x2,0x12,0x34};
+    shimClient.respond(publish,18);
+    shimClient.expect(pubrec,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+
+    // The server did not see the PUBREC and resends the message
+    reset_callback();
+    publish[0] = 0x3c;
+    shimClient.respond(publish,18);
+    shimClient.expect(pubrec,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(callback_called);
+
+    byte pubrel[] = {0x62,0x2,0x12,0x34};
+    byte pubcomp[] = {0x70,0x2,0x12,0x34};
+    shimClient.respond(pubrel,4);
+    shimClient.expect(pubcomp,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(callback_called);
+
+    // Once released, the id can be used for a new message
+    publish[0] = 0x34;
+    shimClient.respond(publish,18);
+    shimClient.expect(pubrec,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callback_called);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_qos2_table_full() {
+    IT("leaves a qos2 message unacknowledged when it cannot be tracked");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x34,0x8,0x0,0x1,0x74,0x0,0x1,0x61,0x62,0x63};
+    byte pubrec[] = {0x50,0x2,0x0,0x1};
+    for (int i = 1; i <= MQTT_MAX_INCOMING_QOS2; i++) {
+        publish[6] = pubrec[3] = i;
+        shimClient.respond(publish,10);
+        shimClient.expect(pubrec,4);
+        rc = client.loop();
+        IS_TRUE(rc);
+    }
+    IS_FALSE(shimClient.error());
+
+    reset_callback();
+    publish[6] = MQTT_MAX_INCOMING_QOS2+1;
+    shimClient.respond(publish,10);
+    uint16_t received = shimClient.received();
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(callback_called);
+    IS_TRUE(shimClient.received() == received);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_fragmented() {
+    IT("receives a message that arrives across several loop calls");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+
+    // Fixed header only
+    shimClient.respond(publish,1);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(callback_called);
+
+    // Remaining length and part of the topic
+    shimClient.respond(publish+1,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(callback_called);
+
+    // Nothing new
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(callback_called);
+
+    // Rest of the topic and part of the payload
+    shimClient.respond(publish+5,6);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(callback_called);
+
+    shimClient.respond(publish+11,5);
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_fragmented_qos1() {
+    IT("acknowledges a fragmented qos1 message once it is complete");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,10);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(callback_called);
+    IS_TRUE(shimClient.received() == 0x1a);
+
+    byte puback[] = {0x40,0x2,0x12,0x34};
+    shimClient.expect(puback,4);
+    shimClient.respond(publish+10,8);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    IS_TRUE(callback_called);
+    IS_TRUE(lastLength == 7);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_view_callback() {
+    IT("receives a view callback message without moving the topic");
+    reset_callback();
+    view_callback_called = false;
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setViewCallback(view_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,16);
+
+    rc = client.loop();
+
+    IS_TRUE(rc);
+
+    IS_FALSE(callback_called);
+    IS_TRUE(view_callback_called);
+    IS_TRUE(lastViewTopicLength == 5);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    // The payload immediately follows the topic, untouched, in the buffer
+    IS_TRUE(lastViewPayload == (const uint8_t*)lastViewTopic+5);
+    IS_TRUE(memcmp(lastViewTopic,"topicpayload",12)==0);
+    IS_TRUE(lastViewLength == 7);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_view_callback_qos1() {
+    IT("receives a qos1 view callback message");
+    reset_callback();
+    view_callback_called = false;
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, shimClient);
+    client.setViewCallback(view_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,18);
+
+    byte puback[] = {0x40,0x2,0x12,0x34};
+    shimClient.expect(puback,4);
+
+    rc = client.loop();
+
+    IS_TRUE(rc);
+
+    IS_TRUE(view_callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastViewLength == 7);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+PubSubClient* replyClient;
+
+// Replies first, then reads the message it was given
+void reply_callback(const char* topic, uint16_t topicLength, const uint8_t* payload, uint32_t length) {
+    replyClient->publish("out",payload,length);
+    view_callback(topic,topicLength,payload,length);
+}
+
+int test_receive_publish_in_callback() {
+    IT("keeps the received message intact while publishing from the callback");
+    reset_callback();
+    view_callback_called = false;
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, shimClient);
+    replyClient = &client;
+    client.setViewCallback(reply_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,18);
+
+    byte reply[] = {0x30,0xc,0x0,0x3,0x6f,0x75,0x74,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(reply,14);
+    byte puback[] = {0x40,0x2,0x12,0x34};
+    shimClient.expect(puback,4);
+
+    rc = client.loop();
+
+    IS_TRUE(rc);
+
+    IS_TRUE(view_callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastViewLength == 7);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_chunked_message() {
+    IT("delivers an oversized message in chunks");
+    reset_callback();
+    reset_chunks();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    int length = 80; // See comment in test_receive_max_sized_message before changing this value
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setBufferSize(30);
+    client.setChunkCallbacks(chunk_begin,chunk_data,chunk_end);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,(byte)(length-2),0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte bigPublish[length];
+    for (int i = 0; i < length; i++) {
+        bigPublish[i] = 'A'+(i%26);
+    }
+    memcpy(bigPublish,publish,16);
+    shimClient.respond(bigPublish,length);
+
+    rc = client.loop();
+
+    IS_TRUE(rc);
+
+    IS_FALSE(callback_called);
+    IS_TRUE(chunk_begin_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(chunkTotal == length-9);
+    IS_TRUE(chunkCount > 1);
+    IS_TRUE(chunkOffsetsValid);
+    IS_TRUE(chunkReceived == chunkTotal);
+    IS_TRUE(memcmp(lastPayload,bigPublish+9,chunkTotal)==0);
+    IS_TRUE(chunk_end_called);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_chunked_fragmented_qos1() {
+    IT("delivers a fragmented oversized qos1 message in chunks and acknowledges it");
+    reset_callback();
+    reset_chunks();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    int length = 80; // See comment in test_receive_max_sized_message before changing this value
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setBufferSize(30);
+    client.setChunkCallbacks(chunk_begin,chunk_data,chunk_end);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,(byte)(length-2),0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34};
+    byte bigPublish[length];
+    for (int i = 0; i < length; i++) {
+        bigPublish[i] = 'A'+(i%26);
+    }
+    memcpy(bigPublish,publish,11);
+
+    shimClient.respond(bigPublish,40);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(chunk_begin_called);
+    IS_FALSE(chunk_end_called);
+    IS_TRUE(chunkReceived == 40-11);
+
+    byte puback[] = {0x40,0x2,0x12,0x34};
+    shimClient.expect(puback,4);
+    shimClient.respond(bigPublish+40,length-40);
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    IS_FALSE(callback_called);
+    IS_TRUE(chunkTotal == length-11);
+    IS_TRUE(chunkOffsetsValid);
+    IS_TRUE(chunkReceived == chunkTotal);
+    IS_TRUE(memcmp(lastPayload,bigPublish+11,chunkTotal)==0);
+    IS_TRUE(chunk_end_called);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_chunked_then_normal() {
+    IT("delivers a normal message to the callback after a chunked one");
+    reset_callback();
+    reset_chunks();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    const int length = 80;
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setBufferSize(30);
+    client.setChunkCallbacks(chunk_begin,chunk_data,chunk_end);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,(byte)(length-2),0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    byte bigPublish[length];
+    for (int i = 0; i < length; i++) {
+        bigPublish[i] = 'A'+(i%26);
+    }
+    memcpy(bigPublish,publish,9);
+    shimClient.respond(bigPublish,length);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(chunk_end_called);
+    IS_FALSE(callback_called);
+
+    reset_chunks();
+    byte small[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(small,18);
+    byte puback[] = {0x40,0x2,0x12,0x34};
+    shimClient.expect(puback,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callback_called);
+    IS_FALSE(chunk_begin_called);
+    IS_TRUE(chunkCount == 0);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(lastLength == 7);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int main()
 {
     SUITE("Receive");
@@ -335,6 +843,16 @@ int main()
     test_resize_buffer();
     test_receive_oversized_stream_message();
     test_receive_qos1();
+    test_receive_qos2();
+    test_receive_qos2_table_full();
+    test_receive_fragmented();
+    test_receive_fragmented_qos1();
+    test_receive_view_callback();
+    test_receive_view_callback_qos1();
+    test_receive_publish_in_callback();
+    test_receive_chunked_message();
+    test_receive_chunked_fragmented_qos1();
+    test_receive_chunked_then_normal();
 
     FINISH
 }
@@ -0,0 +1,242 @@
+#include "PubSubClient.h"
+#include "MqttRouter.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+byte server[] = { 172, 16, 0, 2 };
+
+bool callback_called = false;
+int handler_a_calls = 0;
+int handler_b_calls = 0;
+char lastTopic[1024];
+char lastPayload[1024];
+uint32_t lastLength;
+
+void reset_handlers() {
+    callback_called = false;
+    handler_a_calls = 0;
+    handler_b_calls = 0;
+    lastTopic[0] = '\0';
+    lastPayload[0] = '\0';
+    lastLength = 0;
+}
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    callback_called = true;
+}
+
+void handler_a(const char* topic, uint16_t topicLength, const uint8_t* payload, uint32_t length) {
+    handler_a_calls++;
+    memcpy(lastTopic,topic,topicLength);
+    lastTopic[topicLength] = '\0';
+    memcpy(lastPayload,payload,length);
+    lastLength = length;
+}
+
+void handler_b(const char* topic, uint16_t topicLength, const uint8_t* payload, uint32_t length) {
+    handler_b_calls++;
+}
+
+uint8_t route(MqttRouter& router, const char* topic) {
+    return router.dispatch(topic,strlen(topic),(const uint8_t*)"x",1);
+}
+
+int test_router_exact() {
+    IT("routes exact topic filters");
+    reset_handlers();
+    MqttRouter router;
+    IS_TRUE(router.add("auth/door/command",handler_a));
+    IS_TRUE(router.add("auth/door/pair",handler_b));
+
+    IS_TRUE(route(router,"auth/door/command") == 1);
+    IS_TRUE(handler_a_calls == 1);
+    IS_TRUE(handler_b_calls == 0);
+    IS_TRUE(strcmp(lastTopic,"auth/door/command")==0);
+
+    IS_TRUE(route(router,"auth/door/pair") == 1);
+    IS_TRUE(handler_b_calls == 1);
+
+    IS_TRUE(route(router,"auth/door") == 0);
+    IS_TRUE(route(router,"auth/door/command/x") == 0);
+    IS_TRUE(route(router,"auth/door/comman") == 0);
+    IS_TRUE(handler_a_calls == 1);
+    END_IT
+}
+
+int test_router_plus() {
+    IT("routes single-level wildcards");
+    reset_handlers();
+    MqttRouter router;
+    IS_TRUE(router.add("auth/+/command",handler_a));
+
+    IS_TRUE(route(router,"auth/door1/command") == 1);
+    IS_TRUE(route(router,"auth/door2/command") == 1);
+    IS_TRUE(route(router,"auth//command") == 1);
+    IS_TRUE(route(router,"auth/door1/x/command") == 0);
+    IS_TRUE(route(router,"auth/door1") == 0);
+    IS_TRUE(handler_a_calls == 3);
+    END_IT
+}
+
+int test_router_hash() {
+    IT("routes multi-level wildcards");
+    reset_handlers();
+    MqttRouter router;
+    IS_TRUE(router.add("auth/#",handler_a));
+
+    IS_TRUE(route(router,"auth") == 1);
+    IS_TRUE(route(router,"auth/door") == 1);
+    IS_TRUE(route(router,"auth/door/1/command") == 1);
+    IS_TRUE(route(router,"other/door") == 0);
+    IS_TRUE(handler_a_calls == 3);
+    END_IT
+}
+
+int test_router_dollar() {
+    IT("does not match $ topics with leading wildcards");
+    reset_handlers();
+    MqttRouter router;
+    IS_TRUE(router.add("#",handler_a));
+    IS_TRUE(router.add("+/status",handler_b));
+    IS_TRUE(router.add("$SYS/status",handler_b));
+
+    IS_TRUE(route(router,"$SYS/status") == 1);
+    IS_TRUE(handler_a_calls == 0);
+    IS_TRUE(handler_b_calls == 1);
+
+    IS_TRUE(route(router,"door/status") == 2);
+    IS_TRUE(handler_a_calls == 1);
+    IS_TRUE(handler_b_calls == 2);
+    END_IT
+}
+
+int test_router_overlapping() {
+    IT("calls every matching handler once");
+    reset_handlers();
+    MqttRouter router;
+    IS_TRUE(router.add("auth/door/command",handler_a));
+    IS_TRUE(router.add("auth/+/command",handler_b));
+    IS_TRUE(router.add("auth/door/#",handler_b));
+
+    IS_TRUE(route(router,"auth/door/command") == 3);
+    IS_TRUE(handler_a_calls == 1);
+    IS_TRUE(handler_b_calls == 2);
+    END_IT
+}
+
+int test_router_replace_remove() {
+    IT("replaces and removes handlers");
+    reset_handlers();
+    MqttRouter router;
+    IS_TRUE(router.add("a/b",handler_a));
+    IS_TRUE(router.add("a/b",handler_b));
+    IS_TRUE(route(router,"a/b") == 1);
+    IS_TRUE(handler_a_calls == 0);
+    IS_TRUE(handler_b_calls == 1);
+
+    IS_TRUE(router.remove("a/b"));
+    IS_FALSE(router.remove("a/b"));
+    IS_FALSE(router.remove("a/c"));
+    IS_TRUE(route(router,"a/b") == 0);
+
+    IS_TRUE(router.add("a/#",handler_a));
+    IS_TRUE(router.remove("a/#"));
+    IS_TRUE(route(router,"a/b") == 0);
+    END_IT
+}
+
+int test_router_invalid() {
+    IT("rejects invalid filters");
+    MqttRouter router;
+    IS_FALSE(router.add("a/#/b",handler_a));
+    IS_FALSE(router.add("a/b#",handler_a));
+    IS_FALSE(router.add("a/b+",handler_a));
+    IS_FALSE(router.add(NULL,handler_a));
+    IS_FALSE(router.add("a",NULL));
+    END_IT
+}
+
+int test_router_full() {
+    IT("fails once the trie is full");
+    MqttRouter router;
+    static char filters[MQTT_ROUTER_MAX_NODES][8];
+    int added = 0;
+    for (int i = 0; i < MQTT_ROUTER_MAX_NODES; i++) {
+        sprintf(filters[i],"t%d",i);
+        if (router.add(filters[i],handler_a)) {
+            added++;
+        }
+    }
+    // The root takes one node
+    IS_TRUE(added == MQTT_ROUTER_MAX_NODES-1);
+    IS_TRUE(route(router,"t0") == 1);
+    IS_TRUE(route(router,filters[MQTT_ROUTER_MAX_NODES-2]) == 1);
+    END_IT
+}
+
+int test_subscribe_handler() {
+    IT("subscribes with a handler and routes messages to it");
+    reset_handlers();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte subscribe[] = { 0x82,0xa,0x0,0x2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x1 };
+    shimClient.expect(subscribe,12);
+
+    rc = client.subscribe((char*)"topic",1,handler_a);
+    IS_TRUE(rc);
+    IS_FALSE(shimClient.error());
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,16);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    IS_TRUE(handler_a_calls == 1);
+    IS_FALSE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+
+    // Topics without a handler still reach the callback
+    byte other[] = {0x30,0xe,0x0,0x5,0x6f,0x74,0x68,0x65,0x72,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(other,16);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    IS_TRUE(handler_a_calls == 1);
+    IS_TRUE(callback_called);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Router");
+    test_router_exact();
+    test_router_plus();
+    test_router_hash();
+    test_router_dollar();
+    test_router_overlapping();
+    test_router_replace_remove();
+    test_router_invalid();
+    test_router_full();
+    test_subscribe_handler();
+
+    FINISH
+}
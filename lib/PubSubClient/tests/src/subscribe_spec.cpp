@@ -61,6 +61,31 @@ int test_subscribe_qos_1() {
     END_IT
 }
 
+int test_subscribe_qos_2() {
+    IT("subscribes qos 2");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte subscribe[] = { 0x82,0xa,0x0,0x2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x2 };
+    shimClient.expect(subscribe,12);
+    byte suback[] = { 0x90,0x3,0x0,0x2,0x2 };
+    shimClient.respond(suback,5);
+
+    rc = client.subscribe((char*)"topic",2);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int test_subscribe_not_connected() {
     IT("subscribe fails when not connected");
     ShimClient shimClient;
@@ -87,7 +112,7 @@ int test_subscribe_invalid_qos() {
     int rc = client.connect((char*)"client_test1");
     IS_TRUE(rc);
 
-    rc = client.subscribe((char*)"topic",2);
+    rc = client.subscribe((char*)"topic",3);
     IS_FALSE(rc);
     rc = client.subscribe((char*)"topic",254);
     IS_FALSE(rc);
@@ -164,15 +189,185 @@ int test_unsubscribe_not_connected() {
     END_IT
 }
 
+int test_subscribe_batch() {
+    IT("subscribes to several topics in one packet and tracks the suback");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    const char* topics[] = { "a", "bc" };
+    uint8_t qos[] = { 1, 2 };
+    byte subscribe[] = { 0x82,0xb,0x0,0x2,0x0,0x1,0x61,0x1,0x0,0x2,0x62,0x63,0x2 };
+    shimClient.expect(subscribe,13);
+
+    rc = client.subscribe(topics,qos,2);
+    IS_TRUE(rc);
+    IS_TRUE(client.getSubscriptionStatus("a") == MQTT_SUBACK_PENDING);
+    IS_TRUE(client.getSubscriptionStatus("bc") == MQTT_SUBACK_PENDING);
+    IS_TRUE(client.getSubscriptionStatus("d") == MQTT_SUBACK_FAILURE);
+
+    byte suback[] = { 0x90,0x4,0x0,0x2,0x1,0x80 };
+    shimClient.respond(suback,6);
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    IS_TRUE(client.getSubscriptionStatus("a") == 1);
+    IS_TRUE(client.getSubscriptionStatus("bc") == MQTT_SUBACK_FAILURE);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_subscribe_batch_invalid() {
+    IT("rejects a batch if any topic is invalid");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    const char* topics[] = { "a", "b" };
+    uint8_t qos[] = { 1, 3 };
+    rc = client.subscribe(topics,qos,2);
+    IS_FALSE(rc);
+    IS_TRUE(client.getSubscriptionStatus("a") == MQTT_SUBACK_FAILURE);
+
+    rc = client.subscribe(topics,qos,0);
+    IS_FALSE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_subscribe_resubscribe() {
+    IT("resubscribes in one packet after reconnecting");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte subscribe1[] = { 0x82,0x6,0x0,0x2,0x0,0x1,0x61,0x1 };
+    shimClient.expect(subscribe1,8);
+    rc = client.subscribe("a",1);
+    IS_TRUE(rc);
+    byte subscribe2[] = { 0x82,0x7,0x0,0x3,0x0,0x2,0x62,0x63,0x0 };
+    shimClient.expect(subscribe2,9);
+    rc = client.subscribe("bc",0);
+    IS_TRUE(rc);
+    byte subscribe3[] = { 0x82,0x6,0x0,0x4,0x0,0x1,0x64,0x0 };
+    shimClient.expect(subscribe3,8);
+    rc = client.subscribe("d");
+    IS_TRUE(rc);
+
+    byte unsubscribe[] = { 0xa2,0x5,0x0,0x5,0x0,0x1,0x64 };
+    shimClient.expect(unsubscribe,7);
+    rc = client.unsubscribe("d");
+    IS_TRUE(rc);
+    IS_FALSE(shimClient.error());
+
+    // Connection lost
+    shimClient.setConnected(false);
+    shimClient.respond(connack,4);
+
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    shimClient.expect(connect,26);
+    byte resubscribe[] = { 0x82,0xb,0x0,0x2,0x0,0x1,0x61,0x1,0x0,0x2,0x62,0x63,0x0 };
+    shimClient.expect(resubscribe,13);
+
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getSubscriptionStatus("a") == MQTT_SUBACK_PENDING);
+    IS_TRUE(client.getSubscriptionStatus("d") == MQTT_SUBACK_FAILURE);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_subscribe_session_present() {
+    IT("does not resubscribe when the server kept the session");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1",0,0,0,0,0,0,0);
+    IS_TRUE(rc);
+    IS_FALSE(client.getSessionPresent());
+
+    rc = client.subscribe("a",1);
+    IS_TRUE(rc);
+    byte suback[] = { 0x90,0x3,0x0,0x2,0x1 };
+    shimClient.respond(suback,5);
+    rc = client.loop();
+    IS_TRUE(rc);
+    // Sent, but its SUBACK is lost with the connection
+    rc = client.subscribe("b",1);
+    IS_TRUE(rc);
+
+    shimClient.setConnected(false);
+    byte connack_session[] = { 0x20, 0x02, 0x01, 0x00 };
+    shimClient.respond(connack_session,4);
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x0,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    shimClient.expect(connect,26);
+    byte subscribe[] = { 0x82,0x6,0x0,0x2,0x0,0x1,0x62,0x1 };
+    shimClient.expect(subscribe,8);
+
+    rc = client.connect((char*)"client_test1",0,0,0,0,0,0,0);
+    IS_TRUE(rc);
+    IS_TRUE(client.getSessionPresent());
+    IS_TRUE(client.getSubscriptionStatus("a") == 1);
+    IS_FALSE(shimClient.error());
+
+    // The server lost the session: everything is sent again
+    shimClient.setConnected(false);
+    shimClient.respond(connack,4);
+    shimClient.expect(connect,26);
+    byte resubscribe[] = { 0x82,0xa,0x0,0x2,0x0,0x1,0x61,0x1,0x0,0x1,0x62,0x1 };
+    shimClient.expect(resubscribe,12);
+
+    rc = client.connect((char*)"client_test1",0,0,0,0,0,0,0);
+    IS_TRUE(rc);
+    IS_FALSE(client.getSessionPresent());
+    IS_TRUE(client.getSubscriptionStatus("a") == MQTT_SUBACK_PENDING);
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int main()
 {
     SUITE("Subscribe");
     test_subscribe_no_qos();
     test_subscribe_qos_1();
+    test_subscribe_qos_2();
     test_subscribe_not_connected();
     test_subscribe_invalid_qos();
     test_subscribe_too_long();
     test_unsubscribe();
     test_unsubscribe_not_connected();
+    test_subscribe_batch();
+    test_subscribe_batch_invalid();
+    test_subscribe_resubscribe();
+    test_subscribe_session_present();
     FINISH
 }
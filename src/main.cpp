@@ -4,6 +4,8 @@
 
 #include <WiFi.h>
 #include <PubSubClient.h>
+#include <MqttOutbox.h>
+#include <MqttPublishQueue.h>
 
 #include <Arduino.h>
 #include <Wire.h>
@@ -58,10 +60,173 @@ const char* TOPIC_PAIR_STATUS = "auth/door/pair_status";
 
 WiFiClient espClient;
 PubSubClient mqttClient(espClient);
+String mqttClientId;          // beginConnect() keeps a pointer to it
+bool mqttSubscribed = false; // set once the subscription set has been handed to mqttClient
+bool mqttWasConnected = false;
+uint16_t mqttResolvedAt = 0;  // mqttClient.getConnectFailures() at the last lookup
+
+// ----------------- Outbox -----------------
+// Events that cannot be published (broker down, in-flight window full) are
+// queued in RAM and spilled to an NVS log when that fills up, then drained in
+// batches from loop() once the broker is back.
+// NVS log: one blob per record, "ob0".."ob63" used as a ring, plus
+// "ob_head" / "ob_tail" -> uint32 sequence numbers of the oldest / next record
+const uint16_t OUTBOX_MAX_RECORDS = 64;
+
+class PrefsOutboxStorage : public MqttOutboxStorage {
+public:
+  void begin() {
+    head = prefs.getUInt("ob_head", 0);
+    tail = prefs.getUInt("ob_tail", 0);
+    if (tail < head || tail - head > OUTBOX_MAX_RECORDS) {
+      // Inconsistent counters - start again with an empty log
+      head = tail = 0;
+      save();
+    }
+  }
+  boolean append(const uint8_t* data, uint16_t length) {
+    if (tail - head >= OUTBOX_MAX_RECORDS) return false;
+    if (prefs.putBytes(key(tail).c_str(), data, length) != length) return false;
+    tail++;
+    prefs.putUInt("ob_tail", tail);
+    return true;
+  }
+  uint16_t peek(uint8_t* data, uint16_t size) {
+    if (head == tail) return 0;
+    String k = key(head);
+    size_t n = prefs.getBytesLength(k.c_str());
+    if (n == 0 || n > size) return 0;
+    return prefs.getBytes(k.c_str(), data, n);
+  }
+  void pop() {
+    if (head == tail) return;
+    prefs.remove(key(head).c_str());
+    head++;
+    if (head == tail) head = tail = 0;
+    save();
+  }
+  uint16_t count() { return tail - head; }
+private:
+  uint32_t head = 0;
+  uint32_t tail = 0;
+  String key(uint32_t seq) { return "ob" + String(seq % OUTBOX_MAX_RECORDS); }
+  void save() {
+    prefs.putUInt("ob_head", head);
+    prefs.putUInt("ob_tail", tail);
+  }
+};
+
+PrefsOutboxStorage outboxStorage;
+MqttOutbox outbox(outboxStorage);
+
+// Tasks other than loop() must not touch mqttClient; they publish through this
+// queue instead and loop() sends what they posted.
+MqttPublishQueue publishQueue;
+
+// ----------------- MQTT session -----------------
+// We connect with a persistent session, so commands queued by the broker while
+// we were away are delivered on reconnect, and keep our own half of it (QoS 1
+// and 2 messages not yet acknowledged) in NVS so it survives a restart.
+// NVS: one blob per in-flight message, "ss0".."ss7" ->
+//   [msgId hi][msgId lo][fixed header][rest of packet]
+// The records live in RAM and only go to NVS when the connection drops, or at
+// most every SESSION_PERSIST_MS while connected, instead of on every publish
+// and ack. A restart loses (or resends) what changed since the last write.
+const uint8_t SESSION_MAX_RECORDS = MQTT_MAX_INFLIGHT;
+const unsigned long SESSION_PERSIST_MS = 60000;
+
+class PrefsSessionStore : public MqttSessionStore {
+public:
+  void begin() {
+    for (uint8_t i = 0; i < SESSION_MAX_RECORDS; i++) {
+      lengths[i] = 0;
+      dirty[i] = false;
+      size_t n = prefs.getBytesLength(key(i).c_str());
+      if (n > 3 && n <= sizeof(records[i]) && prefs.getBytes(key(i).c_str(), records[i], n) == n) {
+        lengths[i] = n;
+      }
+    }
+  }
+  boolean save(uint16_t msgId, uint8_t header, const uint8_t* packet, uint16_t length) {
+    if (length + 3u > sizeof(records[0])) return false;
+    uint8_t i = find(msgId);
+    if (i == SESSION_MAX_RECORDS) i = find(0);
+    if (i == SESSION_MAX_RECORDS) return false;
+    records[i][0] = msgId >> 8;
+    records[i][1] = msgId & 0xFF;
+    records[i][2] = header;
+    memcpy(records[i] + 3, packet, length);
+    lengths[i] = length + 3;
+    dirty[i] = true;
+    return true;
+  }
+  void remove(uint16_t msgId) {
+    uint8_t i = find(msgId);
+    if (i == SESSION_MAX_RECORDS) return;
+    lengths[i] = 0;
+    dirty[i] = true;
+  }
+  uint16_t load(uint8_t index, uint16_t* msgId, uint8_t* header, uint8_t* packet, uint16_t size) {
+    for (uint8_t i = 0; i < SESSION_MAX_RECORDS; i++) {
+      if (lengths[i] == 0 || index-- > 0) continue;
+      if (lengths[i] - 3u > size) return 0;
+      *msgId = id(i);
+      *header = records[i][2];
+      memcpy(packet, records[i] + 3, lengths[i] - 3);
+      return lengths[i] - 3;
+    }
+    return 0;
+  }
+  uint8_t count() {
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < SESSION_MAX_RECORDS; i++) {
+      if (lengths[i] != 0) n++;
+    }
+    return n;
+  }
+  // Writes the records changed since the last call to NVS
+  void persist() {
+    for (uint8_t i = 0; i < SESSION_MAX_RECORDS; i++) {
+      if (!dirty[i]) continue;
+      if (lengths[i] != 0) {
+        prefs.putBytes(key(i).c_str(), records[i], lengths[i]);
+      } else {
+        prefs.remove(key(i).c_str());
+      }
+      dirty[i] = false;
+    }
+    lastPersist = millis();
+  }
+  // Call from loop(): persists once the connection is down, or when due
+  void persistWhenDue(bool connected) {
+    if (connected && millis() - lastPersist < SESSION_PERSIST_MS) return;
+    for (uint8_t i = 0; i < SESSION_MAX_RECORDS; i++) {
+      if (dirty[i]) {
+        persist();
+        return;
+      }
+    }
+  }
+private:
+  uint8_t records[SESSION_MAX_RECORDS][3 + MQTT_MAX_PACKET_SIZE];
+  uint16_t lengths[SESSION_MAX_RECORDS]; // 0 if the record is free
+  bool dirty[SESSION_MAX_RECORDS];       // changed since the last persist()
+  unsigned long lastPersist = 0;
+  String key(uint8_t i) { return "ss" + String(i); }
+  uint16_t id(uint8_t i) { return (records[i][0] << 8) | records[i][1]; }
+  uint8_t find(uint16_t msgId) {
+    uint8_t i = 0;
+    while (i < SESSION_MAX_RECORDS && (msgId == 0 ? lengths[i] != 0 : (lengths[i] == 0 || id(i) != msgId))) i++;
+    return i;
+  }
+};
+
+PrefsSessionStore sessionStore;
 
 // ----------------- Appairage / stockage -----------------
-// Max paired clients persisted
-const uint8_t MAX_PAIRED = 20;
+// Max paired clients persisted, and the longest client id
+const uint16_t MAX_PAIRED = 128;
+const uint8_t PAIRED_ID_MAX = 48;
 
 // Preferences keys:
 // "pair_count" -> uint16
@@ -92,16 +257,29 @@ void lcdPrintBoth(const char *l1, const char *l2) {
   lcd.print(l2);
 }
 
-String uidToKey(const MFRC522::Uid &u) {
+String bytesToKey(const uint8_t *b, uint8_t n) {
   String s = "";
-  for (byte i = 0; i < u.size; i++) {
-    if (u.uidByte[i] < 0x10) s += "0";
-    s += String(u.uidByte[i], HEX);
+  for (byte i = 0; i < n; i++) {
+    if (b[i] < 0x10) s += "0";
+    s += String(b[i], HEX);
   }
   s.toUpperCase();
   return s;
 }
 
+String uidToKey(const MFRC522::Uid &u) {
+  return bytesToKey(u.uidByte, u.size);
+}
+
+uint32_t fnv1a(const uint8_t *b, size_t n) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < n; i++) {
+    h ^= b[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
 void openLock() {
   lockServo.write(SERVO_OPEN_POS);
   delay(800);
@@ -109,14 +287,140 @@ void openLock() {
 }
 
 // ----------------- Persistence utilities (paired clients) -----------------
+// The paired clients are kept in RAM as a hashed set of fixed-size ids,
+// loaded from NVS once in setup() and written through on every change, so
+// authorizing a command reads no flash. Each entry remembers its NVS slot
+// ("pairN"), and bySlot maps a slot back to its entry for listing and
+// compaction. Unpairing leaves an empty slot (one write) that
+// compactPairedStep() later fills with the last entry.
+// Open addressing with linear probing, at most half full; a removed entry
+// leaves a marker so probes for the entries past it still get there. Once
+// PAIRED_REMOVED_MAX markers pile up, compactPairedStep() rehashes the table
+// so misses stop probing through them.
+const uint16_t PAIRED_SET_SLOTS = 256; // power of two, at least 2 * MAX_PAIRED
+const uint8_t PAIRED_REMOVED = 0xFF;
+const uint16_t PAIRED_REMOVED_MAX = MAX_PAIRED / 8;
+
+class PairedSet {
+public:
+  PairedSet() { clear(); }
+  void clear() {
+    for (uint16_t i = 0; i < PAIRED_SET_SLOTS; i++) entries[i].len = 0;
+    for (uint16_t i = 0; i < MAX_PAIRED; i++) bySlot[i] = -1;
+    used = 0;
+    removed = 0;
+  }
+  bool add(const char *id, size_t len, uint16_t slot) {
+    if (len == 0 || len > PAIRED_ID_MAX || slot >= MAX_PAIRED || used >= MAX_PAIRED) return false;
+    if (locate(id, len) >= 0) return false;
+    uint16_t i = hash(id, len);
+    while (entries[i].len != 0 && entries[i].len != PAIRED_REMOVED) i = next(i);
+    if (entries[i].len == PAIRED_REMOVED) removed--;
+    entries[i].len = len;
+    memcpy(entries[i].id, id, len);
+    entries[i].id[len] = '\0';
+    entries[i].slot = slot;
+    bySlot[slot] = i;
+    used++;
+    return true;
+  }
+  // The NVS slot of id, or -1
+  int32_t find(const char *id, size_t len) {
+    int32_t i = locate(id, len);
+    return i < 0 ? -1 : entries[i].slot;
+  }
+  bool remove(const char *id, size_t len) {
+    int32_t i = locate(id, len);
+    if (i < 0) return false;
+    bySlot[entries[i].slot] = -1;
+    // Nothing can have probed past i if the next entry is free
+    if (entries[next(i)].len == 0) {
+      entries[i].len = 0;
+    } else {
+      entries[i].len = PAIRED_REMOVED;
+      removed++;
+    }
+    used--;
+    return true;
+  }
+  bool rehashDue() { return removed >= PAIRED_REMOVED_MAX; }
+  // Drops the removed markers, then moves each entry reached through one of
+  // them back towards its hash until every entry has no free slot on its
+  // probe path. Each move shortens a path, so the passes end.
+  void rehash() {
+    for (uint16_t i = 0; i < PAIRED_SET_SLOTS; i++) {
+      if (entries[i].len == PAIRED_REMOVED) entries[i].len = 0;
+    }
+    removed = 0;
+    bool moved = true;
+    while (moved) {
+      moved = false;
+      for (uint16_t k = 0; k < PAIRED_SET_SLOTS; k++) {
+        if (entries[k].len == 0) continue;
+        uint16_t i = hash(entries[k].id, entries[k].len);
+        while (i != k && entries[i].len != 0) i = next(i);
+        if (i == k) continue;
+        entries[i] = entries[k];
+        entries[k].len = 0;
+        bySlot[entries[i].slot] = i;
+        moved = true;
+      }
+    }
+  }
+  // The id held in an NVS slot, or NULL for an empty one
+  const char *atSlot(uint16_t slot) {
+    if (slot >= MAX_PAIRED || bySlot[slot] < 0) return NULL;
+    return entries[bySlot[slot]].id;
+  }
+  void move(uint16_t from, uint16_t to) {
+    if (from >= MAX_PAIRED || to >= MAX_PAIRED || bySlot[from] < 0) return;
+    bySlot[to] = bySlot[from];
+    bySlot[from] = -1;
+    entries[bySlot[to]].slot = to;
+  }
+  uint16_t count() { return used; }
+private:
+  struct Entry {
+    uint8_t len;                    // 0: free, PAIRED_REMOVED: removed
+    char id[PAIRED_ID_MAX + 1];
+    uint16_t slot;
+  };
+  Entry entries[PAIRED_SET_SLOTS];
+  int16_t bySlot[MAX_PAIRED];       // entry index, -1 if the slot is empty
+  uint16_t used = 0;
+  uint16_t removed = 0;             // PAIRED_REMOVED markers in entries
+  static uint16_t next(uint16_t i) { return (i + 1) & (PAIRED_SET_SLOTS - 1); }
+  static uint16_t hash(const char *id, size_t len) {
+    uint32_t h = fnv1a((const uint8_t *)id, len);
+    return (h ^ (h >> 16)) & (PAIRED_SET_SLOTS - 1);
+  }
+  int32_t locate(const char *id, size_t len) {
+    if (len == 0 || len > PAIRED_ID_MAX) return -1;
+    uint16_t i = hash(id, len);
+    for (uint16_t probes = 0; probes < PAIRED_SET_SLOTS && entries[i].len != 0; probes++) {
+      if (entries[i].len == len && memcmp(entries[i].id, id, len) == 0) return i;
+      i = next(i);
+    }
+    return -1;
+  }
+};
+
+PairedSet pairedSet;
+uint16_t pairedSlots = 0;   // "pair_count": slots in use, empty ones included
+
 uint16_t pairedCount() {
-  return prefs.getUShort(PREF_PAIR_COUNT, 0);
+  return pairedSlots;
 }
 
 void setPairedCount(uint16_t v) {
+  pairedSlots = v;
   prefs.putUShort(PREF_PAIR_COUNT, v);
 }
 
+uint16_t pairedHoles() {
+  return pairedSlots - pairedSet.count();
+}
+
 String pairedKeyName(uint16_t idx) {
   // returns key like "pair0", "pair1"
   char buf[16];
@@ -128,49 +432,89 @@ String getPairedAt(uint16_t idx) {
   return prefs.getString(pairedKeyName(idx).c_str(), "");
 }
 
-bool isPairedClient(const String &clientId) {
-  uint16_t n = pairedCount();
-  for (uint16_t i = 0; i < n; ++i) {
-    if (getPairedAt(i) == clientId) return true;
+// Loads the paired clients from NVS
+void initPaired() {
+  pairedSet.clear();
+  pairedSlots = prefs.getUShort(PREF_PAIR_COUNT, 0);
+  if (pairedSlots > MAX_PAIRED) pairedSlots = MAX_PAIRED;
+  for (uint16_t i = 0; i < pairedSlots; ++i) {
+    String id = getPairedAt(i);
+    if (id.length() == 0) continue;
+    if (id.length() > PAIRED_ID_MAX || pairedSet.find(id.c_str(), id.length()) >= 0) {
+      // Too long to keep, or a second copy left by a compaction step cut short
+      Serial.print("Paired slot dropped: "); Serial.println(id);
+      prefs.remove(pairedKeyName(i).c_str());
+      continue;
+    }
+    pairedSet.add(id.c_str(), id.length(), i);
   }
-  return false;
+}
+
+// One step of filling the slots of unpaired clients, at most three writes,
+// or of rehashing the RAM set. Returns false when there is nothing to do
+bool compactPairedStep() {
+  if (pairedSet.rehashDue()) {
+    pairedSet.rehash();
+    return true;
+  }
+  if (pairedHoles() == 0) return false;
+  uint16_t last = pairedSlots - 1;
+  const char *id = pairedSet.atSlot(last);
+  if (id == NULL) {
+    setPairedCount(last);
+    return true;
+  }
+  uint16_t hole = 0;
+  while (hole < last && pairedSet.atSlot(hole) != NULL) hole++;
+  // A reset before the last entry is removed leaves it twice; initPaired()
+  // drops the second copy
+  prefs.putString(pairedKeyName(hole).c_str(), id);
+  prefs.remove(pairedKeyName(last).c_str());
+  setPairedCount(last);
+  pairedSet.move(last, hole);
+  return true;
+}
+
+bool isPairedClient(const String &clientId) {
+  return pairedSet.find(clientId.c_str(), clientId.length()) >= 0;
 }
 
 bool addPairedClient(const String &clientId) {
-  if (clientId.length() == 0) return false;
+  if (clientId.length() == 0 || clientId.length() > PAIRED_ID_MAX) return false;
   if (isPairedClient(clientId)) return false;
-  uint16_t n = pairedCount();
-  if (n >= MAX_PAIRED) return false;
+  while (pairedSlots >= MAX_PAIRED && compactPairedStep()) {}
+  if (pairedSlots >= MAX_PAIRED) return false;
+  uint16_t n = pairedSlots;
   prefs.putString(pairedKeyName(n).c_str(), clientId);
   setPairedCount(n + 1);
+  pairedSet.add(clientId.c_str(), clientId.length(), n);
   Serial.print("Paired saved: "); Serial.println(clientId);
   return true;
 }
 
 bool removePairedClient(const String &clientId) {
-  uint16_t n = pairedCount();
-  for (uint16_t i = 0; i < n; ++i) {
-    String k = getPairedAt(i);
-    if (k == clientId) {
-      // shift remaining
-      for (uint16_t j = i; j < n - 1; ++j) {
-        String next = getPairedAt(j + 1);
-        prefs.putString(pairedKeyName(j).c_str(), next);
-      }
-      prefs.remove(pairedKeyName(n - 1).c_str());
-      setPairedCount(n - 1);
-      Serial.print("Paired removed: "); Serial.println(clientId);
-      return true;
-    }
+  int32_t slot = pairedSet.find(clientId.c_str(), clientId.length());
+  if (slot < 0) return false;
+  prefs.remove(pairedKeyName(slot).c_str());
+  pairedSet.remove(clientId.c_str(), clientId.length());
+  Serial.print("Paired removed: "); Serial.println(clientId);
+  return true;
+}
+
+void clearPairedClients() {
+  for (uint16_t i = 0; i < pairedSlots; ++i) {
+    if (pairedSet.atSlot(i)) prefs.remove(pairedKeyName(i).c_str());
   }
-  return false;
+  setPairedCount(0);
+  pairedSet.clear();
 }
 
 void listPairedClientsSerial() {
-  uint16_t n = pairedCount();
-  Serial.print("Paired clients count: "); Serial.println(n);
-  for (uint16_t i = 0; i < n; ++i) {
-    Serial.print(" - "); Serial.println(getPairedAt(i));
+  Serial.print("Paired clients count: "); Serial.println(pairedSet.count());
+  for (uint16_t i = 0; i < pairedSlots; ++i) {
+    const char *id = pairedSet.atSlot(i);
+    if (id == NULL) continue;
+    Serial.print(" - "); Serial.println(id);
   }
 }
 
@@ -238,19 +582,34 @@ void cleanupPending() {
 }
 
 // ----------------- MQTT helpers -----------------
-void publishEvent(const char* result, const char* method, const char* key, const char* name) {
-  if (!mqttClient.connected()) {
-    Serial.println("publishEvent: mqtt not connected");
-    return;
-  }
+// count > 1: the event stands for that many attempts
+void publishEvent(const char* result, const char* method, const char* key, const char* name, uint16_t count = 1) {
   String payload = "{";
   payload += "\"result\":\""; payload += result; payload += "\",";
   payload += "\"method\":\""; payload += method; payload += "\",";
   payload += "\"key\":\""; payload += key; payload += "\",";
   payload += "\"name\":\""; payload += name; payload += "\",";
+  if (count > 1) {
+    payload += "\"count\":"; payload += String(count); payload += ",";
+  }
   payload += "\"ts\":"; payload += String(millis());
   payload += "}";
-  mqttClient.publish(TOPIC_EVENT, payload.c_str());
+  // QoS 1: kept by the client and resent until the broker acknowledges it
+  if (!mqttClient.connected() ||
+      !mqttClient.publish(TOPIC_EVENT, (const uint8_t*)payload.c_str(), payload.length(), 1, false)) {
+    // Not lost: held in the outbox until the broker can take it
+    if (outbox.push(TOPIC_EVENT, (const uint8_t*)payload.c_str(), payload.length(), 1, false)) {
+      Serial.print("MQTT queued (");
+      Serial.print(outbox.count());
+      Serial.print("): ");
+    } else {
+      Serial.print("MQTT outbox full, dropped: ");
+    }
+    Serial.println(payload);
+    return;
+  }
+  // An event usually ends a burst, and the caller is about to block in delay()
+  mqttClient.flush();
   Serial.print("MQTT published: ");
   Serial.println(payload);
 }
@@ -261,212 +620,878 @@ void publishStatus(const char* s) {
 }
 
 void clearAllUsers();
+bool revokeUser(const String &spec);
+
+// ----------------- Inbound message views -----------------
+// Inbound messages are parsed in place, as (pointer, length) views straight into
+// the MQTT client's receive buffer. Only values we keep become Strings.
+// Publishing does not touch that buffer, so a view stays valid until the
+// handler returns.
+void trimView(const char *&p, uint32_t &n) {
+  while (n && isspace((unsigned char)p[0])) { ++p; --n; }
+  while (n && isspace((unsigned char)p[n - 1])) --n;
+}
 
-void mqttCallback(char* topic, byte* payload, unsigned int length) {
-  String msg;
-  for (unsigned int i = 0; i < length; i++) msg += (char)payload[i];
-  msg.trim();
+bool viewStartsWith(const char *p, uint32_t n, const char *prefix) {
+  size_t k = strlen(prefix);
+  return n >= k && memcmp(p, prefix, k) == 0;
+}
+
+// index of c in p[from..n), or -1
+int viewIndexOf(const char *p, uint32_t n, char c, uint32_t from) {
+  for (uint32_t i = from; i < n; ++i) {
+    if (p[i] == c) return i;
+  }
+  return -1;
+}
+
+// trimmed copy of p[from..to)
+String viewToString(const char *p, uint32_t from, uint32_t to) {
+  const char *s = p + from;
+  uint32_t n = to - from;
+  trimView(s, n);
+  return String(s, n);
+}
+
+// Trims the payload view and logs the message
+void logInbound(const char *topic, uint16_t topicLen, const char *&msg, uint32_t &len) {
+  trimView(msg, len);
   Serial.print("MQTT RX topic=");
-  Serial.print(topic);
+  Serial.write((const uint8_t *)topic, topicLen);
   Serial.print(" msg=");
-  Serial.println(msg);
-
-  // ---- Pairing topic ----
-  if (String(topic) == TOPIC_PAIR) {
-    // Expect simple formats:
-    // REQ:<clientId>          -> request code (ESP shows code on LCD)
-    // CONF:<clientId>:<code>  -> confirm with the code shown on device
-    // UNP:<clientId>          -> unpair
-    if (msg.startsWith("REQ:")) {
-      String clientId = msg.substring(4);
-      clientId.trim();
-      if (clientId.length() == 0) {
-        mqttClient.publish(TOPIC_PAIR_STATUS, "REQ_ERR:missing_clientId");
-        return;
-      }
-      String code;
-      if (!addPending(clientId, code)) {
-        mqttClient.publish(TOPIC_PAIR_STATUS, ("REQ_ERR:busy"));
-        return;
-      }
-      // Show code on LCD so user can read and enter it on the web UI
-      lcdPrintBoth("Pair code:", code.c_str());
-      Serial.print("Pair code for "); Serial.print(clientId); Serial.print(" = "); Serial.println(code);
-      // Inform web that a challenge was generated (not secret: user must read LCD)
-      String out = "CHALLENGE:" + clientId + ":" + code; // optional, mostly for debugging
-      mqttClient.publish(TOPIC_PAIR_STATUS, out.c_str());
+  Serial.write((const uint8_t *)msg, len);
+  Serial.println();
+}
+
+// ---- Pairing topic ----
+void onPairMessage(const char* topic, uint16_t topicLen, const uint8_t* payload, uint32_t length) {
+  const char *msg = (const char *)payload;
+  uint32_t len = length;
+  logInbound(topic, topicLen, msg, len);
+
+  // Expect simple formats:
+  // REQ:<clientId>          -> request code (ESP shows code on LCD)
+  // CONF:<clientId>:<code>  -> confirm with the code shown on device
+  // UNP:<clientId>          -> unpair
+  if (viewStartsWith(msg, len, "REQ:")) {
+    String clientId = viewToString(msg, 4, len);
+    if (clientId.length() == 0) {
+      mqttClient.publish(TOPIC_PAIR_STATUS, "REQ_ERR:missing_clientId");
       return;
-    } else if (msg.startsWith("CONF:")) {
-      // CONF:<clientId>:<code>
-      int first = msg.indexOf(':', 5); // find second colon after "CONF:"
-      if (first <= 5) { mqttClient.publish(TOPIC_PAIR_STATUS, "CONF_ERR:bad_format"); return; }
-      String clientId = msg.substring(5, first);
-      String code = msg.substring(first + 1);
-      clientId.trim(); code.trim();
-      if (verifyPending(clientId, code)) {
-        if (addPairedClient(clientId)) {
-          String ok = "PAIR_OK:" + clientId;
-          mqttClient.publish(TOPIC_PAIR_STATUS, ok.c_str());
-          Serial.print("Client paired: "); Serial.println(clientId);
-          lcdPrintBoth("Paired:", clientId.c_str());
-        } else {
-          mqttClient.publish(TOPIC_PAIR_STATUS, ("PAIR_ERR:save_failed"));
-        }
-      } else {
-        String fail = "PAIR_FAIL:" + clientId;
-        mqttClient.publish(TOPIC_PAIR_STATUS, fail.c_str());
-        Serial.print("Pair verify failed for "); Serial.println(clientId);
-      }
+    }
+    String code;
+    if (!addPending(clientId, code)) {
+      mqttClient.publish(TOPIC_PAIR_STATUS, ("REQ_ERR:busy"));
       return;
-    } else if (msg.startsWith("UNP:")) {
-      String clientId = msg.substring(4);
-      clientId.trim();
-      if (removePairedClient(clientId)) {
-        String ok = "UNPAIR_OK:" + clientId;
+    }
+    // Show code on LCD so user can read and enter it on the web UI
+    lcdPrintBoth("Pair code:", code.c_str());
+    Serial.print("Pair code for "); Serial.print(clientId); Serial.print(" = "); Serial.println(code);
+    // Inform web that a challenge was generated (not secret: user must read LCD)
+    String out = "CHALLENGE:" + clientId + ":" + code; // optional, mostly for debugging
+    mqttClient.publish(TOPIC_PAIR_STATUS, out.c_str());
+    return;
+  } else if (viewStartsWith(msg, len, "CONF:")) {
+    // CONF:<clientId>:<code>
+    int first = viewIndexOf(msg, len, ':', 5); // find second colon after "CONF:"
+    if (first <= 5) { mqttClient.publish(TOPIC_PAIR_STATUS, "CONF_ERR:bad_format"); return; }
+    String clientId = viewToString(msg, 5, first);
+    String code = viewToString(msg, first + 1, len);
+    if (verifyPending(clientId, code)) {
+      if (addPairedClient(clientId)) {
+        String ok = "PAIR_OK:" + clientId;
         mqttClient.publish(TOPIC_PAIR_STATUS, ok.c_str());
-        Serial.print("Client unpaired: "); Serial.println(clientId);
-        lcdPrintBoth("Unpaired:", clientId.c_str());
+        Serial.print("Client paired: "); Serial.println(clientId);
+        lcdPrintBoth("Paired:", clientId.c_str());
       } else {
-        mqttClient.publish(TOPIC_PAIR_STATUS, ("UNPAIR_ERR:not_found"));
+        mqttClient.publish(TOPIC_PAIR_STATUS, ("PAIR_ERR:save_failed"));
       }
-      return;
     } else {
-      mqttClient.publish(TOPIC_PAIR_STATUS, ("PAIR_ERR:unknown_cmd"));
-      return;
+      String fail = "PAIR_FAIL:" + clientId;
+      mqttClient.publish(TOPIC_PAIR_STATUS, fail.c_str());
+      Serial.print("Pair verify failed for "); Serial.println(clientId);
+    }
+    return;
+  } else if (viewStartsWith(msg, len, "UNP:")) {
+    String clientId = viewToString(msg, 4, len);
+    if (removePairedClient(clientId)) {
+      String ok = "UNPAIR_OK:" + clientId;
+      mqttClient.publish(TOPIC_PAIR_STATUS, ok.c_str());
+      Serial.print("Client unpaired: "); Serial.println(clientId);
+      lcdPrintBoth("Unpaired:", clientId.c_str());
+    } else {
+      mqttClient.publish(TOPIC_PAIR_STATUS, ("UNPAIR_ERR:not_found"));
     }
+    return;
+  } else {
+    mqttClient.publish(TOPIC_PAIR_STATUS, ("PAIR_ERR:unknown_cmd"));
+    return;
   }
+}
 
-  // ---- Command topic ----
-  if (String(topic) == TOPIC_COMMAND) {
-    // Expect message format: CMD:<clientId>:<COMMAND>
-    // Example: CMD:web_ab12:OPEN
-    if (!msg.startsWith("CMD:")) {
-      mqttClient.publish(TOPIC_STATUS, "CMD_ERR:bad_format");
-      return;
+// ---- Command topic ----
+void onCommandMessage(const char* topic, uint16_t topicLen, const uint8_t* payload, uint32_t length) {
+  const char *msg = (const char *)payload;
+  uint32_t len = length;
+  logInbound(topic, topicLen, msg, len);
+
+  // Expect message format: CMD:<clientId>:<COMMAND>
+  // Example: CMD:web_ab12:OPEN
+  if (!viewStartsWith(msg, len, "CMD:")) {
+    mqttClient.publish(TOPIC_STATUS, "CMD_ERR:bad_format");
+    return;
+  }
+  int idx1 = viewIndexOf(msg, len, ':', 4);
+  if (idx1 <= 4) { mqttClient.publish(TOPIC_STATUS, "CMD_ERR:bad_format2"); return; }
+  String clientId = viewToString(msg, 4, idx1);
+  String command = viewToString(msg, idx1 + 1, len);
+  if (!isPairedClient(clientId)) {
+    mqttClient.publish(TOPIC_STATUS, ("CMD_REJECTED:not_paired:" + clientId).c_str());
+    Serial.print("Rejected CMD from non-paired client: "); Serial.println(clientId);
+    return;
+  }
+  Serial.print("Authorized CMD from "); Serial.print(clientId); Serial.print(" -> "); Serial.println(command);
+
+  // Handle commands (OPEN/LIST/CLEAR/REVOKE)
+  if (command.equalsIgnoreCase("OPEN")) {
+    lcdPrintBoth("MQTT","OPEN");
+    openLock();
+    publishEvent("remote_open","mqtt","", clientId.c_str());
+  } else if (command.equalsIgnoreCase("LIST")) {
+    uint16_t n = pairedCount();
+    String payload = "{\"cmd\":\"list\",\"count\":";
+    payload += String(pairedSet.count());
+    payload += ",\"users\":[";
+    bool first = true;
+    for (uint16_t i = 0; i < n; ++i) {
+      const char *entry = pairedSet.atSlot(i);
+      if (entry == NULL) continue;
+      if (!first) payload += ",";
+      first = false;
+      payload += "{\"i\":" + String(i) + ",\"clientId\":\"" + entry + "\"}";
     }
-    int idx1 = msg.indexOf(':', 4);
-    if (idx1 <= 4) { mqttClient.publish(TOPIC_STATUS, "CMD_ERR:bad_format2"); return; }
-    String clientId = msg.substring(4, idx1);
-    String command = msg.substring(idx1 + 1);
-    clientId.trim(); command.trim();
-    if (!isPairedClient(clientId)) {
-      mqttClient.publish(TOPIC_STATUS, ("CMD_REJECTED:not_paired:" + clientId).c_str());
-      Serial.print("Rejected CMD from non-paired client: "); Serial.println(clientId);
-      return;
+    payload += "]}";
+    mqttClient.publish(TOPIC_EVENT, payload.c_str());
+  } else if (command.equalsIgnoreCase("CLEAR")) {
+    // Only allow CLEAR if client is paired (already checked)
+    // Clear paired list + user DB
+    clearPairedClients();
+    clearAllUsers(); // reuse existing function to clear users
+    mqttClient.publish(TOPIC_EVENT, "{\"cmd\":\"cleared_via_mqtt\",\"result\":\"ok\"}");
+    lcdPrintBoth("Cleared", "All users");
+    Serial.println("Cleared paired and users via MQTT CLEAR");
+  } else if (command.startsWith("REVOKE:")) {
+    // REVOKE:RFID:<uid> or REVOKE:FP:<template id> - deletes that one user
+    if (!revokeUser(command.substring(7))) {
+      mqttClient.publish(TOPIC_STATUS, "CMD_ERR:revoke_not_found");
     }
-    Serial.print("Authorized CMD from "); Serial.print(clientId); Serial.print(" -> "); Serial.println(command);
-
-    // Handle commands (OPEN/LIST/CLEAR)
-    if (command.equalsIgnoreCase("OPEN")) {
-      lcdPrintBoth("MQTT","OPEN");
-      openLock();
-      publishEvent("remote_open","mqtt","", clientId.c_str());
-    } else if (command.equalsIgnoreCase("LIST")) {
-      uint16_t n = prefs.getUShort(PREF_PAIR_COUNT, 0);
-      String payload = "{\"cmd\":\"list\",\"count\":";
-      payload += String(n);
-      payload += ",\"users\":[";
-      for (uint16_t i = 0; i < n; ++i) {
-        if (i) payload += ",";
-        String entry = getPairedAt(i);
-        payload += "{\"i\":" + String(i) + ",\"clientId\":\"" + entry + "\"}";
+  } else {
+    mqttClient.publish(TOPIC_STATUS, "CMD_ERR:unknown");
+  }
+}
+
+// Users: USER_PAGES pages of USER_PAGE_RECORDS records (see User store).
+// A 720-byte page is a blob of 25 NVS entries, so the 64 pages fill about
+// 13 of the 4 KB NVS pages. With the outbox (5), paired clients (3) and the
+// session (1) that is more than the 20 KB default partition holds:
+// partitions.csv gives nvs 192 KB instead.
+const uint8_t USER_PAGE_RECORDS = 16;
+const uint16_t USER_PAGES = 64;
+const uint16_t MAX_USERS = USER_PAGE_RECORDS * USER_PAGES;
+
+// ----------------- RFID index -----------------
+// Card taps are looked up in a table in RAM keyed by the raw UID bytes, rather
+// than by walking every user in NVS. It is built from NVS in setup() and kept
+// up to date as cards are enrolled and revoked, so a tap costs one probe
+// whatever the number of badges, and no allocation.
+// Open addressing with linear probing. It holds a card for each of the
+// MAX_USERS users at most and is sized to the next power of two above 4/3 of
+// that, so it is never more than 3/4 full and probes stay short: for 1024
+// users, 2048 slots of 14 bytes, 28 KB. A removed card leaves a marker so the
+// probe for any card past it still gets there; add() reuses it. Once
+// RFID_INDEX_REMOVED_MAX markers pile up, compactWhenIdle() rehashes the table
+// so misses stop probing through them.
+const uint8_t UID_MAX = 10;
+constexpr uint16_t powerOfTwoAtLeast(uint32_t n, uint32_t p = 1) {
+  return p >= n ? p : powerOfTwoAtLeast(n, p * 2);
+}
+const uint16_t RFID_INDEX_SLOTS = powerOfTwoAtLeast((uint32_t)MAX_USERS * 4 / 3 + 1);
+const uint8_t RFID_INDEX_REMOVED = 0xFF;
+const uint16_t RFID_INDEX_REMOVED_MAX = MAX_USERS / 8;
+
+class RfidIndex {
+public:
+  void clear() {
+    for (uint16_t i = 0; i < RFID_INDEX_SLOTS; i++) slots[i].len = 0;
+    used = 0;
+    removed = 0;
+  }
+  // Maps uid to user, unless it is already mapped: like the scan it replaces,
+  // the first user enrolled with a card is the one found
+  bool add(const uint8_t *uid, uint8_t len, uint16_t user) {
+    if (len == 0 || len > UID_MAX) return false;
+    uint16_t i = hash(uid, len);
+    int32_t reuse = -1;
+    for (uint16_t probes = 0; probes < RFID_INDEX_SLOTS && slots[i].len != 0; probes++) {
+      if (slots[i].len == RFID_INDEX_REMOVED) {
+        if (reuse < 0) reuse = i;
+      } else if (matches(slots[i], uid, len)) {
+        return true;
       }
-      payload += "]}";
-      mqttClient.publish(TOPIC_EVENT, payload.c_str());
-    } else if (command.equalsIgnoreCase("CLEAR")) {
-      // Only allow CLEAR if client is paired (already checked)
-      // Clear paired list + user DB
-      uint16_t n = prefs.getUShort(PREF_PAIR_COUNT, 0);
-      for (uint16_t i = 0; i < n; ++i) {
-        prefs.remove(pairedKeyName(i).c_str());
+      i = next(i);
+    }
+    if (used >= MAX_USERS) return false;
+    if (reuse >= 0) {
+      i = reuse;
+      removed--;
+    } else if (slots[i].len != 0) {
+      return false;
+    }
+    slots[i].len = len;
+    memcpy(slots[i].uid, uid, len);
+    slots[i].user = user;
+    used++;
+    return true;
+  }
+  // The user enrolled with uid, or -1
+  int32_t find(const uint8_t *uid, uint8_t len) {
+    int32_t i = locate(uid, len);
+    return i < 0 ? -1 : slots[i].user;
+  }
+  bool remove(const uint8_t *uid, uint8_t len) {
+    int32_t i = locate(uid, len);
+    if (i < 0) return false;
+    // Nothing can have probed past i if the next slot is free
+    if (slots[next(i)].len == 0) {
+      slots[i].len = 0;
+    } else {
+      slots[i].len = RFID_INDEX_REMOVED;
+      removed++;
+    }
+    used--;
+    return true;
+  }
+  bool rehashDue() { return removed >= RFID_INDEX_REMOVED_MAX; }
+  // Drops the removed markers, then moves each entry reached through one of
+  // them back towards its hash until every entry has no free slot on its
+  // probe path. Each move shortens a path, so the passes end.
+  void rehash() {
+    for (uint16_t i = 0; i < RFID_INDEX_SLOTS; i++) {
+      if (slots[i].len == RFID_INDEX_REMOVED) slots[i].len = 0;
+    }
+    removed = 0;
+    bool moved = true;
+    while (moved) {
+      moved = false;
+      for (uint16_t k = 0; k < RFID_INDEX_SLOTS; k++) {
+        if (slots[k].len == 0) continue;
+        uint16_t i = hash(slots[k].uid, slots[k].len);
+        while (i != k && slots[i].len != 0) i = next(i);
+        if (i == k) continue;
+        slots[i] = slots[k];
+        slots[k].len = 0;
+        moved = true;
       }
-      setPairedCount(0);
-      clearAllUsers(); // reuse existing function to clear users
-      mqttClient.publish(TOPIC_EVENT, "{\"cmd\":\"cleared_via_mqtt\",\"result\":\"ok\"}");
-      lcdPrintBoth("Cleared", "All users");
-      Serial.println("Cleared paired and users via MQTT CLEAR");
+    }
+  }
+  bool full() { return used >= MAX_USERS; }
+  uint16_t count() { return used; }
+private:
+  struct Entry {
+    uint8_t len;             // 0: free, RFID_INDEX_REMOVED: removed
+    uint8_t uid[UID_MAX];
+    uint16_t user;
+  };
+  Entry slots[RFID_INDEX_SLOTS];
+  uint16_t used = 0;
+  uint16_t removed = 0;      // RFID_INDEX_REMOVED markers in slots
+  static uint16_t next(uint16_t i) { return (i + 1) & (RFID_INDEX_SLOTS - 1); }
+  int32_t locate(const uint8_t *uid, uint8_t len) {
+    if (len == 0 || len > UID_MAX) return -1;
+    uint16_t i = hash(uid, len);
+    for (uint16_t probes = 0; probes < RFID_INDEX_SLOTS && slots[i].len != 0; probes++) {
+      if (matches(slots[i], uid, len)) return i;
+      i = next(i);
+    }
+    return -1;
+  }
+  static bool matches(const Entry &e, const uint8_t *uid, uint8_t len) {
+    return e.len == len && memcmp(e.uid, uid, len) == 0;
+  }
+  static uint16_t hash(const uint8_t *uid, uint8_t len) {
+    uint32_t h = fnv1a(uid, len);
+    return (h ^ (h >> 16)) & (RFID_INDEX_SLOTS - 1);
+  }
+};
+
+RfidIndex rfidIndex;
+
+// Parses a key made by uidToKey() back into UID bytes. Returns the number of
+// bytes, or 0 if key is not a UID
+uint8_t keyToUid(const char *key, uint8_t *uid) {
+  size_t n = strlen(key);
+  if (n == 0 || n % 2 || n / 2 > UID_MAX) return 0;
+  for (size_t i = 0; i < n; i++) {
+    char c = key[i];
+    uint8_t v;
+    if (c >= '0' && c <= '9') v = c - '0';
+    else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+    else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+    else return 0;
+    if (i % 2) uid[i / 2] |= v;
+    else uid[i / 2] = v << 4;
+  }
+  return n / 2;
+}
+
+// ----------------- User store -----------------
+// Users are fixed-size binary records, USER_PAGE_RECORDS to an NVS blob
+// ("up0", "up1", ...), each page written whole with putBytes. Enrolling a user
+// is one write, loading them all at boot a few blob reads, and a record takes
+// far fewer NVS entries than the three strings per user it replaces.
+// "uhdr" -> UserStoreHeader, written when the store is created or migrated
+// from the old layout ("count" + "userN_type" / "userN_key" / "userN_name").
+// Records are appended in order: the first empty one ends the list. Deleting
+// a user overwrites its record with a tombstone, a single page write, and
+// compactStep() later moves the last record into the hole.
+const uint8_t USER_STORE_VERSION = 1;
+const uint8_t USER_NAME_MAX = 32;
+
+enum UserType : uint8_t { USER_EMPTY = 0, USER_RFID = 1, USER_FP = 2, USER_DELETED = 3 };
+
+struct UserRecord {
+  uint8_t type;               // UserType
+  uint8_t keyLen;
+  uint8_t key[UID_MAX];       // RFID: UID bytes, fingerprint: template id (big-endian)
+  uint8_t nameLen;
+  char name[USER_NAME_MAX];   // not NUL-terminated
+};
+
+struct UserStoreHeader {
+  uint8_t version;
+  uint8_t recordSize;
+  uint8_t pageRecords;
+};
+
+class UserStore {
+public:
+  // Counts the stored users, first creating the store or migrating the old
+  // layout if there is none
+  void begin() {
+    UserStoreHeader h;
+    if (prefs.getBytesLength("uhdr") != sizeof(h)) {
+      migrate();
     } else {
-      mqttClient.publish(TOPIC_STATUS, "CMD_ERR:unknown");
+      prefs.getBytes("uhdr", &h, sizeof(h));
+      if (h.version != USER_STORE_VERSION || h.recordSize != sizeof(UserRecord) ||
+          h.pageRecords != USER_PAGE_RECORDS) {
+        Serial.println("User store: unknown layout, starting empty");
+        clear();
+        writeHeader();
+      }
     }
-    return;
+    n = 0;
+    deleted = 0;
+    firstHole = MAX_USERS;
+    UserRecord r;
+    while (n < MAX_USERS && get(n, r) && r.type != USER_EMPTY) {
+      if (r.type == USER_DELETED) {
+        if (deleted++ == 0) firstHole = n;
+      }
+      n++;
+    }
+  }
+  // Users stored
+  uint16_t count() { return n - deleted; }
+  // Records in use, deleted ones included: indexes run from 0 to slots() - 1
+  uint16_t slots() { return n; }
+  uint16_t holes() { return deleted; }
+  // Appends r, returning its index in idx
+  bool add(const UserRecord &r, uint16_t &idx) {
+    if (n >= MAX_USERS || !place(n, r) || !flush()) return false;
+    idx = n++;
+    return true;
+  }
+  bool get(uint16_t idx, UserRecord &r) {
+    if (idx >= MAX_USERS || !load(idx / USER_PAGE_RECORDS)) return false;
+    r = page[idx % USER_PAGE_RECORDS];
+    return true;
+  }
+  // Overwrites the record at idx
+  bool put(uint16_t idx, const UserRecord &r) {
+    return idx < n && place(idx, r) && flush();
+  }
+  // Replaces the user at idx with a tombstone: one page write
+  bool remove(uint16_t idx) {
+    UserRecord r;
+    if (idx >= n || !get(idx, r) || r.type == USER_DELETED) return false;
+    memset(&r, 0, sizeof(r));
+    r.type = USER_DELETED;
+    if (!place(idx, r) || !flush()) return false;
+    deleted++;
+    if (idx < firstHole) firstHole = idx;
+    return true;
+  }
+  // One step of reclaiming tombstones, at most two page writes: trailing ones
+  // in the last page are dropped, or else the last record is moved into the
+  // first hole, from 'from' to 'to' (moved is set). Returns false when there
+  // is nothing to do
+  bool compactStep(bool &moved, uint16_t &from, uint16_t &to) {
+    moved = false;
+    if (deleted == 0) return false;
+    UserRecord last;
+    if (!get(n - 1, last)) return false;
+    UserRecord empty;
+    memset(&empty, 0, sizeof(empty));
+    if (last.type == USER_DELETED) {
+      uint16_t pageStart = (n - 1) / USER_PAGE_RECORDS * USER_PAGE_RECORDS;
+      uint16_t end = n;
+      while (end > pageStart && get(end - 1, last) && last.type == USER_DELETED) {
+        place(--end, empty);
+      }
+      if (!flush()) return false;
+      deleted -= n - end;
+      n = end;
+      if (deleted == 0) firstHole = MAX_USERS;
+      return true;
+    }
+    UserRecord r;
+    while (firstHole < n && get(firstHole, r) && r.type != USER_DELETED) firstHole++;
+    if (firstHole >= n) return false;
+    // A reset between the two writes leaves the user twice; buildUserIndexes()
+    // drops the second copy
+    if (!place(firstHole, last) || !flush()) return false;
+    if (!place(n - 1, empty) || !flush()) return false;
+    moved = true;
+    from = n - 1;
+    to = firstHole;
+    n--;
+    deleted--;
+    firstHole = deleted ? firstHole + 1 : MAX_USERS;
+    return true;
+  }
+  void clear() {
+    for (uint16_t p = 0; p < USER_PAGES; p++) {
+      if (prefs.isKey(key(p).c_str())) prefs.remove(key(p).c_str());
+    }
+    pageNo = -1;
+    dirty = false;
+    n = 0;
+    deleted = 0;
+    firstHole = MAX_USERS;
+  }
+  static bool makeUserRecord(UserRecord &r, uint8_t type, const uint8_t *key, uint8_t keyLen, const char *name) {
+    if (keyLen == 0 || keyLen > UID_MAX) return false;
+    memset(&r, 0, sizeof(r));
+    r.type = type;
+    r.keyLen = keyLen;
+    memcpy(r.key, key, keyLen);
+    setName(r, name);
+    return true;
+  }
+  static bool makeFingerRecord(UserRecord &r, long id, const char *name) {
+    if (id <= 0 || id > 0xFFFF) return false;
+    uint8_t key[2] = { (uint8_t)(id >> 8), (uint8_t)(id & 0xFF) };
+    return makeUserRecord(r, USER_FP, key, 2, name);
+  }
+  // Names longer than USER_NAME_MAX are cut short
+  static void setName(UserRecord &r, const char *name) {
+    size_t len = strlen(name);
+    r.nameLen = len > USER_NAME_MAX ? USER_NAME_MAX : len;
+    memcpy(r.name, name, r.nameLen);
+  }
+private:
+  UserRecord page[USER_PAGE_RECORDS];   // the last page read or written
+  int32_t pageNo = -1;
+  bool dirty = false;
+  uint16_t n = 0;
+  uint16_t deleted = 0;
+  uint16_t firstHole = MAX_USERS;      // no tombstone before it
+
+  String key(uint16_t p) { return "up" + String(p); }
+  bool load(uint16_t p) {
+    if (pageNo == (int32_t)p) return true;
+    if (!flush()) return false;
+    memset(page, 0, sizeof(page));
+    size_t len = prefs.getBytesLength(key(p).c_str());
+    // A missing page is an empty one
+    if (len == sizeof(page) && prefs.getBytes(key(p).c_str(), page, len) != len) return false;
+    pageNo = p;
+    return true;
+  }
+  bool place(uint16_t idx, const UserRecord &r) {
+    if (!load(idx / USER_PAGE_RECORDS)) return false;
+    page[idx % USER_PAGE_RECORDS] = r;
+    dirty = true;
+    return true;
+  }
+  bool flush() {
+    if (!dirty) return true;
+    if (prefs.putBytes(key(pageNo).c_str(), page, sizeof(page)) != sizeof(page)) {
+      // Forget the unsaved change
+      pageNo = -1;
+      dirty = false;
+      return false;
+    }
+    dirty = false;
+    return true;
   }
+  void writeHeader() {
+    UserStoreHeader h = { USER_STORE_VERSION, sizeof(UserRecord), USER_PAGE_RECORDS };
+    prefs.putBytes("uhdr", &h, sizeof(h));
+  }
+  // Copies the users kept as strings into pages, a page per write. The header
+  // is only written once they are all saved, so a migration cut short by a
+  // reset is started again at the next boot
+  void migrate() {
+    uint16_t old = prefs.getUInt("count", 0);
+    if (old > MAX_USERS) old = MAX_USERS;
+    uint16_t moved = 0;
+    for (uint16_t i = 0; i < old; ++i) {
+      String base = "user" + String(i) + "_";
+      String t = prefs.getString((base + "type").c_str(), "");
+      String k = prefs.getString((base + "key").c_str(), "");
+      String name = prefs.getString((base + "name").c_str(), "");
+      UserRecord r;
+      bool ok = false;
+      if (t == "rfid") {
+        uint8_t uid[UID_MAX];
+        uint8_t len = keyToUid(k.c_str(), uid);
+        ok = makeUserRecord(r, USER_RFID, uid, len, name.c_str());
+      } else if (t == "fp") {
+        ok = makeFingerRecord(r, k.toInt(), name.c_str());
+      }
+      if (!ok) {
+        Serial.print("User store: skipped user "); Serial.println(i);
+        continue;
+      }
+      place(moved++, r);
+    }
+    if (!flush()) {
+      Serial.println("User store: migration failed");
+      return;
+    }
+    writeHeader();
+    for (uint16_t i = 0; i < old; ++i) {
+      String base = "user" + String(i) + "_";
+      prefs.remove((base + "type").c_str());
+      prefs.remove((base + "key").c_str());
+      prefs.remove((base + "name").c_str());
+    }
+    prefs.remove("count");
+    if (old) {
+      Serial.print("User store: migrated "); Serial.print(moved); Serial.println(" users");
+    }
+  }
+};
+
+UserStore userStore;
+
+uint16_t fingerIdOf(const UserRecord &r) { return (r.key[0] << 8) | r.key[1]; }
+
+String userName(const UserRecord &r) { return String(r.name, r.nameLen); }
 
-  // Other topics: keep previous behavior (e.g. none)
+// Copies the name of r into name, USER_NAME_MAX + 1 bytes, as a C string
+void copyUserName(const UserRecord &r, char *name) {
+  memcpy(name, r.name, r.nameLen);
+  name[r.nameLen] = '\0';
 }
 
-// ----------------- Finding / clearing users (reuse) -----------------
+// The key as it appears in events and listings: the UID in hex or the template id
+String userKey(const UserRecord &r) {
+  if (r.type == USER_FP) return String(fingerIdOf(r));
+  return bytesToKey(r.key, r.keyLen);
+}
 
-uint16_t userCount() { return prefs.getUInt("count", 0); }
-void setUserCount(uint16_t v) { prefs.putUInt("count", v); }
+// ----------------- Fingerprint table -----------------
+// The sensor hands back a template id from a small dense range, so matches are
+// resolved through an array indexed by that id holding the user's index in
+// the store. Sized from the sensor's capacity in setup(), filled from the
+// store and kept up to date on enrollment.
+// Used when the sensor does not report its capacity
+const uint16_t FP_DEFAULT_CAPACITY = 200;
+
+class FingerTable {
+public:
+  bool begin(uint16_t capacity) {
+    free(users);
+    size = 0;
+    // Ids start at 1 on some sensors and 0 on others
+    users = (uint16_t*)calloc(capacity + 1, sizeof(uint16_t));
+    if (users == NULL) return false;
+    size = capacity + 1;
+    return true;
+  }
+  void clear() {
+    if (users) memset(users, 0, size * sizeof(uint16_t));
+  }
+  bool set(uint16_t id, uint16_t user) {
+    if (id >= size) return false;
+    users[id] = user + 1;
+    return true;
+  }
+  // The user enrolled with template id, or -1
+  int32_t find(uint16_t id) {
+    if (id >= size || users[id] == 0) return -1;
+    return users[id] - 1;
+  }
+  void remove(uint16_t id) {
+    if (id < size) users[id] = 0;
+  }
+private:
+  uint16_t *users = NULL;   // user index + 1, 0 if none
+  uint16_t size = 0;
+};
 
-void addUserRecordRaw(const char *type, const char *key, const char *name) {
-  uint16_t n = userCount();
-  String base = "user" + String(n) + "_";
-  prefs.putString((base + "type").c_str(), type);
-  prefs.putString((base + "key").c_str(), key);
-  prefs.putString((base + "name").c_str(), name);
-  setUserCount(n + 1);
+FingerTable fingerTable;
+
+// ----------------- Denied badges -----------------
+// An unknown card tapped again soon after being turned away (someone retrying
+// it, or a card left on the reader) is rejected without redrawing the LCD or
+// holding the loop for DISPLAY_MS, and its events are rate limited: at most
+// one "denied" event per card every DENIED_EVENT_MS, whose "count" says how
+// many taps it stands for. The most recently denied cards are kept in RAM,
+// each forgotten DENIED_HOLD_MS after its last tap.
+const uint8_t MAX_DENIED = 8;
+const unsigned long DENIED_HOLD_MS = 30000;
+const unsigned long DENIED_EVENT_MS = 10000;
+
+struct DeniedBadge {
+  uint8_t len;               // 0: free
+  uint8_t uid[UID_MAX];
+  unsigned long lastTap;
+  unsigned long lastEvent;
+  uint16_t unreported;       // taps since the last event
+};
+
+DeniedBadge denied[MAX_DENIED];
+
+void reportDenied(DeniedBadge &d, unsigned long now) {
+  if (d.unreported == 0) return;
+  publishEvent("denied", "rfid", bytesToKey(d.uid, d.len).c_str(), "", d.unreported);
+  d.unreported = 0;
+  d.lastEvent = now;
 }
 
-void updateUserNameAtIndex(uint16_t idx, const char *name) {
-  String base = "user" + String(idx) + "_";
-  prefs.putString((base + "name").c_str(), name);
+// The entry for a card denied within DENIED_HOLD_MS, or NULL
+DeniedBadge *findDenied(const uint8_t *uid, uint8_t len, unsigned long now) {
+  for (uint8_t i = 0; i < MAX_DENIED; ++i) {
+    DeniedBadge &d = denied[i];
+    if (d.len == len && now - d.lastTap < DENIED_HOLD_MS && memcmp(d.uid, uid, len) == 0) return &d;
+  }
+  return NULL;
 }
 
-String findUserByRFID(const String &key) {
-  uint16_t n = userCount();
+// Counts a repeated tap, reporting the taps so far once an event is due
+void tapDenied(DeniedBadge &d, unsigned long now) {
+  d.lastTap = now;
+  d.unreported++;
+  if (now - d.lastEvent >= DENIED_EVENT_MS) reportDenied(d, now);
+}
+
+// Remembers a card that has just been denied (and reported), in place of the
+// least recently tapped one
+void addDenied(const uint8_t *uid, uint8_t len, unsigned long now) {
+  if (len == 0 || len > UID_MAX) return;
+  uint8_t victim = 0;
+  for (uint8_t i = 0; i < MAX_DENIED; ++i) {
+    if (denied[i].len == 0) { victim = i; break; }
+    if (now - denied[i].lastTap > now - denied[victim].lastTap) victim = i;
+  }
+  DeniedBadge &d = denied[victim];
+  reportDenied(d, now);
+  d.len = len;
+  memcpy(d.uid, uid, len);
+  d.lastTap = now;
+  d.lastEvent = now;
+  d.unreported = 0;
+}
+
+// Sends the aggregated events that are due and forgets cards not seen lately
+void cleanupDenied() {
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < MAX_DENIED; ++i) {
+    DeniedBadge &d = denied[i];
+    if (d.len == 0) continue;
+    if (now - d.lastEvent >= DENIED_EVENT_MS) reportDenied(d, now);
+    if (now - d.lastTap >= DENIED_HOLD_MS) d.len = 0;
+  }
+}
+
+// ----------------- Finding / clearing users (reuse) -----------------
+
+uint16_t userCount() { return userStore.count(); }
+
+void indexUser(const UserRecord &r, uint16_t idx) {
+  bool ok = true;
+  if (r.type == USER_RFID) ok = rfidIndex.add(r.key, r.keyLen, idx);
+  else if (r.type == USER_FP) ok = fingerTable.set(fingerIdOf(r), idx);
+  if (!ok) {
+    Serial.print("Cannot index user "); Serial.println(idx);
+  }
+}
+
+// Fills the RFID index and fingerprint table from the user store
+void buildUserIndexes() {
+  rfidIndex.clear();
+  fingerTable.clear();
+  uint16_t n = userStore.slots();
+  UserRecord r;
   for (uint16_t i = 0; i < n; ++i) {
-    String base = "user" + String(i) + "_";
-    String t = prefs.getString((base + "type").c_str(), "");
-    if (t == "rfid") {
-      String k = prefs.getString((base + "key").c_str(), "");
-      if (k == key) return prefs.getString((base + "name").c_str(), "");
+    if (!userStore.get(i, r)) continue;
+    if ((r.type == USER_RFID && rfidIndex.find(r.key, r.keyLen) >= 0) ||
+        (r.type == USER_FP && fingerTable.find(fingerIdOf(r)) >= 0)) {
+      // A second copy, left by a compaction step cut short (or an old double
+      // enrollment): only the first one was ever found
+      Serial.print("Dropping duplicate user "); Serial.println(i);
+      userStore.remove(i);
+      continue;
     }
+    indexUser(r, i);
   }
-  return "";
+  Serial.print("RFID cards indexed: ");
+  Serial.println(rfidIndex.count());
 }
 
-String findUserByFP(uint16_t id) {
-  uint16_t n = userCount();
-  for (uint16_t i = 0; i < n; ++i) {
-    String base = "user" + String(i) + "_";
-    String t = prefs.getString((base + "type").c_str(), "");
-    if (t == "fp") {
-      String k = prefs.getString((base + "key").c_str(), "");
-      if (k == String(id)) {
-        return prefs.getString((base + "name").c_str(), "");
-      }
+// Reclaims one step's worth of deleted user records. Returns false once there
+// are none left
+bool compactUsersStep() {
+  bool moved;
+  uint16_t from, to;
+  if (!userStore.compactStep(moved, from, to)) return false;
+  UserRecord r;
+  if (moved && userStore.get(to, r)) {
+    if (r.type == USER_RFID) {
+      rfidIndex.remove(r.key, r.keyLen);
+      rfidIndex.add(r.key, r.keyLen, to);
+    } else if (r.type == USER_FP) {
+      fingerTable.set(fingerIdOf(r), to);
     }
   }
-  return "";
+  return true;
+}
+
+bool addUserRecord(const UserRecord &r, uint16_t &idx) {
+  // Room held by deleted users is reclaimed now rather than waiting for idle time
+  while (userStore.slots() >= MAX_USERS && compactUsersStep()) {}
+  if (!userStore.add(r, idx)) {
+    Serial.println("User store full or write failed");
+    return false;
+  }
+  indexUser(r, idx);
+  return true;
+}
+
+void updateUserNameAtIndex(uint16_t idx, const char *name) {
+  UserRecord r;
+  if (!userStore.get(idx, r)) return;
+  UserStore::setName(r, name);
+  userStore.put(idx, r);
+}
+
+// The store is only read once the card is known, for the name, which is
+// copied into name (USER_NAME_MAX + 1 bytes). Returns false for an unknown card
+bool findUserByRFID(const MFRC522::Uid &u, char *name) {
+  int32_t i = rfidIndex.find(u.uidByte, u.size);
+  UserRecord r;
+  name[0] = '\0';
+  if (i < 0 || !userStore.get(i, r)) return false;
+  copyUserName(r, name);
+  return true;
+}
+
+bool findUserByFP(uint16_t id, char *name) {
+  int32_t i = fingerTable.find(id);
+  UserRecord r;
+  name[0] = '\0';
+  if (i < 0 || !userStore.get(i, r)) return false;
+  copyUserName(r, name);
+  return true;
+}
+
+// Index of the user with key spec "RFID:<uid>" or "FP:<template id>", or -1
+int32_t findUserByKey(const String &spec) {
+  int sep = spec.indexOf(':');
+  if (sep <= 0) return -1;
+  String type = spec.substring(0, sep);
+  String key = spec.substring(sep + 1);
+  key.trim();
+  if (type.equalsIgnoreCase("RFID")) {
+    uint8_t uid[UID_MAX];
+    uint8_t len = keyToUid(key.c_str(), uid);
+    return rfidIndex.find(uid, len);
+  } else if (type.equalsIgnoreCase("FP")) {
+    long id = key.toInt();
+    if (id <= 0 || id > 0xFFFF) return -1;
+    return fingerTable.find(id);
+  }
+  return -1;
+}
+
+// Leaves a tombstone in place of the user at idx, and drops it from the
+// indexes (and its template from the sensor). r is set to the deleted user
+bool deleteUser(uint16_t idx, UserRecord &r) {
+  if (!userStore.get(idx, r) || (r.type != USER_RFID && r.type != USER_FP)) return false;
+  if (!userStore.remove(idx)) return false;
+  if (r.type == USER_RFID) {
+    rfidIndex.remove(r.key, r.keyLen);
+  } else {
+    fingerTable.remove(fingerIdOf(r));
+    if (finger.deleteModel(fingerIdOf(r)) != FINGERPRINT_OK) {
+      Serial.print("Could not delete template "); Serial.println(fingerIdOf(r));
+    }
+  }
+  return true;
+}
+
+// Deletes the user with key spec (see findUserByKey()) and reports it.
+// Returns false if there is no such user
+bool revokeUser(const String &spec) {
+  int32_t idx = findUserByKey(spec);
+  UserRecord r;
+  if (idx < 0 || !deleteUser(idx, r)) return false;
+  String name = userName(r);
+  Serial.print("User revoked: "); Serial.println(name);
+  publishEvent("revoked", r.type == USER_RFID ? "rfid" : "finger", userKey(r).c_str(), name.c_str());
+  return true;
 }
 
 void listUsers() {
-  uint16_t n = userCount();
+  uint16_t n = userStore.slots();
   Serial.print("Total users: ");
-  Serial.println(n);
+  Serial.println(userCount());
+  UserRecord r;
   for (uint16_t i = 0; i < n; ++i) {
-    String base = "user" + String(i) + "_";
-    String t = prefs.getString((base + "type").c_str(), "");
-    String k = prefs.getString((base + "key").c_str(), "");
-    String name = prefs.getString((base + "name").c_str(), "");
+    if (!userStore.get(i, r) || r.type == USER_DELETED) continue;
     Serial.print(i); Serial.print(": ");
-    Serial.print(t); Serial.print(" | ");
-    Serial.print(k); Serial.print(" | ");
-    Serial.println(name);
+    Serial.print(r.type == USER_RFID ? "rfid" : "fp"); Serial.print(" | ");
+    Serial.print(userKey(r)); Serial.print(" | ");
+    Serial.println(userName(r));
   }
 }
 
 void clearAllUsers() {
-  uint16_t n = userCount();
-  for (uint16_t i = 0; i < n; ++i) {
-    String base = "user" + String(i) + "_";
-    prefs.remove((base + "type").c_str());
-    prefs.remove((base + "key").c_str());
-    prefs.remove((base + "name").c_str());
-  }
-  prefs.putUInt("count", 0);
+  userStore.clear();
   prefs.putUInt("next_fp_id", 1);
+  rfidIndex.clear();
+  fingerTable.clear();
+}
+
+// ----------------- Compaction -----------------
+// Deleted users and unpaired clients are reclaimed a step at a time, and the
+// RAM tables rehashed, only once the door has been idle for COMPACT_IDLE_MS,
+// so the flash writes never hold up a tap
+const unsigned long COMPACT_IDLE_MS = 5000;
+const unsigned long COMPACT_STEP_MS = 1000;
+unsigned long lastActivity = 0;
+unsigned long lastCompactStep = 0;
+
+void compactWhenIdle() {
+  unsigned long now = millis();
+  if (now - lastActivity < COMPACT_IDLE_MS || now - lastCompactStep < COMPACT_STEP_MS) return;
+  lastCompactStep = now;
+  if (rfidIndex.rehashDue()) rfidIndex.rehash();
+  else if (!compactUsersStep()) compactPairedStep();
 }
 
 // ----------------- WiFi & MQTT connect -----------------
@@ -490,35 +1515,68 @@ void connectWiFi() {
   }
 }
 
-void reconnectMqtt() {
-  if (mqttClient.connected()) return;
+// The broker is given to mqttClient by address, so its retries from loop()
+// never wait on DNS. The lookup is done here and again after
+// MQTT_RESOLVE_FAILURES failed connects in a row, in case the address moved;
+// the domain is only used while it cannot be resolved.
+const uint8_t MQTT_RESOLVE_FAILURES = 5;
 
+void resolveBroker() {
   Serial.print("Resolving MQTT host ");
   Serial.println(MQTT_SERVER);
   IPAddress brokerIp;
   if (WiFi.hostByName(MQTT_SERVER, brokerIp)) {
     Serial.print("Resolved "); Serial.print(MQTT_SERVER); Serial.print(" -> "); Serial.println(brokerIp.toString());
+    mqttClient.setServer(brokerIp, MQTT_PORT);
   } else {
     Serial.print("DNS resolve failed for "); Serial.println(MQTT_SERVER);
+    mqttClient.setServer(MQTT_SERVER, MQTT_PORT);
   }
+}
 
-  Serial.print("Connecting MQTT...");
-  String clientId = "ESP32-" + WiFi.macAddress();
-  while (!mqttClient.connected()) {
-    bool ok;
-    if (MQTT_USER && strlen(MQTT_USER) > 0) {
-      ok = mqttClient.connect(clientId.c_str(), MQTT_USER, MQTT_PASS);
-    } else {
-      ok = mqttClient.connect(clientId.c_str());
-    }
-    if (ok) break;
-    Serial.print(".");
-    delay(2000);
+void startMqtt() {
+  resolveBroker();
+
+  // mqttClient.loop() connects a step at a time, and reconnects with a backoff,
+  // so the auth pipeline keeps running while the broker is unreachable
+  Serial.println("Connecting MQTT...");
+  // The client id has to stay the same for the broker to find our session
+  mqttClientId = "ESP32-" + WiFi.macAddress();
+  bool auth = MQTT_USER && strlen(MQTT_USER) > 0;
+  mqttClient.beginConnect(mqttClientId.c_str(), auth ? MQTT_USER : NULL, auth ? MQTT_PASS : NULL,
+                          NULL, 0, false, NULL, false);
+}
+
+// Call after mqttClient.loop(): looks the broker up again once
+// MQTT_RESOLVE_FAILURES more connects have failed
+void checkMqttFailures() {
+  uint16_t failures = mqttClient.getConnectFailures();
+  // The count starts again from 0 after each successful connect
+  if (failures < mqttResolvedAt) mqttResolvedAt = 0;
+  if (failures - mqttResolvedAt < MQTT_RESOLVE_FAILURES) return;
+  mqttResolvedAt = failures;
+  resolveBroker();
+}
+
+// Call after mqttClient.loop(): reacts to the connection coming up
+void checkMqttConnected() {
+  bool connected = mqttClient.connected();
+  if (connected == mqttWasConnected) return;
+  mqttWasConnected = connected;
+  if (!connected) {
+    Serial.print("MQTT disconnected, state ");
+    Serial.println(mqttClient.state());
+    return;
   }
-  Serial.println("");
   Serial.println("MQTT connected");
-  mqttClient.subscribe(TOPIC_COMMAND);
-  mqttClient.subscribe(TOPIC_PAIR);
+  if (!mqttSubscribed && !mqttClient.getSessionPresent()) {
+    // Both topics go out in one SUBSCRIBE; the client re-issues the set itself
+    // after every later reconnect that finds no session on the broker. QoS 2
+    // so that OPEN / CLEAR run exactly once even if the broker resends them
+    const char* topics[] = { TOPIC_COMMAND, TOPIC_PAIR };
+    uint8_t qos[] = { 2, 0 };
+    mqttSubscribed = mqttClient.subscribe(topics, qos, 2);
+  }
   publishStatus("connected");
 }
 
@@ -542,6 +1600,11 @@ String readLineSerial(unsigned long timeout = 30000) {
 }
 
 void enrollRFID() {
+  if (rfidIndex.full() || userCount() >= MAX_USERS) {
+    lcdPrintBoth("Enroll RFID", "Storage full");
+    Serial.println("ENROLL RFID: no room for another user");
+    return;
+  }
   lcdPrintBoth("Enroll RFID", "Scan card...");
   Serial.println(F("ENROLL RFID: Present card now"));
   unsigned long start = millis();
@@ -560,7 +1623,15 @@ void enrollRFID() {
         rfid.PICC_HaltA();
         return;
       }
-      addUserRecordRaw("rfid", uid.c_str(), name.c_str());
+      UserRecord r;
+      uint16_t idx;
+      if (!UserStore::makeUserRecord(r, USER_RFID, rfid.uid.uidByte, rfid.uid.size, name.c_str()) ||
+          !addUserRecord(r, idx)) {
+        lcdPrintBoth("Enroll failed", "save error");
+        delay(1500);
+        rfid.PICC_HaltA();
+        return;
+      }
       Serial.print("RFID enrolled: ");
       Serial.println(name);
       lcdPrintBoth("RFID enrolled:", name.c_str());
@@ -576,6 +1647,11 @@ void enrollRFID() {
 }
 
 bool enrollFingerprint() {
+  if (userCount() >= MAX_USERS) {
+    lcdPrintBoth("Enroll Finger", "Storage full");
+    Serial.println("ENROLL FINGER: no room for another user");
+    return false;
+  }
   lcdPrintBoth("Enroll Finger", "Place finger...");
   Serial.println(F("ENROLL FINGER: Follow prompts"));
   delay(300);
@@ -640,8 +1716,13 @@ bool enrollFingerprint() {
 
   if (storedId == 0) { lcdPrintBoth("Enroll failed", "no slot"); return false; }
 
-  uint16_t indexBefore = userCount();
-  addUserRecordRaw("fp", String(storedId).c_str(), ("FP_" + String(storedId)).c_str());
+  UserRecord r;
+  uint16_t indexBefore;
+  if (!UserStore::makeFingerRecord(r, storedId, ("FP_" + String(storedId)).c_str()) ||
+      !addUserRecord(r, indexBefore)) {
+    lcdPrintBoth("Enroll failed", "save error");
+    return false;
+  }
   lcdPrintBoth("Enrolled ID:", String(storedId).c_str());
   Serial.print("Stored template ID: ");
   Serial.println(storedId);
@@ -670,6 +1751,7 @@ void showHelp() {
   Serial.println(F(" listp  -> list paired clients"));
   Serial.println(F(" clear  -> clear all users (prefs)"));
   Serial.println(F(" delmod -> empty fingerprint database"));
+  Serial.println(F(" del RFID:<uid> | del FP:<id> -> delete one user"));
   Serial.println(F(" help   -> show commands"));
 }
 
@@ -694,6 +1776,9 @@ void setup() {
   delay(100);
 
   prefs.begin(PREF_NS, false);
+  outboxStorage.begin();
+  sessionStore.begin();
+  userStore.begin();
 
   initPending();
 
@@ -713,11 +1798,15 @@ void setup() {
   lockServo.write(SERVO_CLOSED_POS);
 
   bool fpok = finger.verifyPassword();
+  uint16_t fpCapacity = FP_DEFAULT_CAPACITY;
   if (fpok) {
     Serial.println("Fingerprint sensor OK");
+    if (finger.getParameters() == FINGERPRINT_OK && finger.capacity > 0) fpCapacity = finger.capacity;
   } else {
     Serial.println("Fingerprint sensor NOK");
   }
+  if (!fingerTable.begin(fpCapacity)) Serial.println("Fingerprint table: out of memory");
+  buildUserIndexes();
 
   Serial.println();
   Serial.println(F("\n--- AUTH SYSTEM READY ---"));
@@ -726,16 +1815,21 @@ void setup() {
   Serial.println(prefs.getUInt("next_fp_id", 1));
   Serial.print("Stored users count: ");
   Serial.println(userCount());
+  initPaired();
   Serial.print("Paired clients saved: ");
-  Serial.println(pairedCount());
+  Serial.println(pairedSet.count());
   listPairedClientsSerial();
 
   // WiFi & MQTT init
   connectWiFi();
-  mqttClient.setServer(MQTT_SERVER, MQTT_PORT);
-  mqttClient.setCallback(mqttCallback);
+  // Acks, status and event messages produced together leave in one TCP segment
+  mqttClient.setTxBuffer(512, 10);
+  // Messages left unacknowledged before a restart are resent once connected
+  mqttClient.setSessionStore(sessionStore);
+  mqttClient.addHandler(TOPIC_COMMAND, onCommandMessage);
+  mqttClient.addHandler(TOPIC_PAIR, onPairMessage);
 
-  reconnectMqtt();
+  startMqtt();
 
   lcdPrintBoth("Ready", "Scan...");
   delay(500);
@@ -746,13 +1840,19 @@ void setup() {
 void loop() {
   // housekeeping pending challenges
   cleanupPending();
+  cleanupDenied();
 
   if (WiFi.status() == WL_CONNECTED) {
-    if (!mqttClient.connected()) reconnectMqtt();
     mqttClient.loop();
+    checkMqttFailures();
+    checkMqttConnected();
+    publishQueue.drain(mqttClient);
+    // Drains queued events in small batches once connected
+    outbox.loop(mqttClient);
   } else {
     connectWiFi();
   }
+  sessionStore.persistWhenDue(mqttClient.connected());
 
   if (Serial.available()) {
     String cmd = Serial.readStringUntil('\n');
@@ -777,6 +1877,8 @@ void loop() {
       mqttClient.publish(TOPIC_EVENT, "{\"cmd\":\"cleared_via_serial\"}");
     } else if (cmd == "delmod") {
       emptyFingerprintLibrary();
+    } else if (cmd.startsWith("del ")) {
+      if (!revokeUser(cmd.substring(4))) Serial.println("No such user");
     } else {
       Serial.println("Unknown command. Type help");
     }
@@ -784,43 +1886,55 @@ void loop() {
 
   // RFID check
   if (rfid.PICC_IsNewCardPresent() && rfid.PICC_ReadCardSerial()) {
-    String uid = uidToKey(rfid.uid);
-    Serial.print("RFID detected: ");
-    Serial.println(uid);
-    String name = findUserByRFID(uid);
-    if (name.length()) {
-      Serial.print("Access granted: ");
-      Serial.println(name);
-      lcdPrintBoth("Access granted", name.c_str());
-      openLock();
-      publishEvent("granted","rfid", uid.c_str(), name.c_str());
+    unsigned long now = millis();
+    lastActivity = now;
+    char name[USER_NAME_MAX + 1];
+    bool known = findUserByRFID(rfid.uid, name);
+    DeniedBadge *d = known ? NULL : findDenied(rfid.uid.uidByte, rfid.uid.size, now);
+    if (d) {
+      // Turned away moments ago: only counted
+      tapDenied(*d, now);
+      rfid.PICC_HaltA();
     } else {
-      Serial.print("Access denied UID: ");
+      String uid = uidToKey(rfid.uid);
+      Serial.print("RFID detected: ");
       Serial.println(uid);
-      lcdPrintBoth("Access denied", uid.c_str());
-      publishEvent("denied","rfid", uid.c_str(), "");
+      if (known) {
+        Serial.print("Access granted: ");
+        Serial.println(name);
+        lcdPrintBoth("Access granted", name);
+        openLock();
+        publishEvent("granted","rfid", uid.c_str(), name);
+      } else {
+        Serial.print("Access denied UID: ");
+        Serial.println(uid);
+        lcdPrintBoth("Access denied", uid.c_str());
+        publishEvent("denied","rfid", uid.c_str(), "");
+        addDenied(rfid.uid.uidByte, rfid.uid.size, now);
+      }
+      rfid.PICC_HaltA();
+      delay(DISPLAY_MS);
+      lcdPrintBoth("Ready", "Scan...");
     }
-    rfid.PICC_HaltA();
-    delay(DISPLAY_MS);
-    lcdPrintBoth("Ready", "Scan...");
   }
 
   // Fingerprint check
   int p = finger.getImage();
   if (p == FINGERPRINT_OK) {
+    lastActivity = millis();
     if (finger.image2Tz(1) == FINGERPRINT_OK) {
         int res = finger.fingerSearch();
         if (res == FINGERPRINT_OK) {
           uint16_t id = finger.fingerID;
           Serial.print("Fingerprint found ID: ");
           Serial.println(id);
-          String name = findUserByFP(id);
-          if (name.length()) {
+          char name[USER_NAME_MAX + 1];
+          if (findUserByFP(id, name)) {
             Serial.print("Access granted: ");
             Serial.println(name);
-            lcdPrintBoth("Access granted", name.c_str());
+            lcdPrintBoth("Access granted", name);
             openLock();
-            publishEvent("granted","finger", String(id).c_str(), name.c_str());
+            publishEvent("granted","finger", String(id).c_str(), name);
           } else {
             Serial.print("Access denied FP ID ");
             Serial.println(id);
@@ -837,5 +1951,6 @@ void loop() {
       Serial.println("img2tz failed");
     }
   }
+  compactWhenIdle();
   delay(200);
 }